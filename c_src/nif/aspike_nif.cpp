@@ -6,6 +6,11 @@
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
 
 #include <aerospike/aerospike.h>
 #include <aerospike/aerospike_info.h>
@@ -29,6 +34,14 @@
 #include <aerospike/as_batch.h>
 #include <aerospike/aerospike_batch.h>
 #include <aerospike/as_arraylist.h>
+#include <aerospike/as_event.h>
+
+#include "cache.h"
+#include "coalesce.h"
+#include "counters.h"
+#include "flight.h"
+#include "negcache.h"
+#include "stats.h"
 
 
 // ----------------------------------------------------------------------------
@@ -39,6 +52,9 @@
 #define MAX_SET_SIZE 64			// based on current server limit
 #define AS_BIN_NAME_MAX_SIZE 16
 #define MAX_BINS_NUMBER 1024
+#define MAX_ATOM_SIZE 32         // policy option atoms
+#define EVENT_LOOPS_NUMBER 2     // libev loops owned by the NIF for *_async calls
+#define RESOURCE_BINARY_MIN_SIZE 1024   // bytes/string values from this size are not copied
 
 #define USE_DIRTY 1
 #ifdef USE_DIRTY
@@ -47,16 +63,116 @@
 #define NIF_FUN(A, B, C) {A, B, C}
 #endif
 
+// Latency histograms per operation and phase, see stats.cpp
+#define USE_STATS 1
+#ifdef USE_STATS
+#define STATS_START(OP) const int stats_op = OP; uint64_t stats_t0 = stats_now();
+#define STATS_PHASE(PHASE) {\
+        uint64_t stats_t1 = stats_now();\
+        stats_record(stats_op, PHASE, stats_t1 - stats_t0);\
+        stats_t0 = stats_t1;\
+    }
+// async: the call phase lasts from the submit to the listener
+#define STATS_SUSPEND(DATA) (DATA)->stats_op = stats_op; (DATA)->stats_t0 = stats_t0;
+#define STATS_RESUME(DATA) const int stats_op = (DATA)->stats_op; uint64_t stats_t0 = (DATA)->stats_t0;\
+    STATS_PHASE(STATS_CALL)
+#else
+#define STATS_START(OP)
+#define STATS_PHASE(PHASE)
+#define STATS_SUSPEND(DATA)
+#define STATS_RESUME(DATA)
+#endif
+
+enum {
+    STATS_BINARY_GET,
+    STATS_CDT_GET,
+    STATS_BINARY_PUT,
+    STATS_CDT_PUT,
+    STATS_BINARY_GET_MANY,
+    STATS_CDT_GET_MANY,
+    STATS_BINARY_PUT_MANY,
+    STATS_CDT_PUT_MANY,
+    STATS_BINARY_GET_ASYNC,
+    STATS_CDT_GET_ASYNC,
+    STATS_BINARY_PUT_ASYNC,
+    STATS_CDT_PUT_ASYNC,
+    STATS_CDT_CHECK_AND_PUT,
+    STATS_CDT_GET_LIVE,
+    STATS_CDT_GET_SUBKEYS,
+    STATS_OPS_NUMBER
+};
+
+static const char* const stats_op_names[STATS_OPS_NUMBER] = {
+    "binary_get",
+    "cdt_get",
+    "binary_put",
+    "cdt_put",
+    "binary_get_many",
+    "cdt_get_many",
+    "binary_put_many",
+    "cdt_put_many",
+    "binary_get_async",
+    "cdt_get_async",
+    "binary_put_async",
+    "cdt_put_async",
+    "cdt_check_and_put",
+    "cdt_get_live",
+    "cdt_get_subkeys"
+};
+
 // ----------------------------------------------------------------------------
 
-static aerospike as;
-static bool is_aerospike_initialised = false;
-static bool is_connected = false;
 static ERL_NIF_TERM erl_error;
 static ERL_NIF_TERM erl_ok;
+static ERL_NIF_TERM erl_aspike;
+static bool has_event_loops = false;
 
 // ----------------------------------------------------------------------------
 
+// Cluster handle, every operation gets it as the first argument.
+// Each handle has its own as_config, connection pools and tend thread.
+typedef struct {
+    aerospike *as;
+    bool is_aerospike_initialised;
+    bool is_connected;
+    uint64_t id;                // unique per as_init/1, a freed handle's address is reused
+} aspike_cluster;
+
+static std::atomic<uint64_t> next_cluster_id(1);
+
+static ErlNifResourceType* cluster_rt = NULL;
+
+// Keeps a record returned by the client alive while Erlang binaries
+// made with enif_make_resource_binary() point into its bin values.
+typedef struct {
+    as_record *rec;
+} record_holder;
+
+static ErlNifResourceType* record_rt = NULL;
+
+// Policy made once by policy_new/2 and shared by any number of calls,
+// the client only reads it.
+typedef enum {
+    POLICY_READ,
+    POLICY_WRITE,
+    POLICY_OPERATE,
+    POLICY_BATCH,
+    POLICY_REMOVE
+} policy_type;
+
+typedef struct {
+    policy_type type;
+    union {
+        as_policy_read read;
+        as_policy_write write;
+        as_policy_operate operate;
+        as_policy_batch batch;
+        as_policy_remove remove;
+    } p;
+} aspike_policy;
+
+static ErlNifResourceType* policy_rt = NULL;
+
 typedef struct {
     ErlNifEnv* env;
     uint32_t count;
@@ -66,14 +182,15 @@ typedef struct {
 // ----------------------------------------------------------------------------
 
 #define CHECK_AEROSPIKE_INIT \
-    if (!is_aerospike_initialised) {\
+    aspike_cluster* handle = NULL;\
+    if (!enif_get_resource(env, argv[0], cluster_rt, (void**)&handle) || !handle->is_aerospike_initialised) {\
         return enif_make_tuple2(env,\
             enif_make_atom(env, "error"),\
             enif_make_string(env, "aerospike not initialised", ERL_NIF_UTF8));\
     }
 
 #define CHECK_IS_CONNECTED \
-    if (!is_connected) {\
+    if (!handle->is_connected) {\
         return enif_make_tuple2(env,\
             enif_make_atom(env, "error"),\
             enif_make_string(env, "not connected", ERL_NIF_UTF8));\
@@ -87,35 +204,216 @@ typedef struct {
 
 // ----------------------------------------------------------------------------
 
-static ERL_NIF_TERM as_init(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static void cluster_dtor(ErlNifEnv* env, void* obj)
+{
+    aspike_cluster* handle = (aspike_cluster*)obj;
+    if (!handle->is_aerospike_initialised) {
+        return;
+    }
+    aerospike* as = handle->as;
+    // the last reference may be dropped on an event loop thread (async listener),
+    // aerospike_close() waits for the event loops, so it runs on its own thread
+    std::thread([as]() {
+        as_error err;
+        aerospike_close(as, &err);
+        aerospike_destroy(as);
+    }).detach();
+}
+
+static void record_dtor(ErlNifEnv* env, void* obj)
 {
-    if (!is_aerospike_initialised) {
-        as_config config;
-        as_config_init(&config);
-        aerospike_init(&as, &config);
-        is_aerospike_initialised = true;
+    record_holder* holder = (record_holder*)obj;
+    if (holder->rec != NULL) {
+        as_record_destroy(holder->rec);
     }
+}
+
+static record_holder* record_holder_new(as_record* p_rec)
+{
+    record_holder* holder = (record_holder*)enif_alloc_resource(record_rt, sizeof(record_holder));
+    holder->rec = p_rec;
+    return holder;
+}
+
+// key_inc aggregation, see counters_configure(); the interval is handed to the next library
+// by upgrade()
+static std::atomic<uint32_t> counters_interval(0);
+static void counters_configure(uint32_t interval);
+static bool counters_flush(std::string* error);
+static void coalesce_write(put_batch* b);
+static void coalesce_target_free(void* target);
+
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
+{
     erl_error = enif_make_atom(env, "error");
     erl_ok = enif_make_atom(env, "ok");
-    ERL_NIF_TERM msg = enif_make_string(env, "initialised", ERL_NIF_UTF8);
-    return enif_make_tuple2(env, erl_ok, msg);
+    erl_aspike = enif_make_atom(env, "aspike");
+    stats_init(stats_op_names, STATS_OPS_NUMBER);
+    flight_init(env);
+    coalesce_init(coalesce_write, coalesce_target_free);
+    cluster_rt = enif_open_resource_type(env, NULL, "aspike_cluster", cluster_dtor,
+        (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), NULL);
+    record_rt = enif_open_resource_type(env, NULL, "aspike_record", record_dtor,
+        (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), NULL);
+    policy_rt = enif_open_resource_type(env, NULL, "aspike_policy", NULL,
+        (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), NULL);
+    *priv_data = &counters_interval;
+    return (cluster_rt == NULL || record_rt == NULL || policy_rt == NULL) ? -1 : 0;
+}
+
+// The key_inc flush thread of the old library keeps writing what was aggregated there until
+// the old code is purged and unload() stops it; new key_inc calls aggregate in this library
+// with the same interval.
+static int upgrade(ErlNifEnv* env, void** priv_data, void** old_priv_data, ERL_NIF_TERM load_info)
+{
+    if (load(env, priv_data, load_info) != 0) {
+        return -1;
+    }
+    uint32_t interval = 0;
+    if (old_priv_data != NULL && *old_priv_data != NULL) {
+        interval = ((std::atomic<uint32_t>*)*old_priv_data)->load(std::memory_order_relaxed);
+    }
+    if (interval > 0) {
+        counters_configure(interval);
+    }
+    return 0;
+}
+
+// stops the coalescing and key_inc flush threads and writes what is left, a joinable thread
+// must not outlive the library
+static void unload(ErlNifEnv* env, void* priv_data)
+{
+    coalesce_configure(0, 64);
+    counters_configure(0);
+    std::string error;
+    counters_flush(&error);
+}
+
+// cdt_get cache and negative cache key: cluster id, namespace and record digest
+static std::string cache_key(aspike_cluster* handle, as_key* key)
+{
+    std::string res((const char*)&handle->id, sizeof(handle->id));
+    res.append(key->ns);
+    res.push_back('\0');
+    res.append((const char*)as_key_digest(key)->value, AS_DIGEST_VALUE_SIZE);
+    return res;
+}
+
+// the caches and the single-flight table are all keyed by cache_key()
+static bool any_cache_enabled()
+{
+    return cache_enabled() || negcache_enabled() || flight_enabled();
+}
+
+static void cache_drop_key(const std::string& ckey)
+{
+    if (cache_enabled()) {
+        cache_invalidate(ckey);
+    }
+    if (negcache_enabled()) {
+        negcache_clear(ckey);
+    }
+    if (flight_enabled()) {
+        flight_detach(ckey);
+    }
+}
+
+// every write to a record through the NIF drops its cdt_get cache entry and
+// its negative cache slots, after the write, so that a read in flight does
+// not put the old value back, and later reads do not join a flight sent before
+static void cache_drop(aspike_cluster* handle, as_key* key)
+{
+    if (any_cache_enabled()) {
+        cache_drop_key(cache_key(handle, key));
+    }
+}
+
+// a sync read that led a flight hands its result to the joined readers
+static ERL_NIF_TERM flight_reply(flight* fl, ErlNifEnv* env, ERL_NIF_TERM result)
+{
+    if (fl != NULL) {
+        flight_leave(fl, env, result);
+    }
+    return result;
+}
+
+// answer of a read found in the negative cache, the same as the client's
+static ERL_NIF_TERM not_found_error(ErlNifEnv* env)
+{
+    return enif_make_tuple2(env, erl_error,
+        enif_make_string(env, as_error_string(AEROSPIKE_ERR_RECORD_NOT_FOUND), ERL_NIF_UTF8));
+}
+
+static bool get_config_uint(ErlNifEnv* env, ERL_NIF_TERM map, const char* name, uint32_t* value)
+{
+    ERL_NIF_TERM term;
+    unsigned int v;
+    if (!enif_get_map_value(env, map, enif_make_atom(env, name), &term)) {
+        return true;
+    }
+    if (!enif_get_uint(env, term, &v)) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+// as_init(#{max_conns_per_node => N, ...}) -> {ok, Cluster}
+static ERL_NIF_TERM as_init(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (!enif_is_map(env, argv[0])) {
+        return enif_make_badarg(env);
+    }
+    as_config config;
+    as_config_init(&config);
+    if (!get_config_uint(env, argv[0], "min_conns_per_node", &config.min_conns_per_node)
+        || !get_config_uint(env, argv[0], "max_conns_per_node", &config.max_conns_per_node)
+        || !get_config_uint(env, argv[0], "async_min_conns_per_node", &config.async_min_conns_per_node)
+        || !get_config_uint(env, argv[0], "async_max_conns_per_node", &config.async_max_conns_per_node)
+        || !get_config_uint(env, argv[0], "conn_pools_per_node", &config.conn_pools_per_node)
+        || !get_config_uint(env, argv[0], "conn_timeout_ms", &config.conn_timeout_ms)
+        || !get_config_uint(env, argv[0], "login_timeout_ms", &config.login_timeout_ms)
+        || !get_config_uint(env, argv[0], "max_socket_idle", &config.max_socket_idle)
+        || !get_config_uint(env, argv[0], "tender_interval", &config.tender_interval)
+        || !get_config_uint(env, argv[0], "thread_pool_size", &config.thread_pool_size)) {
+        return enif_make_badarg(env);
+    }
+
+    if (!has_event_loops) {
+        // event loops have to exist before aerospike_connect() builds the async connection pools,
+        // they are shared by all cluster handles
+        if (as_event_create_loops(EVENT_LOOPS_NUMBER) == NULL) {
+            return enif_make_tuple2(env, erl_error,
+                enif_make_string(env, "failed to create event loops", ERL_NIF_UTF8));
+        }
+        has_event_loops = true;
+    }
+
+    aspike_cluster* handle = (aspike_cluster*)enif_alloc_resource(cluster_rt, sizeof(aspike_cluster));
+    handle->as = aerospike_new(&config);
+    handle->is_aerospike_initialised = true;
+    handle->is_connected = false;
+    handle->id = next_cluster_id.fetch_add(1, std::memory_order_relaxed);
+    ERL_NIF_TERM res = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+    return enif_make_tuple2(env, erl_ok, res);
 }
 
 static ERL_NIF_TERM host_add(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     char host[MAX_HOST_SIZE];
     int port;
-    if (!enif_get_string(env, argv[0], host, MAX_HOST_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], host, MAX_HOST_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_int(env, argv[1], &port)) {
+    if (!enif_get_int(env, argv[2], &port)) {
 	    return enif_make_badarg(env);
     }
     CHECK_INIT
 
     ERL_NIF_TERM rc, msg;
 
-    if (! as_config_add_hosts(&as.config, host, port)) {
+    if (! as_config_add_hosts(&handle->as->config, host, port)) {
         rc = erl_error;
         msg = enif_make_string(env, "failed to add host and port", ERL_NIF_UTF8);
     } else {
@@ -129,7 +427,7 @@ static ERL_NIF_TERM host_add(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]
 static ERL_NIF_TERM host_clear(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     CHECK_INIT
-    as_config_clear_hosts(&as.config);
+    as_config_clear_hosts(&handle->as->config);
     ERL_NIF_TERM rc = erl_ok;
     ERL_NIF_TERM msg = enif_make_string(env, "hosts list was cleared", ERL_NIF_UTF8);
     return enif_make_tuple2(env, rc, msg);
@@ -138,7 +436,7 @@ static ERL_NIF_TERM host_clear(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 static ERL_NIF_TERM host_list(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     CHECK_INIT
-    as_config  *config = &as.config;   
+    as_config  *config = &handle->as->config;   
     as_vector  *hosts = config->hosts;
     uint32_t size = (hosts == NULL) ? 0 : hosts->size;
 
@@ -162,159 +460,600 @@ static ERL_NIF_TERM connect(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     char user[AS_USER_SIZE];
     char password[AS_PASSWORD_SIZE];
 
-    if (!enif_get_string(env, argv[0], user, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], user, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], password, AS_PASSWORD_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], password, AS_PASSWORD_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
     CHECK_AEROSPIKE_INIT
 
     ERL_NIF_TERM rc, msg;
-    as_config_set_user(&as.config, user, password);
+    as_config_set_user(&handle->as->config, user, password);
 	as_error err;
 
-    if (aerospike_connect(&as, &err) != AEROSPIKE_OK) {
+    if (aerospike_connect(handle->as, &err) != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-        is_connected = false;
+        handle->is_connected = false;
     } else {
         rc = erl_ok;
         msg = enif_make_string(env, "connected", ERL_NIF_UTF8);
-        is_connected = true;
+        handle->is_connected = true;
     }
 
     return enif_make_tuple2(env, rc, msg);
 }
 
-static ERL_NIF_TERM binary_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// {max_retries, sleep_between_retries, socket_timeout, total_timeout}
+static bool get_policy_base(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_base* base)
 {
-    ErlNifBinary bin_ns, bin_set, bin_key;
-    unsigned int length;
-    std::string name_space, aspk_set, aspk_key;
-    long ttl;
+    const ERL_NIF_TERM* policy = NULL;
+    int policy_length;
+    long max_retries = 0;
+    long sleep_between_retries = 0;
+    long socket_timeout = 30000;
+    long total_timeout = 1000;
+    if(!enif_get_tuple(env, term, &policy_length, &policy) || policy_length != 4){
+        return false;
+    }
+    enif_get_long(env, policy[0], &max_retries);
+    enif_get_long(env, policy[1], &sleep_between_retries);
+    enif_get_long(env, policy[2], &socket_timeout);
+    enif_get_long(env, policy[3], &total_timeout);
 
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
-	    return enif_make_badarg(env);
+    base->max_retries = max_retries;
+    base->sleep_between_retries = sleep_between_retries;
+    base->socket_timeout = socket_timeout;
+    base->total_timeout = total_timeout;
+    return true;
+}
+
+// Policy argument is either default (*policy = NULL, the cluster's defaults), a policy resource
+// of the right type (used as is) or a {MaxRetries, SleepBetweenRetries, SocketTimeout, TotalTimeout}
+// tuple unpacked into p. false for anything else.
+static bool is_default_policy(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    char atom[MAX_ATOM_SIZE];
+    return enif_get_atom(env, term, atom, MAX_ATOM_SIZE, ERL_NIF_LATIN1) && strcmp(atom, "default") == 0;
+}
+
+static bool get_read_policy(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_read* p, const as_policy_read** policy)
+{
+    aspike_policy* resource = NULL;
+    if (is_default_policy(env, term)) {
+        *policy = NULL;
+        return true;
+    }
+    if (enif_get_resource(env, term, policy_rt, (void**)&resource)) {
+        *policy = &resource->p.read;
+        return resource->type == POLICY_READ;
+    }
+    as_policy_read_init(p);
+    *policy = p;
+    return get_policy_base(env, term, &p->base);
+}
+
+static bool get_write_policy(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_write* p, const as_policy_write** policy)
+{
+    aspike_policy* resource = NULL;
+    if (is_default_policy(env, term)) {
+        *policy = NULL;
+        return true;
+    }
+    if (enif_get_resource(env, term, policy_rt, (void**)&resource)) {
+        *policy = &resource->p.write;
+        return resource->type == POLICY_WRITE;
+    }
+    as_policy_write_init(p);
+    *policy = p;
+    return get_policy_base(env, term, &p->base);
+}
+
+static bool get_operate_policy(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_operate* p, const as_policy_operate** policy)
+{
+    aspike_policy* resource = NULL;
+    if (is_default_policy(env, term)) {
+        *policy = NULL;
+        return true;
+    }
+    if (enif_get_resource(env, term, policy_rt, (void**)&resource)) {
+        *policy = &resource->p.operate;
+        return resource->type == POLICY_OPERATE;
+    }
+    as_policy_operate_init(p);
+    *policy = p;
+    return get_policy_base(env, term, &p->base);
+}
+
+static bool get_batch_policy(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_batch* p, const as_policy_batch** policy)
+{
+    aspike_policy* resource = NULL;
+    if (is_default_policy(env, term)) {
+        *policy = NULL;
+        return true;
+    }
+    if (enif_get_resource(env, term, policy_rt, (void**)&resource)) {
+        *policy = &resource->p.batch;
+        return resource->type == POLICY_BATCH;
+    }
+    as_policy_batch_init(p);
+    *policy = p;
+    return get_policy_base(env, term, &p->base);
+}
+
+static bool get_remove_policy(ErlNifEnv* env, ERL_NIF_TERM term, as_policy_remove* p, const as_policy_remove** policy)
+{
+    aspike_policy* resource = NULL;
+    if (is_default_policy(env, term)) {
+        *policy = NULL;
+        return true;
+    }
+    if (enif_get_resource(env, term, policy_rt, (void**)&resource)) {
+        *policy = &resource->p.remove;
+        return resource->type == POLICY_REMOVE;
+    }
+    as_policy_remove_init(p);
+    *policy = p;
+    return get_policy_base(env, term, &p->base);
+}
+
+// Atom option of the map, *value is left as is when the key is missing;
+// false for an unknown atom or an option the policy type does not have (value == NULL).
+static bool get_config_enum(ErlNifEnv* env, ERL_NIF_TERM map, const char* name,
+    const char* const atoms[], const int values[], int count, int* value)
+{
+    ERL_NIF_TERM term;
+    char atom[MAX_ATOM_SIZE];
+    if (!enif_get_map_value(env, map, enif_make_atom(env, name), &term)) {
+        return true;
     }
-    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+    if (value == NULL || !enif_get_atom(env, term, atom, MAX_ATOM_SIZE, ERL_NIF_LATIN1)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(atom, atoms[i]) == 0) {
+            *value = values[i];
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
-	    return enif_make_badarg(env);
+static bool get_config_bool(ErlNifEnv* env, ERL_NIF_TERM map, const char* name, bool* value)
+{
+    static const char* const atoms[] = {"true", "false"};
+    static const int values[] = {1, 0};
+    int v = value != NULL ? *value : 0;
+    if (!get_config_enum(env, map, name, atoms, values, 2, value != NULL ? &v : NULL)) {
+        return false;
     }
-    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+    if (value != NULL) {
+        *value = v;
+    }
+    return true;
+}
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
-	    return enif_make_badarg(env);
+static bool get_policy_options(ErlNifEnv* env, ERL_NIF_TERM map, as_policy_base* base,
+    as_policy_replica* replica, as_policy_read_mode_ap* read_mode_ap,
+    as_policy_commit_level* commit_level, bool* durable_delete)
+{
+    static const char* const replica_atoms[] = {"master", "any", "sequence", "prefer_rack"};
+    static const int replica_values[] = {AS_POLICY_REPLICA_MASTER, AS_POLICY_REPLICA_ANY,
+        AS_POLICY_REPLICA_SEQUENCE, AS_POLICY_REPLICA_PREFER_RACK};
+    static const char* const read_mode_atoms[] = {"one", "all"};
+    static const int read_mode_values[] = {AS_POLICY_READ_MODE_AP_ONE, AS_POLICY_READ_MODE_AP_ALL};
+    static const char* const commit_level_atoms[] = {"all", "master"};
+    static const int commit_level_values[] = {AS_POLICY_COMMIT_LEVEL_ALL, AS_POLICY_COMMIT_LEVEL_MASTER};
+
+    int v_replica = replica != NULL ? (int)*replica : 0;
+    int v_read_mode = read_mode_ap != NULL ? (int)*read_mode_ap : 0;
+    int v_commit_level = commit_level != NULL ? (int)*commit_level : 0;
+
+    if (!get_config_uint(env, map, "max_retries", &base->max_retries)
+        || !get_config_uint(env, map, "sleep_between_retries", &base->sleep_between_retries)
+        || !get_config_uint(env, map, "socket_timeout", &base->socket_timeout)
+        || !get_config_uint(env, map, "total_timeout", &base->total_timeout)
+        || !get_config_bool(env, map, "compress", &base->compress)
+        || !get_config_enum(env, map, "replica", replica_atoms, replica_values, 4,
+            replica != NULL ? &v_replica : NULL)
+        || !get_config_enum(env, map, "read_mode_ap", read_mode_atoms, read_mode_values, 2,
+            read_mode_ap != NULL ? &v_read_mode : NULL)
+        || !get_config_enum(env, map, "commit_level", commit_level_atoms, commit_level_values, 2,
+            commit_level != NULL ? &v_commit_level : NULL)
+        || !get_config_bool(env, map, "durable_delete", durable_delete)) {
+        return false;
     }
-    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+    if (replica != NULL) {
+        *replica = (as_policy_replica)v_replica;
+    }
+    if (read_mode_ap != NULL) {
+        *read_mode_ap = (as_policy_read_mode_ap)v_read_mode;
+    }
+    if (commit_level != NULL) {
+        *commit_level = (as_policy_commit_level)v_commit_level;
+    }
+    return true;
+}
 
-    ERL_NIF_TERM list = argv[3];
-    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
+// policy_new(read | write | operate | batch | remove, #{Option => Value}) -> {ok, Policy}
+static ERL_NIF_TERM policy_new(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char type[MAX_ATOM_SIZE];
+    if (!enif_get_atom(env, argv[0], type, MAX_ATOM_SIZE, ERL_NIF_LATIN1) || !enif_is_map(env, argv[1])) {
 	    return enif_make_badarg(env);
     }
 
-    if (!enif_get_long(env, argv[4], &ttl)) {
+    aspike_policy* policy = (aspike_policy*)enif_alloc_resource(policy_rt, sizeof(aspike_policy));
+    bool is_valid;
+    if (strcmp(type, "read") == 0) {
+        policy->type = POLICY_READ;
+        as_policy_read* p = as_policy_read_init(&policy->p.read);
+        is_valid = get_policy_options(env, argv[1], &p->base, &p->replica, &p->read_mode_ap, NULL, NULL);
+    } else if (strcmp(type, "write") == 0) {
+        policy->type = POLICY_WRITE;
+        as_policy_write* p = as_policy_write_init(&policy->p.write);
+        is_valid = get_policy_options(env, argv[1], &p->base, &p->replica, NULL, &p->commit_level, &p->durable_delete);
+    } else if (strcmp(type, "operate") == 0) {
+        policy->type = POLICY_OPERATE;
+        as_policy_operate* p = as_policy_operate_init(&policy->p.operate);
+        is_valid = get_policy_options(env, argv[1], &p->base, &p->replica, &p->read_mode_ap,
+            &p->commit_level, &p->durable_delete);
+    } else if (strcmp(type, "batch") == 0) {
+        policy->type = POLICY_BATCH;
+        as_policy_batch* p = as_policy_batch_init(&policy->p.batch);
+        is_valid = get_policy_options(env, argv[1], &p->base, &p->replica, &p->read_mode_ap, NULL, NULL);
+    } else if (strcmp(type, "remove") == 0) {
+        policy->type = POLICY_REMOVE;
+        as_policy_remove* p = as_policy_remove_init(&policy->p.remove);
+        is_valid = get_policy_options(env, argv[1], &p->base, &p->replica, NULL, &p->commit_level, &p->durable_delete);
+    } else {
+        is_valid = false;
+    }
+
+    if (!is_valid) {
+        enif_release_resource(policy);
         return enif_make_badarg(env);
     }
+    ERL_NIF_TERM res = enif_make_resource(env, policy);
+    enif_release_resource(policy);
+    return enif_make_tuple2(env, erl_ok, res);
+}
 
-    ERL_NIF_TERM rc, msg;
-    if (length == 0) {
-        rc = erl_ok;
-        msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
+// fcap entries are written as [value, ttl, wt] lists instead of {value, ttl, wt} maps,
+// the readers take both (cdt_compact/1)
+static std::atomic<bool> compact_entries(false);
+
+// cdt_put* and binary_put*/binary_remove keep the expiry index too (cdt_expiry_index/1)
+static std::atomic<bool> expiry_index(false);
+
+// a new [value, ttl, wt] entry, value may be NULL
+static as_arraylist* compact_entry_new(as_val* value, long ttl, long wt)
+{
+    as_arraylist* entry = as_arraylist_new(3, 0);
+    as_arraylist_append(entry, value != NULL ? value : (as_val*)&as_nil);
+    as_arraylist_append_int64(entry, ttl);
+    as_arraylist_append_int64(entry, wt);
+    return entry;
+}
+
+// The expiry index of an fcap bin: the map bin Bin ++ "_exp" with SubKey => fcap_expiry()
+// of every subkey, so that the expired subkeys can be found on the server (cdt_check_and_put,
+// cdt_get_live). Those two keep it for the subkeys they see; the other writers only with
+// expiry_index on, and the deleters always drop its entries.
+// false when the name would be too long, such a bin has no index.
+static bool expiry_bin_name(const std::string& bin, std::string* res)
+{
+    *res = bin + "_exp";
+    return res->size() < AS_BIN_NAME_MAX_SIZE;
+}
+
+// true for the index bin of another bin of the record, the readers leave it out
+static bool is_expiry_bin(const as_record* p_rec, const char* name)
+{
+    size_t len = strlen(name);
+    if (len <= 4 || strcmp(name + len - 4, "_exp") != 0) {
+        return false;
     }
+    std::string bin(name, len - 4);
+    return as_record_get(p_rec, bin.c_str()) != NULL;
+}
 
-    CHECK_ALL
+// expiry time of a subkey written at wt, one without a ttl does not expire
+static int64_t fcap_expiry(int64_t wt, int64_t ttl)
+{
+    return ttl > 0 ? wt + ttl : INT64_MAX;
+}
 
-	as_error err;
-    as_key key;
-	as_record rec;
+// fcap_expiry() of an entry as stored, a {value, ttl, wt} map or a [value, ttl, wt] list
+static int64_t fcap_entry_expiry(const as_val* entry)
+{
+    if (as_val_type(entry) == AS_LIST) {
+        const as_list* list = (const as_list*)entry;
+        if (as_list_size(list) != 3) {
+            return INT64_MAX;
+        }
+        return fcap_expiry(as_list_get_int64(list, 2), as_list_get_int64(list, 1));
+    }
+    if (as_val_type(entry) != AS_MAP) {
+        return INT64_MAX;
+    }
+    as_string ttl_key, wt_key;
+    as_string_init(&ttl_key, (char*)"ttl", false);
+    as_string_init(&wt_key, (char*)"wt", false);
+    as_integer* ttl = as_integer_fromval(as_map_get(as_map_fromval(entry), (as_val*)&ttl_key));
+    as_integer* wt = as_integer_fromval(as_map_get(as_map_fromval(entry), (as_val*)&wt_key));
+    if (ttl == NULL || wt == NULL) {
+        return INT64_MAX;
+    }
+    return fcap_expiry(as_integer_get(wt), as_integer_get(ttl));
+}
+
+// Adds the write of one [SubKey, Value, TTL] of bin to ops: a map_put_items of {value, ttl, wt}
+// or, with compact_entries, a map_put of [value, ttl, wt]; and the SubKey => expiry time of
+// the index bin exp_bin (NULL: none). Value and TTL are left out (nil and 0 in a compact entry)
+// when they are not a binary and an integer.
+static bool add_cdt_subkey_put(ErlNifEnv* env, const std::string& bin, const char* exp_bin, ERL_NIF_TERM triple,
+    long wt, const as_map_policy* put_mode, as_operations* ops)
+{
+    ERL_NIF_TERM head, tail;
+    ErlNifBinary bin_key, bin_val;
+    long i64;
+    bool has_value = false;
+    bool has_ttl = false;
+    bool res;
+
+    if (!enif_get_list_cell(env, triple, &head, &tail) || !enif_inspect_binary(env, head, &bin_key)) {
+        return false;
+    }
+    std::string fcap_key((const char*) bin_key.data, bin_key.size);
+    if (enif_get_list_cell(env, tail, &head, &tail) && enif_inspect_binary(env, head, &bin_val)) {
+        has_value = true;
+    }
+    if (enif_get_list_cell(env, tail, &head, &tail) && enif_get_int64(env, head, &i64)) {
+        has_ttl = true;
+    }
+
+    if (compact_entries.load(std::memory_order_relaxed)) {
+        as_val* value = has_value ? (as_val*)as_bytes_new_wrap(bin_val.data, bin_val.size, false) : NULL;
+        // key and entry are freed by the operation
+        res = as_operations_map_put(ops, bin.c_str(), NULL, put_mode,
+            (as_val*)as_string_new_strdup(fcap_key.c_str()), (as_val*)compact_entry_new(value, has_ttl ? i64 : 0, wt));
+    } else {
+        // freed by the operation
+        as_orderedmap* items = as_orderedmap_new(3);
+        if (has_value) {
+            as_orderedmap_set(items, (as_val*)as_string_new((char*)"value", false),
+                (as_val*)as_bytes_new_wrap(bin_val.data, bin_val.size, false));
+        }
+        if (has_ttl) {
+            as_orderedmap_set(items, (as_val*)as_string_new((char*)"ttl", false), (as_val*)as_integer_new(i64));
+        }
+        as_orderedmap_set(items, (as_val*)as_string_new((char*)"wt", false), (as_val*)as_integer_new(wt));
+
+        as_string key_str;
+        as_string_init(&key_str, (char*)fcap_key.c_str(), false);
+        as_cdt_ctx ctx;
+        as_cdt_ctx_init(&ctx, 1);
+        as_cdt_ctx_add_map_key_create(&ctx, (as_val*)&key_str, AS_MAP_KEY_ORDERED);
+        res = as_operations_map_put_items(ops, bin.c_str(), &ctx, put_mode, (as_map*)items);
+        as_cdt_ctx_destroy(&ctx);
+    }
+
+    if (res && exp_bin != NULL) {
+        res = as_operations_map_put(ops, exp_bin, NULL, put_mode, (as_val*)as_string_new_strdup(fcap_key.c_str()),
+            (as_val*)as_integer_new(fcap_expiry(wt, has_ttl ? i64 : 0)));
+    }
+    return res;
+}
+
+// Number of operations add_cdt_put_ops() adds for list at most: one per subkey,
+// two when indexed
+static unsigned int cdt_put_ops_count(ErlNifEnv* env, ERL_NIF_TERM list, bool indexed)
+{
+    unsigned int per_subkey = indexed ? 2 : 1;
+    unsigned int count = 0;
+    unsigned int subkeys;
+    ERL_NIF_TERM head, first, rest;
+    int t_length;
+    const ERL_NIF_TERM* tuple = NULL;
+
+    while (enif_get_list_cell(env, list, &head, &list)) {
+        if (enif_get_tuple(env, head, &t_length, &tuple) && t_length == 2
+            && enif_get_list_cell(env, tuple[1], &first, &rest)) {
+            count += enif_is_list(env, first) && enif_get_list_length(env, tuple[1], &subkeys)
+                ? per_subkey * subkeys : per_subkey;
+        }
+    }
+    return count;
+}
+
+// Adds map_put_items operations for [{BinName, [SubKey, Value, TTL]}] or
+// [{BinName, [[SubKey, Value, TTL], ...]}] to ops, one per subkey and, when indexed, one for its
+// expiry index. Map operations are packed right away, so the values may live on this frame;
+// ops itself has to be initialised by the caller (cdt_put_ops_count() operations).
+static bool add_cdt_put_ops(ErlNifEnv* env, ERL_NIF_TERM list, unsigned int length, bool indexed,
+    as_operations* ops)
+{
+    as_map_policy put_mode;
+    //as_map_policy_set(&put_mode, AS_MAP_UNORDERED, AS_MAP_UPDATE);
+    as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
+
+    // subkey write time
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    long wt = std::chrono::duration_cast<std::chrono::seconds>(now).count();
 
-	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-	as_record_inita(&rec, length);
-    rec.ttl = ttl;
-    long ret_val = 0;
-   
     for (uint i = 0; i < length; i++) {
         ERL_NIF_TERM head;
         ERL_NIF_TERM tail;
         ErlNifBinary bin_bin;
         std::string bin_str;
+        int t_length;
+        const ERL_NIF_TERM* tuple = NULL;
 
         if (!enif_get_list_cell(env, list, &head, &tail)) {
             break;
         }
-        if (!enif_inspect_binary(env, head, &bin_bin)) {
-            return enif_make_badarg(env);
+        if(!enif_get_tuple(env, head, &t_length, &tuple) || t_length != 2){
+            return false;
+        }
+
+        if (!enif_inspect_binary(env, tuple[0], &bin_bin)) {
+            return false;
         }
         bin_str.assign((const char*) bin_bin.data, bin_bin.size);
 
-	    if(!as_record_set_nil(&rec, bin_str.c_str())){
-		    ret_val = 1;
+        std::string exp_bin_str;
+        const char* exp_bin = indexed && expiry_bin_name(bin_str, &exp_bin_str) ? exp_bin_str.c_str() : NULL;
+
+        ERL_NIF_TERM ts_list = tuple[1];
+        ERL_NIF_TERM first, rest;
+        if (!enif_is_list(env, ts_list)) {
+            return false;
+        }
+        if (!enif_get_list_cell(env, ts_list, &first, &rest)) {
+            // no subkeys
+        } else if (enif_is_list(env, first)) {
+            while (enif_get_list_cell(env, ts_list, &first, &ts_list)) {
+                if (!add_cdt_subkey_put(env, bin_str, exp_bin, first, wt, &put_mode, ops)) {
+                    return false;
+                }
+            }
+        } else if (!add_cdt_subkey_put(env, bin_str, exp_bin, ts_list, wt, &put_mode, ops)) {
+            return false;
         }
-    }
 
-    if(!ret_val){
-	// destroy heap record
-    }
-	
-    if (aerospike_key_put(&as, &err, NULL, &key, &rec)  != AEROSPIKE_OK) {
-        rc = erl_error;
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-    } else {
-        rc = erl_ok;
-        msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
+        list = tail;
     }
-
-    return enif_make_tuple2(env, rc, msg);
+    return true;
 }
 
-static ERL_NIF_TERM cdt_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
-{
-    ErlNifBinary bin_ns, bin_set, bin_key;
-    unsigned int length;
-    std::string name_space, aspk_set, aspk_key;
+// what a coalesced batch is written to, made by its first caller
+typedef struct {
+    aspike_cluster* handle;     // kept until the batch is written
+    as_policy_operate policy;
+    std::string name_space;
+    std::string set;
+    std::string key;
     long ttl;
+    std::string cache_key;
+} coalesce_target;
 
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
-	    return enif_make_badarg(env);
-    }
-    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+static void coalesce_target_free(void* target)
+{
+    coalesce_target* t = (coalesce_target*)target;
+    enif_release_resource(t->handle);
+    delete t;
+}
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
-	    return enif_make_badarg(env);
+static void coalesce_write_listener(as_error* err, as_record* p_rec, void* udata, as_event_loop* event_loop)
+{
+    put_batch* b = (put_batch*)udata;
+    coalesce_target* t = (coalesce_target*)b->target;
+    if (!t->cache_key.empty()) {
+        cache_drop_key(t->cache_key);
     }
-    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+    coalesce_done(b, err == NULL, err == NULL ? NULL : err->message);
+}
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
-	    return enif_make_badarg(env);
+// run by the flush thread of coalesce.cpp: the bins of all callers in one async operate
+static void coalesce_write(put_batch* b)
+{
+    coalesce_target* t = (coalesce_target*)b->target;
+    unsigned int total = 0;
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+    std::vector<unsigned int> lengths(b->lists.size());
+    for (size_t i = 0; i < b->lists.size(); i++) {
+        enif_get_list_length(b->env, b->lists[i], &lengths[i]);
+        total += cdt_put_ops_count(b->env, b->lists[i], indexed);
+    }
+
+    as_error err;
+    as_key key;
+    as_key_init_str(&key, t->name_space.c_str(), t->set.c_str(), t->key.c_str());
+    as_operations ops;
+    as_operations_init(&ops, total);
+    if (t->ttl != 0) {
+        ops.ttl = t->ttl;
+    } else {
+        ops.ttl = AS_RECORD_NO_CHANGE_TTL;
+    }
+    // every list was checked by its caller already
+    for (size_t i = 0; i < b->lists.size(); i++) {
+        add_cdt_put_ops(b->env, b->lists[i], lengths[i], indexed, &ops);
+    }
+    if (any_cache_enabled()) {
+        t->cache_key = cache_key(t->handle, &key);
+    }
+    as_status status = aerospike_key_operate_async(t->handle->as, &err, &t->policy, &key, &ops,
+        coalesce_write_listener, b, NULL, NULL);
+    as_operations_destroy(&ops);
+    as_key_destroy(&key);
+    if (status != AEROSPIKE_OK) {
+        // the listener is not called when the command was not queued
+        coalesce_done(b, false, err.message);
+    }
+}
+
+// cdt_put with coalescing on: the bins go to the open batch of the key (and ttl) and the
+// result comes as {aspike, *ref, Result}; false when coalescing was turned off meanwhile
+static bool cdt_put_coalesced(ErlNifEnv* env, aspike_cluster* handle, const as_policy_operate* policy,
+    const std::string& name_space, const std::string& set, const std::string& key, as_key* as_key,
+    ERL_NIF_TERM list, unsigned int subkeys, long ttl, ERL_NIF_TERM* ref)
+{
+    coalesce_target* t = new coalesce_target;
+    enif_keep_resource(handle);
+    t->handle = handle;
+    t->policy = policy ? *policy : handle->as->config.policies.operate;
+    t->name_space = name_space;
+    t->set = set;
+    t->key = key;
+    t->ttl = ttl;
+    std::string bkey = cache_key(handle, as_key) + std::to_string(ttl);
+    if (!coalesce_put(env, bkey, list, subkeys, t, ref)) {
+        coalesce_target_free(t);
+        return false;
+    }
+    return true;
+}
+
+static ERL_NIF_TERM cdt_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_CDT_PUT)
+    ErlNifBinary bin_ns, bin_set, bin_key;
+    unsigned int length;
+    std::string name_space, aspk_set, aspk_key;
+    long ttl;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
 
-    ERL_NIF_TERM list = argv[3];
+    ERL_NIF_TERM list = argv[4];
     if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
 	    return enif_make_badarg(env);
     }
 
-    if (!enif_get_long(env, argv[4], &ttl)) {
+    if (!enif_get_long(env, argv[5], &ttl)) {
         return enif_make_badarg(env);
     }
 
-    // {max_retries, sleep_between_retries, socket_timeout, total_timeout}
-    const ERL_NIF_TERM* policy = NULL;
-    int policy_length;
-    long max_retries = 0;
-    long sleep_between_retries = 0;
-    long socket_timeout = 30000;
-    long total_timeout = 1000;
-    if(!enif_get_tuple(env, argv[5], &policy_length, &policy) || policy_length != 4){
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[6], &p, &policy)) {
         return enif_make_badarg(env);
     }
-    enif_get_long(env, policy[0], &max_retries);
-    enif_get_long(env, policy[1], &sleep_between_retries);
-    enif_get_long(env, policy[2], &socket_timeout);
-    enif_get_long(env, policy[3], &total_timeout);
     
     ERL_NIF_TERM rc, msg;
     if (length == 0) {
@@ -327,192 +1066,187 @@ static ERL_NIF_TERM cdt_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 
 	as_error err;
     as_key key;
-	as_record rec;
-	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-	as_record_inita(&rec, length);
+    as_operations ops;
+    // on the heap, the number of subkeys is up to the caller
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+    unsigned int ops_count = cdt_put_ops_count(env, list, indexed);
+    as_operations_init(&ops, ops_count);
     if(ttl != 0){
-        rec.ttl = ttl;
+        ops.ttl = ttl;
+    } else {
+        ops.ttl = AS_RECORD_NO_CHANGE_TTL;
     }
-        
-    as_cdt_ctx ctx;
-    as_cdt_ctx_inita(&ctx, 1);
-    as_operations ops;
-    as_map_policy put_mode;
-    //as_map_policy_set(&put_mode, AS_MAP_UNORDERED, AS_MAP_UPDATE);
-    as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
+    if (!add_cdt_put_ops(env, list, length, indexed, &ops)) {
+        as_operations_destroy(&ops);
+        return enif_make_badarg(env);
+    }
+    if (ops_count == 0) {
+        // only empty subkey lists, nothing to write
+        as_operations_destroy(&ops);
+        return enif_make_tuple2(env, erl_ok, enif_make_string(env, "put", ERL_NIF_UTF8));
+    }
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    ERL_NIF_TERM ref;
+    if (coalesce_enabled()
+        && cdt_put_coalesced(env, handle, policy, name_space, aspk_set, aspk_key, &key, list,
+            indexed ? ops_count / 2 : ops_count, ttl, &ref)) {
+        // ops only checked the bins, the flush thread packs them again; aspike_nif:cdt_put/7
+        // waits for {aspike, Ref, Result} up to the window and the total timeout of the put
+        // (1000 ms, as the module's default policy, when that has none)
+        uint32_t total_timeout = policy ? policy->base.total_timeout
+            : handle->as->config.policies.operate.base.total_timeout;
+        if (total_timeout == 0) {
+            total_timeout = 1000;
+        }
+        as_operations_destroy(&ops);
+        as_key_destroy(&key);
+        STATS_PHASE(STATS_DECODE)
+        return enif_make_tuple3(env, enif_make_atom(env, "coalesced"), ref,
+            enif_make_uint(env, coalesce_window() + total_timeout));
+    }
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, NULL);
+    STATS_PHASE(STATS_CALL)
+    cache_drop(handle, &key);
+    if(status != AEROSPIKE_OK){
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+    } else {
+        rc = erl_ok;
+        msg = enif_make_string(env, "put", ERL_NIF_UTF8);
+    }
+    as_operations_destroy(&ops);
+    as_key_destroy(&key);
+    STATS_PHASE(STATS_ENCODE)
+
+    return enif_make_tuple2(env, rc, msg);
+}
+
+// Converts a binary_put value: binary, integer, list of integers or any atom (nil, i.e. delete the bin).
+// The value is allocated on the heap and owned by the record/operations it is set on;
+// *value is left NULL for values that are silently skipped.
+static bool get_bin_value(ErlNifEnv* env, ERL_NIF_TERM term, as_bin_value** value)
+{
+    ErlNifBinary bin_val;
+    unsigned int ts_length;
+
+    *value = NULL;
+    if (enif_inspect_binary(env, term, &bin_val)) {
+        as_bytes* bytes_v = as_bytes_new(bin_val.size);
+        as_bytes_set(bytes_v, 0, (const uint8_t *)bin_val.data, bin_val.size);
+        *value = (as_bin_value*)bytes_v;
+    } else if(enif_is_number(env, term)){
+        long i64;
+        if(enif_get_int64(env, term, &i64)){
+            *value = (as_bin_value*)as_integer_new(i64);
+        }
+    } else if(enif_is_atom(env, term)) { // every atom is considering as undefined to delete this binary
+        *value = (as_bin_value*)&as_nil;
+    } else {
+        if (!enif_is_list(env, term) || !enif_get_list_length(env, term, &ts_length)) {
+            return false;
+        }
+        // expecting list of integers
+        auto ts_list = term;
+        as_arraylist* as_list_ofints = as_arraylist_new((uint32_t)ts_length, 0);
+        for (uint ts_i = 0; ts_i < ts_length; ts_i++) {
+            ERL_NIF_TERM ts_head;
+            ERL_NIF_TERM ts_tail;
+            long i64;
+            if (!enif_get_list_cell(env, ts_list, &ts_head, &ts_tail)) {
+                break;
+            }
+            if(enif_get_int64(env, ts_head, &i64)){
+                as_arraylist_append_int64(as_list_ofints, i64);
+            }
+            ts_list = ts_tail;
+        }
+        ((as_val *)as_list_ofints)->type = AS_LIST;
+        *value = (as_bin_value*)as_list_ofints;
+    }
+    return true;
+}
 
-    std::vector<as_bytes*> bin_vec; 
+// Sets bins from [{BinName, Value}] on rec, or adds them as write operations to ops when rec is NULL.
+// When indexed, the expiry index of every bin written is deleted as well, it would not match the bin
+// anymore (rec and ops need room for 2 * length bins then).
+static bool set_binary_put_bins(ErlNifEnv* env, ERL_NIF_TERM list, unsigned int length, bool indexed,
+    as_record* rec, as_operations* ops)
+{
     for (uint i = 0; i < length; i++) {
         ERL_NIF_TERM head;
         ERL_NIF_TERM tail;
         ErlNifBinary bin_bin;
-        std::string bin_str, bin_str_val;
+        std::string bin_str;
         int t_length;
         const ERL_NIF_TERM* tuple = NULL;
-        //as_bytes as_bytes_val;
-        unsigned int ts_length;
+        as_bin_value* value;
 
         if (!enif_get_list_cell(env, list, &head, &tail)) {
             break;
         }
         if(!enif_get_tuple(env, head, &t_length, &tuple) || t_length != 2){
-            return enif_make_badarg(env);
+            return false;
         }
 
         if (!enif_inspect_binary(env, tuple[0], &bin_bin)) {
-            return enif_make_badarg(env);
+            return false;
         }
         bin_str.assign((const char*) bin_bin.data, bin_bin.size);
 
-        if (!enif_is_list(env, tuple[1]) || !enif_get_list_length(env, tuple[1], &ts_length)) {
-            return enif_make_badarg(env);
+        if (!get_bin_value(env, tuple[1], &value)) {
+            return false;
         }
-        auto ts_list = tuple[1];
-        as_operations_inita(&ops, 3);
-        if(ttl != 0){
-            ops.ttl = ttl;
-        } else {
-            ops.ttl = -2;
-        }
-        uint opnum = 0;
-        ErlNifBinary bin_key, bin_val;
-        as_string key_str, subkey1, subkey2, subkey3;
-        as_bytes subval1;
-        as_integer subval2, subval3;
-        std::string fcap_key, fcap_val, valuesk, valuesk1, valuesk2;
-        long i64;
-        for (uint ts_i = 0; ts_i < ts_length; ts_i++) {
-            ERL_NIF_TERM ts_head;
-            ERL_NIF_TERM ts_tail;
-            if (!enif_get_list_cell(env, ts_list, &ts_head, &ts_tail)) {
-                break;
+        if (value != NULL) {
+            bool set = rec ? as_record_set(rec, bin_str.c_str(), value)
+                           : as_operations_add_write(ops, bin_str.c_str(), value);
+            if (!set) {
+                as_val_destroy((as_val*)value);
             }
-            
-            if(opnum == 0){
-                //getting fcap key
-                if (enif_inspect_binary(env, ts_head, &bin_key)) {
-                    fcap_key.assign((const char*) bin_key.data, bin_key.size);
-                    as_string_init(&key_str, (char*)fcap_key.c_str(), false);
-                    as_cdt_ctx_add_map_key_create(&ctx, (as_val*)&key_str, AS_MAP_KEY_ORDERED);
-                }
-                opnum++;
-            }else if(opnum == 1){
-                //getting fcap value
-                if (enif_inspect_binary(env, ts_head, &bin_val)) {
-                    //fcap_val.assign((const char*) bin_val.data, bin_val.size);
-                    valuesk = "value";
-                    as_string_init(&subkey1, (char*)valuesk.c_str(), false);
-                    //as_string_init(&subval1, (char*)fcap_val.c_str(), false);
-                    as_bytes_inita(&subval1, bin_val.size);
-                    as_bytes_set(&subval1, 0, bin_val.data, bin_val.size);
-                    as_operations_map_put(&ops, bin_str.c_str(), &ctx, &put_mode, (as_val*)&subkey1, (as_val*)&subval1);
-                }
-                opnum++;
-
-            }else if(opnum == 2){
-                //getting subkey ttl
-                if(enif_get_int64(env, ts_head, &i64)){
-                    valuesk1 = "ttl";
-                    as_string_init(&subkey2, (char*)valuesk1.c_str(), false);
-                    as_integer_init(&subval2, i64);
-                    as_operations_map_put(&ops, bin_str.c_str(), &ctx, &put_mode, (as_val*)&subkey2, (as_val*)&subval2);
+            std::string exp_bin_str;
+            if (indexed && expiry_bin_name(bin_str, &exp_bin_str)) {
+                if (rec) {
+                    as_record_set_nil(rec, exp_bin_str.c_str());
+                } else {
+                    as_operations_add_write(ops, exp_bin_str.c_str(), (as_bin_value*)&as_nil);
                 }
-                opnum=0;
-                //subkey write time
-                auto now = std::chrono::system_clock::now().time_since_epoch();
-                long wt = std::chrono::duration_cast<std::chrono::seconds>(now).count();
-                valuesk2 = "wt";
-                as_string_init(&subkey3, (char*)valuesk2.c_str(), false);
-                as_integer_init(&subval3, wt);
-                as_operations_map_put(&ops, bin_str.c_str(), &ctx, &put_mode, (as_val*)&subkey3, (as_val*)&subval3);
-                break;
-            }else{
-                break;
             }
-            
-
-            ts_list = ts_tail;
         }
-/*
-        as_string str;
-        std::string uidsk = "flight.id.99999.5657667";
-        as_string_init(&str, (char*)uidsk.c_str(), false);
-        as_cdt_ctx_add_map_key_create(&ctx, (as_val*)&str, AS_MAP_UNORDERED);
-
-        as_string subkey;
-        std::string valuesk = "value";
-        as_string_init(&subkey, (char*)valuesk.c_str(), false);
-        //as_integer subval;
-        //as_integer_init(&subval, 222);
-        as_string subval;
-        std::string valuesv = "200,212,242,174,6,144,8,6";
-        as_string_init(&subval, (char*)valuesv.c_str(), false);
-        as_operations_map_put(&ops, bin_str.c_str(), &ctx, &put_mode, (as_val*)&subkey, (as_val*)&subval);
-        
-        as_string subkey1;
-        std::string valuesk1 = "ttl";
-        as_string_init(&subkey1, (char*)valuesk1.c_str(), false);
-        as_integer subval1;
-        as_integer_init(&subval1, 600);
-        as_operations_map_put(&ops, bin_str.c_str(), &ctx, &put_mode, (as_val*)&subkey1, (as_val*)&subval1);
-*/
-
-    }
-
-    //const as_policy_operate * policy;
-    as_record * rec1 = &rec;
-    as_policy_operate p;
-	as_policy_operate_init(&p);
-    p.ttl = ttl;
-    p.base.max_retries = max_retries;
-    p.base.sleep_between_retries = sleep_between_retries;
-    p.base.socket_timeout = socket_timeout;
-    p.base.total_timeout = total_timeout;
-
-    if(aerospike_key_operate(&as, &err, &p, &key, &ops, &rec1) != AEROSPIKE_OK){
-        rc = erl_error;
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-    } else {
-        rc = erl_ok;
-        msg = enif_make_string(env, "put", ERL_NIF_UTF8);
-        as_record_destroy(&rec);
+        list = tail;
     }
-    as_operations_destroy(&ops);
-    as_key_destroy(&key);
-
-
-
-    return enif_make_tuple2(env, rc, msg);
+    return true;
 }
 
-static ERL_NIF_TERM binary_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM binary_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     ErlNifBinary bin_ns, bin_set, bin_key;
     unsigned int length;
     std::string name_space, aspk_set, aspk_key;
     long ttl;
 
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
 
-    ERL_NIF_TERM list = argv[3];
+    ERL_NIF_TERM list = argv[4];
     if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
 	    return enif_make_badarg(env);
     }
 
-    if (!enif_get_long(env, argv[4], &ttl)) {
+    if (!enif_get_long(env, argv[5], &ttl)) {
         return enif_make_badarg(env);
     }
 
@@ -523,6 +1257,12 @@ static ERL_NIF_TERM binary_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
         return enif_make_tuple2(env, rc, msg);
     }
 
+    as_policy_write p;
+    const as_policy_write* policy;
+    if (!get_write_policy(env, argv[6], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
 	as_error err;
@@ -530,122 +1270,90 @@ static ERL_NIF_TERM binary_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 	as_record rec;
 
 	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-	as_record_inita(&rec, length);
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+	as_record_inita(&rec, indexed ? 2 * length : length);
     rec.ttl = ttl;
     long ret_val = 0;
    
-    std::vector<as_bytes*> bin_vec; 
     for (uint i = 0; i < length; i++) {
         ERL_NIF_TERM head;
         ERL_NIF_TERM tail;
-        ErlNifBinary bin_bin, bin_val;
-        std::string bin_str, bin_str_val;
-        int t_length;
-        const ERL_NIF_TERM* tuple = NULL;
-        //as_bytes as_bytes_val;
-        unsigned int ts_length;
+        ErlNifBinary bin_bin;
+        std::string bin_str;
 
         if (!enif_get_list_cell(env, list, &head, &tail)) {
             break;
         }
-        if(!enif_get_tuple(env, head, &t_length, &tuple) || t_length != 2){
-            return enif_make_badarg(env);
-        }
-
-        if (!enif_inspect_binary(env, tuple[0], &bin_bin)) {
+        if (!enif_inspect_binary(env, head, &bin_bin)) {
             return enif_make_badarg(env);
         }
         bin_str.assign((const char*) bin_bin.data, bin_bin.size);
 
-        if (!enif_inspect_binary(env, tuple[1], &bin_val)) {
-            if(enif_is_number(env, tuple[1])){
-                long i64;
-                if(enif_get_int64(env, tuple[1], &i64)){
-                    if(!as_record_set_int64(&rec, bin_str.c_str(), i64)){
-                        ret_val = 1;
-                    }
-                }
-            } else if(enif_is_atom(env, tuple[1])) { // every atom is considering as undefined to delete this binary
-                if(!as_record_set_nil(&rec, bin_str.c_str())){
-                    ret_val = 1;
-                }
-            } else {
-                if (!enif_is_list(env, tuple[1]) || !enif_get_list_length(env, tuple[1], &ts_length)) {
-                    return enif_make_badarg(env);
-                }
-                // expecting list of integers
-                auto ts_list = tuple[1];
-                //as_list* as_list_ofints = (as_list *)as_arraylist_new((uint32_t)ts_length, 0);
-                as_arraylist* as_list_ofints = as_arraylist_new((uint32_t)ts_length, 0);
-                for (uint ts_i = 0; ts_i < ts_length; ts_i++) {
-                    ERL_NIF_TERM ts_head;
-                    ERL_NIF_TERM ts_tail;
-                    long i64;
-                    if (!enif_get_list_cell(env, ts_list, &ts_head, &ts_tail)) {
-                        break;
-                    }
-                    if(enif_get_int64(env, ts_head, &i64)){
-                        as_arraylist_append_int64(as_list_ofints, i64);
-                    }
-                    ts_list = ts_tail;
-                }
-                ((as_val *)as_list_ofints)->type = AS_LIST;
-                if(!as_record_set_list(&rec, bin_str.c_str(), (as_list*)as_list_ofints)){
-                    as_list_destroy((as_list*)as_list_ofints);
-                    ret_val = 1;
-                };
-            }
-        }else{
-	    bin_vec.push_back(as_bytes_new(bin_val.size));
-	    as_bytes * bytes_v = bin_vec.back();
-	    as_bytes_set(bytes_v, 0, (const uint8_t *)bin_val.data, bin_val.size);
-	    if(!as_record_set_bytes(&rec, bin_str.c_str(), bytes_v)){
-		as_bytes_destroy(bytes_v);
-		ret_val = 1;
-	    }
+	    if(!as_record_set_nil(&rec, bin_str.c_str())){
+		    ret_val = 1;
+        }
+        // and its expiry index
+        std::string exp_bin_str;
+        if (indexed && expiry_bin_name(bin_str, &exp_bin_str)) {
+            as_record_set_nil(&rec, exp_bin_str.c_str());
         }
-        list = tail;
     }
+
     if(!ret_val){
 	// destroy heap record
     }
 	
-    if (aerospike_key_put(&as, &err, NULL, &key, &rec)  != AEROSPIKE_OK) {
+    as_status status = aerospike_key_put(handle->as, &err, policy, &key, &rec);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
     } else {
         rc = erl_ok;
         msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
     }
-    for(unsigned int i = 0; i < bin_vec.size(); i++){
-	as_bytes_destroy(bin_vec[i]);
-    }
 
     return enif_make_tuple2(env, rc, msg);
 }
 
-static ERL_NIF_TERM key_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM binary_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    char name_space[MAX_NAMESPACE_SIZE];
-    char set[MAX_SET_SIZE];
-    char key_str[MAX_KEY_STR_SIZE];
+    STATS_START(STATS_BINARY_PUT)
+    ErlNifBinary bin_ns, bin_set, bin_key;
     unsigned int length;
+    std::string name_space, aspk_set, aspk_key;
+    long ttl;
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
-    ERL_NIF_TERM list = argv[3];
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    ERL_NIF_TERM list = argv[4];
     if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
 	    return enif_make_badarg(env);
     }
-    CHECK_ALL
-                                        // enif_get_list_length(env, *val, &len);
+
+    if (!enif_get_long(env, argv[5], &ttl)) {
+        return enif_make_badarg(env);
+    }
+
+    as_policy_write p;
+    const as_policy_write* policy;
+    if (!get_write_policy(env, argv[6], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     ERL_NIF_TERM rc, msg;
     if (length == 0) {
         rc = erl_ok;
@@ -653,85 +1361,248 @@ static ERL_NIF_TERM key_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_tuple2(env, rc, msg);
     }
 
+    CHECK_ALL
+
 	as_error err;
     as_key key;
 	as_record rec;
 
-	as_key_init_str(&key, name_space, set, key_str);
-	as_record_inita(&rec, length);
-
-    
-    for (uint i = 0; i < length; i++) {
-        ERL_NIF_TERM head;
-        ERL_NIF_TERM tail;
-        char bin[AS_BIN_NAME_MAX_SIZE] = {0};
-        long val = 0;
-        int t_length;
-        const ERL_NIF_TERM* tuple = NULL;
-
-        if (!enif_get_list_cell(env, list, &head, &tail)) {
-            break;
-        }
-        if(!enif_get_tuple(env, head, &t_length, &tuple) || t_length != 2){
-            return enif_make_badarg(env);
-        }
-        if (!enif_get_string(env, tuple[0], bin, MAX_SET_SIZE, ERL_NIF_UTF8)) {
-    	    return enif_make_badarg(env);
-        }
-        if (!enif_get_long(env, tuple[1], &val)) {
-            return enif_make_badarg(env);
-        }
-        as_record_set_int64(&rec, bin, val);
-        list = tail;
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+	as_record_inita(&rec, indexed ? 2 * length : length);
+    rec.ttl = ttl;
+   
+    if(!set_binary_put_bins(env, list, length, indexed, &rec, NULL)){
+        as_record_destroy(&rec);
+        return enif_make_badarg(env);
     }
-
-    if (aerospike_key_put(&as, &err, NULL, &key, &rec)  != AEROSPIKE_OK) {
-        rc = erl_error;;
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+	
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_put(handle->as, &err, policy, &key, &rec);
+    cache_drop(handle, &key);
+    STATS_PHASE(STATS_CALL)
+    if (status != AEROSPIKE_OK) {
+        rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
     } else {
         rc = erl_ok;
         msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
     }
+    as_record_destroy(&rec);
+    STATS_PHASE(STATS_ENCODE)
 
     return enif_make_tuple2(env, rc, msg);
 }
 
-static ERL_NIF_TERM key_inc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Builds as_operations for one {Key, BinList, TTL} of a batch write
+typedef as_operations* (*batch_ops_builder)(ErlNifEnv* env, ERL_NIF_TERM bins, unsigned int bins_length, long ttl);
+
+static as_operations* binary_put_ops(ErlNifEnv* env, ERL_NIF_TERM bins, unsigned int bins_length, long ttl)
 {
-    char name_space[MAX_NAMESPACE_SIZE];
-    char set[MAX_SET_SIZE];
-    char key_str[MAX_KEY_STR_SIZE];
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+    as_operations* ops = as_operations_new(indexed ? 2 * bins_length : bins_length);
+    ops->ttl = ttl;
+    if (!set_binary_put_bins(env, bins, bins_length, indexed, NULL, ops)) {
+        as_operations_destroy(ops);
+        return NULL;
+    }
+    return ops;
+}
+
+static as_operations* cdt_put_ops(ErlNifEnv* env, ERL_NIF_TERM bins, unsigned int bins_length, long ttl)
+{
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+    as_operations* ops = as_operations_new(cdt_put_ops_count(env, bins, indexed));
+    if(ttl != 0){
+        ops->ttl = ttl;
+    } else {
+        ops->ttl = AS_RECORD_NO_CHANGE_TTL;
+    }
+    if (!add_cdt_put_ops(env, bins, bins_length, indexed, ops)) {
+        as_operations_destroy(ops);
+        return NULL;
+    }
+    return ops;
+}
+
+// Writes [{Key, BinList, TTL}] of Namespace/Set with one batch request, returns {ok, [Status]}
+// where Status is the aerospike status code of each record in the order of the list.
+static ERL_NIF_TERM batch_write(ErlNifEnv* env, const ERL_NIF_TERM argv[], const as_policy_batch* policy,
+    batch_ops_builder build_ops, int op)
+{
+    STATS_START(op)
+    ErlNifBinary bin_ns, bin_set;
+    std::string name_space, aspk_set;
     unsigned int length;
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    ERL_NIF_TERM records_list = argv[3];
+    if (!enif_is_list(env, records_list) || !enif_get_list_length(env, records_list, &length)) {
 	    return enif_make_badarg(env);
     }
-    ERL_NIF_TERM list = argv[3];
-    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
-	    return enif_make_badarg(env);
+    if (length == 0) {
+        return enif_make_tuple2(env, erl_ok, enif_make_list(env, 0));
     }
+
     CHECK_ALL
 
+    // as_key_init_str() keeps the pointer, so the strings have to outlive the batch
+    std::vector<std::string> key_str_list(length);
+    std::vector<as_batch_write_record*> abwrs;
+    std::vector<as_operations*> wopsl;
+    abwrs.reserve(length);
+    wopsl.reserve(length);
+
+    as_batch_records recs;
+	as_batch_records_inita(&recs, length);
+
+    bool decoded = true;
+    for (uint i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        ERL_NIF_TERM tail;
+        ErlNifBinary bin_bin;
+        const ERL_NIF_TERM* rec_tuple = NULL;
+        int rec_length;
+        unsigned int bins_length;
+        long ttl;
+
+        if (!enif_get_list_cell(env, records_list, &head, &tail)) {
+            break;
+        }
+        if(!enif_get_tuple(env, head, &rec_length, &rec_tuple) || rec_length != 3
+            || !enif_inspect_binary(env, rec_tuple[0], &bin_bin)
+            || !enif_is_list(env, rec_tuple[1]) || !enif_get_list_length(env, rec_tuple[1], &bins_length)
+            || !enif_get_long(env, rec_tuple[2], &ttl)){
+            decoded = false;
+            break;
+        }
+        key_str_list[i].assign((const char*) bin_bin.data, bin_bin.size);
+
+        as_operations* ops = build_ops(env, rec_tuple[1], bins_length, ttl);
+        if (ops == NULL) {
+            decoded = false;
+            break;
+        }
+        wopsl.push_back(ops);
+
+        as_batch_write_record* abwr = as_batch_write_reserve(&recs);
+	    as_key_init_str(&(abwr->key), name_space.c_str(), aspk_set.c_str(), key_str_list[i].c_str());
+        abwr->ops = ops;
+        abwrs.push_back(abwr);
+
+        records_list = tail;
+    }
+
+    if (!decoded) {
+        for(auto vitr : wopsl){
+            as_operations_destroy(vitr);
+        }
+        as_batch_records_destroy(&recs);
+        return enif_make_badarg(env);
+    }
+
+    ERL_NIF_TERM rc, msg;
+    as_error err;
+    STATS_PHASE(STATS_DECODE)
+	as_status status = aerospike_batch_write(handle->as, &err, policy, &recs);
+    STATS_PHASE(STATS_CALL)
+    for (auto aitr : abwrs) {
+        cache_drop(handle, &aitr->key);
+    }
+    // AEROSPIKE_BATCH_FAILED only means that some records have an error status
+    if(status != AEROSPIKE_OK && status != AEROSPIKE_BATCH_FAILED){
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+    } else {
+        std::vector<ERL_NIF_TERM> erl_list;
+        erl_list.reserve(abwrs.size());
+        for(auto aitr : abwrs){
+            erl_list.push_back(enif_make_int(env, aitr->result));
+        }
+        rc = erl_ok;
+        msg = enif_make_list_from_array(env, erl_list.data(), erl_list.size());
+    }
+
+    for(auto vitr : wopsl){
+        as_operations_destroy(vitr);
+    }
+    as_batch_records_destroy(&recs);
+    STATS_PHASE(STATS_ENCODE)
+    return enif_make_tuple2(env, rc, msg);
+}
+
+static ERL_NIF_TERM binary_put_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    as_policy_batch p;
+    const as_policy_batch* policy;
+    if (!get_batch_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+    return batch_write(env, argv, policy, binary_put_ops, STATS_BINARY_PUT_MANY);
+}
+
+static ERL_NIF_TERM cdt_put_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    as_policy_batch p;
+    const as_policy_batch* policy;
+    if (!get_batch_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+    return batch_write(env, argv, policy, cdt_put_ops, STATS_CDT_PUT_MANY);
+}
+
+static ERL_NIF_TERM key_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char name_space[MAX_NAMESPACE_SIZE];
+    char set[MAX_SET_SIZE];
+    char key_str[MAX_KEY_STR_SIZE];
+    unsigned int length;
+
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM list = argv[4];
+    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
+	    return enif_make_badarg(env);
+    }
+    as_policy_write p;
+    const as_policy_write* policy;
+    if (!get_write_policy(env, argv[5], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+                                        // enif_get_list_length(env, *val, &len);
     ERL_NIF_TERM rc, msg;
     if (length == 0) {
         rc = erl_ok;
-        msg = enif_make_string(env, "key_inc", ERL_NIF_UTF8);
+        msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
         return enif_make_tuple2(env, rc, msg);
     }
 
 	as_error err;
     as_key key;
+	as_record rec;
+
 	as_key_init_str(&key, name_space, set, key_str);
-	
-    as_operations ops;
-	as_operations_inita(&ops, length);
+	as_record_inita(&rec, length);
 
+    
     for (uint i = 0; i < length; i++) {
         ERL_NIF_TERM head;
         ERL_NIF_TERM tail;
@@ -752,11 +1623,248 @@ static ERL_NIF_TERM key_inc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         if (!enif_get_long(env, tuple[1], &val)) {
             return enif_make_badarg(env);
         }
-        as_operations_add_incr(&ops, bin, val);
+        as_record_set_int64(&rec, bin, val);
+        list = tail;
+    }
+
+    as_status status = aerospike_key_put(handle->as, &err, policy, &key, &rec);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
+        rc = erl_error;;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+    } else {
+        rc = erl_ok;
+        msg = enif_make_string(env, "key_put", ERL_NIF_UTF8);
+    }
+
+    return enif_make_tuple2(env, rc, msg);
+}
+
+// ------------------------------------------------------------------------------------------------
+// key_inc aggregation: with an interval set, key_inc only adds its deltas to native counters
+// (counters.cpp) and a background thread writes them every interval with one batch per cluster.
+
+static std::atomic<bool> counters_aggregate(false);
+static std::mutex counters_flush_mutex;     // one flush at a time
+static std::mutex counters_thread_mutex;
+static std::condition_variable counters_thread_cv;
+static std::thread counters_thread;
+static bool counters_thread_stop = false;
+
+static bool same_record(const counter_delta& a, const counter_delta& b)
+{
+    return a.owner == b.owner && a.ns == b.ns && a.set == b.set && a.key == b.key;
+}
+
+// writes the records of one cluster, deltas[from, to) sorted by record
+static bool counters_write(std::vector<counter_delta>& deltas, size_t from, size_t to, std::string* error)
+{
+    aspike_cluster* handle = (aspike_cluster*)deltas[from].owner;
+    std::vector<size_t> starts;
+    for (size_t i = from; i < to; i++) {
+        if (i == from || !same_record(deltas[i - 1], deltas[i])) {
+            starts.push_back(i);
+        }
+    }
+    starts.push_back(to);
+
+    std::vector<as_batch_write_record*> abwrs;
+    std::vector<as_operations*> wopsl;
+    as_batch_records recs;
+    as_batch_records_init(&recs, starts.size() - 1);
+    for (size_t r = 0; r + 1 < starts.size(); r++) {
+        as_operations* ops = as_operations_new(starts[r + 1] - starts[r]);
+        for (size_t i = starts[r]; i < starts[r + 1]; i++) {
+            as_operations_add_incr(ops, deltas[i].bin.c_str(), deltas[i].delta);
+        }
+        wopsl.push_back(ops);
+        const counter_delta& d = deltas[starts[r]];
+        as_batch_write_record* abwr = as_batch_write_reserve(&recs);
+        as_key_init_str(&(abwr->key), d.ns.c_str(), d.set.c_str(), d.key.c_str());
+        abwr->ops = ops;
+        abwrs.push_back(abwr);
+    }
+
+    as_error err;
+    as_status status = AEROSPIKE_ERR_CLIENT;
+    if (handle->is_aerospike_initialised && handle->is_connected) {
+        status = aerospike_batch_write(handle->as, &err, NULL, &recs);
+    } else {
+        as_error_update(&err, AEROSPIKE_ERR_CLIENT, "not connected");
+    }
+    bool ok = true;
+    if (status != AEROSPIKE_OK && status != AEROSPIKE_BATCH_FAILED) {
+        // nothing was written, the deltas wait for the next flush
+        for (size_t i = from; i < to; i++) {
+            const counter_delta& d = deltas[i];
+            if (counters_add(d.owner, d.ns, d.set, d.key, d.bin, d.delta)) {
+                enif_keep_resource(d.owner);
+            }
+        }
+        *error = err.message;
+        ok = false;
+    } else {
+        for (auto aitr : abwrs) {
+            cache_drop(handle, &aitr->key);
+            // a record error (e.g. a bin that is not an integer) does not get better, dropped
+            if (aitr->result != AEROSPIKE_OK) {
+                *error = std::string("key_inc flush: ") + as_error_string(aitr->result);
+                ok = false;
+            }
+        }
+    }
+    for (auto vitr : wopsl) {
+        as_operations_destroy(vitr);
+    }
+    as_batch_records_destroy(&recs);
+    return ok;
+}
+
+// writes everything aggregated so far, false with the last error if some deltas were not written
+static bool counters_flush(std::string* error)
+{
+    std::lock_guard<std::mutex> lock(counters_flush_mutex);
+    std::vector<counter_delta> deltas;
+    counters_drain(&deltas);
+    std::sort(deltas.begin(), deltas.end(), [](const counter_delta& a, const counter_delta& b) {
+        if (a.owner != b.owner) return a.owner < b.owner;
+        if (a.ns != b.ns) return a.ns < b.ns;
+        if (a.set != b.set) return a.set < b.set;
+        return a.key < b.key;
+    });
+
+    bool ok = true;
+    size_t from = 0;
+    while (from < deltas.size()) {
+        size_t to = from + 1;
+        while (to < deltas.size() && deltas[to].owner == deltas[from].owner) {
+            to++;
+        }
+        ok = counters_write(deltas, from, to, error) && ok;
+        from = to;
+    }
+    // every drained entry holds a reference of its cluster
+    for (auto& d : deltas) {
+        enif_release_resource(d.owner);
+    }
+    return ok;
+}
+
+static void counters_loop(uint32_t interval)
+{
+    std::unique_lock<std::mutex> lock(counters_thread_mutex);
+    while (!counters_thread_stop) {
+        counters_thread_cv.wait_for(lock, std::chrono::milliseconds(interval));
+        lock.unlock();
+        std::string error;
+        counters_flush(&error);
+        lock.lock();
+    }
+}
+
+// interval 0 stops the flush thread and writes what is left
+static void counters_configure(uint32_t interval)
+{
+    std::unique_lock<std::mutex> lock(counters_thread_mutex);
+    if (counters_thread.joinable()) {
+        counters_thread_stop = true;
+        counters_thread_cv.notify_all();
+        lock.unlock();
+        counters_thread.join();
+        lock.lock();
+    }
+    counters_aggregate.store(interval > 0, std::memory_order_relaxed);
+    counters_interval.store(interval, std::memory_order_relaxed);
+    counters_thread_stop = false;
+    if (interval > 0) {
+        counters_thread = std::thread(counters_loop, interval);
+    }
+}
+
+static ERL_NIF_TERM key_inc(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char name_space[MAX_NAMESPACE_SIZE];
+    char set[MAX_SET_SIZE];
+    char key_str[MAX_KEY_STR_SIZE];
+    unsigned int length;
+
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+	    return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM list = argv[4];
+    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
+	    return enif_make_badarg(env);
+    }
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[5], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    ERL_NIF_TERM rc, msg;
+    if (length == 0) {
+        rc = erl_ok;
+        msg = enif_make_string(env, "key_inc", ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    }
+
+    std::vector<std::pair<std::string, long>> incs;
+    incs.reserve(length);
+    for (uint i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        ERL_NIF_TERM tail;
+        char bin[AS_BIN_NAME_MAX_SIZE] = {0};
+        long val = 0;
+        int t_length;
+        const ERL_NIF_TERM* tuple = NULL;
+
+        if (!enif_get_list_cell(env, list, &head, &tail)) {
+            break;
+        }
+        if(!enif_get_tuple(env, head, &t_length, &tuple) || t_length != 2){
+            return enif_make_badarg(env);
+        }
+        if (!enif_get_string(env, tuple[0], bin, AS_BIN_NAME_MAX_SIZE, ERL_NIF_UTF8)) {
+    	    return enif_make_badarg(env);
+        }
+        if (!enif_get_long(env, tuple[1], &val)) {
+            return enif_make_badarg(env);
+        }
+        incs.push_back(std::make_pair(std::string(bin), val));
         list = tail;
     }
 
-    if (aerospike_key_operate(&as, &err, NULL, &key, &ops, NULL)  != AEROSPIKE_OK) {
+    if (counters_aggregate.load(std::memory_order_relaxed)) {
+        // written by the next flush, with the cluster's default policy
+        for (auto& inc : incs) {
+            if (counters_add(handle, name_space, set, key_str, inc.first, inc.second)) {
+                enif_keep_resource(handle);
+            }
+        }
+        return enif_make_tuple2(env, erl_ok, enif_make_string(env, "key_inc", ERL_NIF_UTF8));
+    }
+
+	as_error err;
+    as_key key;
+	as_key_init_str(&key, name_space, set, key_str);
+
+    as_operations ops;
+	as_operations_inita(&ops, length);
+    for (auto& inc : incs) {
+        as_operations_add_incr(&ops, inc.first.c_str(), inc.second);
+    }
+
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, NULL);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
         rc = erl_error;;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
     } else {
@@ -781,22 +1889,22 @@ static ERL_NIF_TERM a_key_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[
     char key_str[MAX_KEY_STR_SIZE];
     long n;
 
-    if (!enif_get_string(env, argv[0], bin, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], bin, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_long(env, argv[1], &val)) {
+    if (!enif_get_long(env, argv[2], &val)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[3], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[4], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[4], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[5], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_long(env, argv[5], &n)) {
+    if (!enif_get_long(env, argv[6], &n)) {
 	    return enif_make_badarg(env);
     }
     CHECK_ALL
@@ -817,12 +1925,13 @@ static ERL_NIF_TERM a_key_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[
     clock_gettime(CLOCK_REALTIME, &real_start);
 
     for (uint i=0; i < n; i++) {
-        if (aerospike_key_put(&as, &err, NULL, &key, &rec)  != AEROSPIKE_OK) {
+        if (aerospike_key_put(handle->as, &err, NULL, &key, &rec)  != AEROSPIKE_OK) {
             rc = erl_error;
             msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
             return enif_make_tuple2(env, rc, msg);
         }
     }
+    cache_drop(handle, &key);
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thread_done);
     clock_gettime(CLOCK_REALTIME, &real_done);
     // Convert to microseconds
@@ -851,15 +1960,21 @@ static ERL_NIF_TERM key_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     char set[MAX_SET_SIZE];
     char key_str[MAX_KEY_STR_SIZE];
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
+    as_policy_remove p;
+    const as_policy_remove* policy;
+    if (!get_remove_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
     ERL_NIF_TERM rc, msg;
@@ -868,7 +1983,9 @@ static ERL_NIF_TERM key_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 
 	as_key_init_str(&key, name_space, set, key_str);
 
-    if (aerospike_key_remove(&as, &err, NULL, &key)  != AEROSPIKE_OK) {
+    as_status status = aerospike_key_remove(handle->as, &err, policy, &key);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
     } else {
@@ -893,41 +2010,127 @@ static bool list_to_termlist_each(as_val *val, void *udata){
     return true;
 }
 
-ERL_NIF_TERM get_binary_asval(ErlNifEnv* env, const as_val * val) {
-    ERL_NIF_TERM fcap_key;
-    as_string *keystr = as_string_fromval(val);
-    auto len = as_string_len(keystr);
+// Large values are returned as a slice of the record kept by holder,
+// small ones (or without holder) are copied into a new binary.
+static ERL_NIF_TERM make_value_binary(ErlNifEnv* env, record_holder* holder, const uint8_t* data, size_t len) {
+    if (holder != NULL && len >= RESOURCE_BINARY_MIN_SIZE) {
+        return enif_make_resource_binary(env, holder, data, len);
+    }
+    ERL_NIF_TERM res;
     unsigned char * val_data;
-    val_data = enif_make_new_binary(env, len, &fcap_key);
-    memcpy(val_data, as_string_get(keystr), len);
-    return fcap_key;
+    val_data = enif_make_new_binary(env, len, &res);
+    memcpy(val_data, data, len);
+    return res;
+}
+
+ERL_NIF_TERM get_binary_asval(ErlNifEnv* env, const as_val * val, record_holder* holder) {
+    as_string *keystr = as_string_fromval(val);
+    return make_value_binary(env, holder, (const uint8_t*)as_string_get(keystr), as_string_len(keystr));
 }
 
-ERL_NIF_TERM get_binaryb_asval(ErlNifEnv* env, const as_val * val) {
-    ERL_NIF_TERM fcap_key;
+ERL_NIF_TERM get_binaryb_asval(ErlNifEnv* env, const as_val * val, record_holder* holder) {
     as_bytes *keystr = as_bytes_fromval(val);
-    auto len = as_bytes_size(keystr);
-    unsigned char * val_data;
-    val_data = enif_make_new_binary(env, len, &fcap_key);
-    memcpy(val_data, as_bytes_get(keystr), len);
-    return fcap_key;
+    return make_value_binary(env, holder, as_bytes_get(keystr), as_bytes_size(keystr));
+}
+
+// the value of an fcap entry, bytes or a string
+static ERL_NIF_TERM fcap_value_out(ErlNifEnv* env, const as_val* val, record_holder* holder) {
+    return as_val_type(val) == AS_BYTES ? get_binaryb_asval(env, val, holder) : get_binary_asval(env, val, holder);
+}
+
+// {Value, TTL, WT} of an fcap entry, written either as a {value, ttl, wt} map or in the
+// compact [value, ttl, wt] layout; false for anything else
+static bool format_fcap_entry(ErlNifEnv* env, const as_val* entry, record_holder* holder, ERL_NIF_TERM* res) {
+    ERL_NIF_TERM vnt = enif_make_atom(env, "undefined");
+    ERL_NIF_TERM ttlsm = enif_make_int64(env, 0);
+    ERL_NIF_TERM writetime = enif_make_int64(env, 0);
+
+    if (as_val_type(entry) == AS_LIST) {
+        const as_list* list = (const as_list*)entry;
+        if (as_list_size(list) != 3) {
+            return false;
+        }
+        const as_val* value = as_list_get(list, 0);
+        if (as_val_type(value) == AS_BYTES || as_val_type(value) == AS_STRING) {
+            vnt = fcap_value_out(env, value, holder);
+        }
+        ttlsm = enif_make_int64(env, as_list_get_int64(list, 1));
+        writetime = enif_make_int64(env, as_list_get_int64(list, 2));
+        *res = enif_make_tuple3(env, vnt, ttlsm, writetime);
+        return true;
+    }
+    if (as_val_type(entry) != AS_MAP) {
+        return false;
+    }
+
+    long fccount = 0;
+    const as_orderedmap *vmap = (const as_orderedmap*)as_map_fromval(entry);
+    as_orderedmap_iterator iti_int;
+    as_orderedmap_iterator_init(&iti_int, vmap);
+    while ( as_orderedmap_iterator_has_next(&iti_int) ) {
+        const as_val* valsm = as_orderedmap_iterator_next(&iti_int);
+        as_pair * aprsm = as_pair_fromval(valsm);
+        switch (as_val_type(as_pair_2(aprsm))) {
+            case AS_BYTES:
+            case AS_STRING:
+                vnt = fcap_value_out(env, as_pair_2(aprsm), holder);
+                fccount++;
+                break;
+            case AS_INTEGER: {
+                auto smkey = as_string_get((as_string*)as_pair_1(aprsm));
+                if(strcmp(smkey,"ttl") == 0){
+                    ttlsm = enif_make_int64(env, as_integer_get((as_integer*)as_pair_2(aprsm)));
+                }else if(strcmp(smkey,"wt") == 0) {
+                    writetime = enif_make_int64(env, as_integer_get((as_integer*)as_pair_2(aprsm)));
+                }
+                fccount++;
+            }break;
+            default:
+                break;
+        }
+    }
+    as_orderedmap_iterator_destroy(&iti_int);
+    if((fccount == 2) || (fccount == 3)){
+        *res = enif_make_tuple3(env, vnt, ttlsm, writetime);
+        return true;
+    }
+    return false;
+}
+
+// [SubKey, {Value, TTL, WT}, ...] of an fcap map; live_at > 0 leaves out the subkeys
+// that have expired by then according to their own ttl and wt
+static ERL_NIF_TERM format_fcap_map(ErlNifEnv* env, const as_orderedmap* amap, record_holder* holder, int64_t live_at) {
+    auto len = as_map_size((as_map *)amap);
+    std::vector<ERL_NIF_TERM> erl_list;
+    erl_list.reserve(len*2);
+
+    as_orderedmap_iterator it;
+    as_orderedmap_iterator_init(&it, amap);
+    while ( as_orderedmap_iterator_has_next(&it) ) {
+        const as_val* val = as_orderedmap_iterator_next(&it);
+        as_pair * apr = as_pair_fromval(val);
+        if (live_at > 0 && fcap_entry_expiry(as_pair_2(apr)) <= live_at) {
+            continue;
+        }
+        erl_list.push_back(get_binary_asval(env, as_pair_1(apr), NULL));
+
+        ERL_NIF_TERM entry;
+        if (format_fcap_entry(env, as_pair_2(apr), holder, &entry)) {
+            erl_list.push_back(entry);
+        }
+    }
+    as_orderedmap_iterator_destroy(&it);
+    return enif_make_list_from_array(env, erl_list.data(), erl_list.size());
 }
 
-static ERL_NIF_TERM format_value_out(ErlNifEnv* env, as_val_t type, as_bin_value *val) {
+static ERL_NIF_TERM format_value_out(ErlNifEnv* env, as_val_t type, as_bin_value *val, record_holder* holder) {
     switch(type) {
         case AS_INTEGER:
             return enif_make_int64(env, val->integer.value);
         case AS_STRING:
         case AS_BYTES: {
             as_bytes asbval = val->bytes;
-            uint8_t * bin_as_str = as_bytes_get(&asbval);
-            auto len = asbval.size;
-
-            unsigned char * val_data;
-            ERL_NIF_TERM res;
-            val_data = enif_make_new_binary(env, len, &res);
-            memcpy(val_data, bin_as_str, len);
-            return res;
+            return make_value_binary(env, holder, as_bytes_get(&asbval), asbval.size);
         }break;
         case AS_LIST: {
             auto len = as_list_size((as_list *)(&val->list));
@@ -940,59 +2143,8 @@ static ERL_NIF_TERM format_value_out(ErlNifEnv* env, as_val_t type, as_bin_value
             as_list_foreach((as_list *)(&val->list), list_to_termlist_each, &convd);
 	        return enif_make_list_from_array(env, erl_list->data(), len);
         }break;
-        case AS_MAP: {
-            auto len = as_map_size((as_map *)(&val->map));
-	        std::vector<ERL_NIF_TERM> * erl_list = new std::vector<ERL_NIF_TERM>();
-	        erl_list->reserve(len*2);
-            
-            const as_orderedmap *amap = (const as_orderedmap*)&val->map;
-            as_orderedmap_iterator it;
-            as_orderedmap_iterator_init(&it, amap);
-            while ( as_orderedmap_iterator_has_next(&it) ) {
-                long fccount = 0;
-                const as_val* val = as_orderedmap_iterator_next(&it);
-                as_pair * apr = as_pair_fromval(val);
-                erl_list->push_back(get_binary_asval(env, as_pair_1(apr)));
-
-                const as_orderedmap *vmap = (const as_orderedmap*)as_map_fromval(as_pair_2(apr));
-                as_orderedmap_iterator iti_int;
-                as_orderedmap_iterator_init(&iti_int, vmap);
-                ERL_NIF_TERM vnt = enif_make_atom(env, "undefined");
-                ERL_NIF_TERM ttlsm = enif_make_int64(env, 0);
-                ERL_NIF_TERM writetime = enif_make_int64(env, 0);
-                while ( as_orderedmap_iterator_has_next(&iti_int) ) {
-                    const as_val* valsm = as_orderedmap_iterator_next(&iti_int);
-                    as_pair * aprsm = as_pair_fromval(valsm);
-                    if(as_pair_2(aprsm)->type == 9){
-                        vnt = get_binaryb_asval(env, as_pair_2(aprsm));
-                        fccount++;
-                    }else if(as_pair_2(aprsm)->type == 3){
-                        auto smkey = as_string_get((as_string*)as_pair_1(aprsm));
-                        if(strcmp(smkey,"ttl") == 0){
-                            ttlsm = enif_make_int64(env, as_integer_get((as_integer*)as_pair_2(aprsm)));
-                        }else if(strcmp(smkey,"wt") == 0) {
-                            writetime = enif_make_int64(env, as_integer_get((as_integer*)as_pair_2(aprsm)));
-                        }
-                        fccount++;
-                    }else if(as_pair_2(aprsm)->type == 4){
-                        vnt = get_binary_asval(env, as_pair_2(aprsm));
-                        fccount++;
-                    }
-                }
-                as_orderedmap_iterator_destroy(&iti_int);
-                if((fccount == 2) || (fccount == 3)){
-                    erl_list->push_back(enif_make_tuple3(env, vnt, ttlsm, writetime));
-                }
-            }
-            as_orderedmap_iterator_destroy(&it);
-            if(erl_list->size() == 0){
-                return enif_make_list(env, 0);
-            } else {
-	            auto dlret = enif_make_list_from_array(env, erl_list->data(), erl_list->size());
-                delete erl_list;
-                return dlret;
-            }
-        }break;
+        case AS_MAP:
+            return format_fcap_map(env, (const as_orderedmap*)&val->map, holder, 0);
         default:
             char * val_as_str = as_val_tostring(val);
             ERL_NIF_TERM res =  enif_make_string(env, as_val_tostring(val), ERL_NIF_UTF8);
@@ -1003,7 +2155,7 @@ static ERL_NIF_TERM format_value_out(ErlNifEnv* env, as_val_t type, as_bin_value
 
 
 
-static ERL_NIF_TERM dump_records(ErlNifEnv* env, const as_record *p_rec) {
+static ERL_NIF_TERM dump_records(ErlNifEnv* env, const as_record *p_rec, record_holder* holder) {
     ERL_NIF_TERM res;
 
 	if (p_rec->key.valuep) {
@@ -1021,10 +2173,13 @@ static ERL_NIF_TERM dump_records(ErlNifEnv* env, const as_record *p_rec) {
     while (as_record_iterator_has_next(&it)) {
         const as_bin* p_bin = as_record_iterator_next(&it);
         char* name = as_bin_get_name(p_bin);
+        if (is_expiry_bin(p_rec, name)) {
+            continue;
+        }
         uint type = as_bin_get_type(p_bin);
 		ERL_NIF_TERM cell = enif_make_tuple2(env,
             enif_make_string(env, name, ERL_NIF_UTF8),
-            format_value_out(env, type, as_bin_get_value(p_bin))
+            format_value_out(env, type, as_bin_get_value(p_bin), holder)
             );
         res = enif_make_list_cell(env, cell, res);
 	}
@@ -1040,15 +2195,21 @@ static ERL_NIF_TERM key_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     char set[MAX_SET_SIZE];
     char key_str[MAX_KEY_STR_SIZE];
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
     ERL_NIF_TERM rc, msg;
@@ -1058,7 +2219,7 @@ static ERL_NIF_TERM key_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 
 	as_key_init_str(&key, name_space, set, key_str);
 
-    if (aerospike_key_get(&as, &err, NULL, &key, &p_rec)  != AEROSPIKE_OK) {
+    if (aerospike_key_get(handle->as, &err, policy, &key, &p_rec)  != AEROSPIKE_OK) {
         if (p_rec != NULL) {
             as_record_destroy(p_rec);
         }
@@ -1072,16 +2233,16 @@ static ERL_NIF_TERM key_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
         return enif_make_tuple2(env, rc, msg);
     }
 
-    msg = dump_records(env, p_rec);
+    // the holder owns p_rec now, it is destroyed with the last binary pointing into it
+    record_holder* holder = record_holder_new(p_rec);
+    msg = dump_records(env, p_rec, holder);
     rc = erl_ok;
-    if (p_rec != NULL) {
-        as_record_destroy(p_rec);
-    }
+    enif_release_resource(holder);
     return enif_make_tuple2(env, rc, msg);
 }
 
 
-static ERL_NIF_TERM dump_binary_records(ErlNifEnv* env, const as_record *p_rec) {
+static ERL_NIF_TERM dump_binary_records(ErlNifEnv* env, const as_record *p_rec, record_holder* holder) {
     ERL_NIF_TERM res;
 	
     if (p_rec->key.valuep) {
@@ -1104,6 +2265,9 @@ static ERL_NIF_TERM dump_binary_records(ErlNifEnv* env, const as_record *p_rec)
     while (as_record_iterator_has_next(&it)) {
         const as_bin* p_bin = as_record_iterator_next(&it);
         char* name = as_bin_get_name(p_bin);
+        if (is_expiry_bin(p_rec, name)) {
+            continue;
+        }
         auto namelen = strlen(name);
         uint type = as_bin_get_type(p_bin);
 
@@ -1114,7 +2278,7 @@ static ERL_NIF_TERM dump_binary_records(ErlNifEnv* env, const as_record *p_rec)
 
 		ERL_NIF_TERM cell = enif_make_tuple2(env,
             name_term,
-            format_value_out(env, type, as_bin_get_value(p_bin))
+            format_value_out(env, type, as_bin_get_value(p_bin), holder)
             );
         res = enif_make_list_cell(env, cell, res);
 	}
@@ -1125,7 +2289,7 @@ static ERL_NIF_TERM dump_binary_records(ErlNifEnv* env, const as_record *p_rec)
 
 }
 
-static ERL_NIF_TERM dump_cdt_records(ErlNifEnv* env, const as_record *p_rec) {
+static ERL_NIF_TERM dump_cdt_records(ErlNifEnv* env, const as_record *p_rec, record_holder* holder) {
     ERL_NIF_TERM res;
     if (p_rec->key.valuep) {
         unsigned char* key_data;
@@ -1146,6 +2310,9 @@ static ERL_NIF_TERM dump_cdt_records(ErlNifEnv* env, const as_record *p_rec) {
     while (as_record_iterator_has_next(&it)) {
         const as_bin* p_bin = as_record_iterator_next(&it);
         char* name = as_bin_get_name(p_bin);
+        if (is_expiry_bin(p_rec, name)) {
+            continue;
+        }
         auto namelen = strlen(name);
         uint type = as_bin_get_type(p_bin);
 
@@ -1157,7 +2324,7 @@ static ERL_NIF_TERM dump_cdt_records(ErlNifEnv* env, const as_record *p_rec) {
 
 		ERL_NIF_TERM cell = enif_make_tuple2(env,
             name_term,
-            format_value_out(env, type, as_bin_get_value(p_bin))
+            format_value_out(env, type, as_bin_get_value(p_bin), holder)
             );
         res = enif_make_list_cell(env, cell, res);
 	}
@@ -1172,22 +2339,28 @@ static ERL_NIF_TERM cdt_expire(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     std::string name_space, aspk_set, aspk_key;
     long ttl;
     
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
     
-    if (!enif_get_long(env, argv[3], &ttl)) {
+    if (!enif_get_long(env, argv[4], &ttl)) {
+        return enif_make_badarg(env);
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[5], &p, &policy)) {
         return enif_make_badarg(env);
     }
 
@@ -1242,7 +2415,9 @@ static ERL_NIF_TERM cdt_expire(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     as_operations_add_map_remove_by_key_list(&ops, bin_str.c_str(), (as_list*)&remove_list, AS_MAP_RETURN_NONE);
     as_arraylist_destroy(&remove_list);*/
 
-    if(aerospike_key_operate(&as, &err, NULL, &key, &ops, NULL) != AEROSPIKE_OK){
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, NULL);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
     } else {
@@ -1261,26 +2436,32 @@ static ERL_NIF_TERM cdt_delete_by_keys_batch(ErlNifEnv* env, int argc, const ERL
     unsigned int length;
 
     
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
     
-    if (!enif_inspect_binary(env, argv[2], &bin_name)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_name)) {
 	    return enif_make_badarg(env);
     }
     bin_str.assign((const char*) bin_name.data, bin_name.size);
     
-    ERL_NIF_TERM key_subkeys_list = argv[3];
+    ERL_NIF_TERM key_subkeys_list = argv[4];
     if (!enif_is_list(env, key_subkeys_list) || !enif_get_list_length(env, key_subkeys_list, &length)) {
 	    return enif_make_badarg(env);
     }
 
+    as_policy_batch p;
+    const as_policy_batch* policy;
+    if (!get_batch_policy(env, argv[5], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
     ERL_NIF_TERM rc, msg;
     std::vector<std::string> bin_str_list(length);
@@ -1288,6 +2469,9 @@ static ERL_NIF_TERM cdt_delete_by_keys_batch(ErlNifEnv* env, int argc, const ERL
     std::vector<as_batch_write_record*> abwrs(length);
     std::vector<as_operations> wopsl(length);
     std::vector<as_arraylist> rval(length);
+    std::vector<as_arraylist> exp_rval(length);
+    std::string exp_bin_str;
+    bool has_index = expiry_bin_name(bin_str, &exp_bin_str);
 
     as_batch_records recs;
 	as_batch_records_inita(&recs, length);
@@ -1322,6 +2506,7 @@ static ERL_NIF_TERM cdt_delete_by_keys_batch(ErlNifEnv* env, int argc, const ERL
         auto ts_list = ksk_tuple[1];
         std::vector<std::string> bin_str_sk_list(ts_length);
 	    as_arraylist_init(&(rval[i]), ts_length, ts_length);
+	    as_arraylist_init(&(exp_rval[i]), ts_length, ts_length);
         for(uint j = 0; j < ts_length; j++){
             ERL_NIF_TERM skl_head;
             ERL_NIF_TERM skl_tail;
@@ -1335,21 +2520,27 @@ static ERL_NIF_TERM cdt_delete_by_keys_batch(ErlNifEnv* env, int argc, const ERL
             }
             bin_str_sk_list[j].assign((const char*) skl_bin_bin.data, skl_bin_bin.size);
 	        as_arraylist_append_str(&(rval[i]), (char*)bin_str_sk_list[j].c_str());
+	        as_arraylist_append_str(&(exp_rval[i]), (char*)bin_str_sk_list[j].c_str());
 
             ts_list = skl_tail;
         }
         skeys_lst.push_back(bin_str_sk_list);
-        as_operations_inita(&(wopsl[i]), 1);
+        as_operations_inita(&(wopsl[i]), 2);
         as_operations_add_map_remove_by_key_list(&(wopsl[i]), bin_str.c_str(), (as_list*)&(rval[i]), AS_MAP_RETURN_NONE);
-        wopsl[i].ttl = AS_RECORD_CLIENT_DEFAULT_TTL;
+        if (has_index) {
+            as_operations_add_map_remove_by_key_list(&(wopsl[i]), exp_bin_str.c_str(), (as_list*)&(exp_rval[i]), AS_MAP_RETURN_NONE);
+        }
+        wopsl[i].ttl = 1000;
         abwrs[i]->ops = &(wopsl[i]);
 
         key_subkeys_list = tail;
     }
 
-    as.config.policies.batch_write.ttl = 1000;
     as_error err;
-	as_status status = aerospike_batch_write(&as, &err, NULL, &recs);
+	as_status status = aerospike_batch_write(handle->as, &err, policy, &recs);
+    for (auto aitr : abwrs) {
+        cache_drop(handle, &aitr->key);
+    }
 
 	std::vector<ERL_NIF_TERM> * erl_list = new std::vector<ERL_NIF_TERM>();
     for(auto aitr : abwrs){
@@ -1367,225 +2558,1292 @@ static ERL_NIF_TERM cdt_delete_by_keys_batch(ErlNifEnv* env, int argc, const ERL
         as_operations_destroy(&vitr);
     }
 
-    as_batch_records_destroy(&recs);
-    if(status != AEROSPIKE_OK){
-        rc = erl_error;
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
-    } else {
-        rc = erl_ok; 
-        return enif_make_tuple2(env, rc, opsl);
+    as_batch_records_destroy(&recs);
+    if(status != AEROSPIKE_OK){
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    } else {
+        rc = erl_ok; 
+        return enif_make_tuple2(env, rc, opsl);
+    }
+}
+
+static ERL_NIF_TERM cdt_delete_by_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin_ns, bin_set, bin_key, bin_name;
+    std::string name_space, aspk_set, aspk_key, bin_str;
+    unsigned int length;
+    
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+    
+    if (!enif_inspect_binary(env, argv[4], &bin_name)) {
+	    return enif_make_badarg(env);
+    }
+    bin_str.assign((const char*) bin_name.data, bin_name.size);
+    
+    ERL_NIF_TERM list = argv[5];
+    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
+	    return enif_make_badarg(env);
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[6], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+    
+    as_arraylist remove_list, exp_remove_list;
+	as_arraylist_init(&remove_list, length, length);
+	as_arraylist_init(&exp_remove_list, length, length);
+
+    ERL_NIF_TERM rc, msg;
+	as_error err;
+    as_key key;
+
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+    
+    // the subkeys and their expiry index entries
+    as_operations ops;
+    as_operations_inita(&ops, 2);
+    as_map_policy put_mode;
+    as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
+
+    ErlNifBinary subkey_term;
+    std::string subkey_str;
+    unsigned int subkeys_num = 0;
+    for (uint i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        ERL_NIF_TERM tail;
+        if (!enif_get_list_cell(env, list, &head, &tail)) {
+            break;
+        }
+        if (enif_inspect_binary(env, head, &subkey_term)) {
+            subkey_str.assign((const char*) subkey_term.data, subkey_term.size);
+	        as_arraylist_append_str(&remove_list, (char*)subkey_str.c_str());
+	        as_arraylist_append_str(&exp_remove_list, (char*)subkey_str.c_str());
+            subkeys_num++;
+        }
+        list = tail;
+    }
+    if(subkeys_num == length){
+        as_operations_add_map_remove_by_key_list(&ops, bin_str.c_str(), (as_list*)&remove_list, AS_MAP_RETURN_NONE);
+        std::string exp_bin_str;
+        if (expiry_bin_name(bin_str, &exp_bin_str)) {
+            as_operations_add_map_remove_by_key_list(&ops, exp_bin_str.c_str(), (as_list*)&exp_remove_list, AS_MAP_RETURN_NONE);
+        }
+    }
+    as_arraylist_destroy(&remove_list);
+    as_arraylist_destroy(&exp_remove_list);
+
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, NULL);
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+    } else {
+        rc = erl_ok;
+        msg = enif_make_string(env, "keys_deleted", ERL_NIF_UTF8);
+    }
+    as_operations_destroy(&ops);
+
+    return enif_make_tuple2(env, rc, msg);
+}
+
+// Adds the expiry index entries that are missing in exp_bin for subkeys of bin, computed from
+// the ttl and wt of the entries themselves: subkeys written before the writers kept the index.
+// Index entries written meanwhile are not overwritten.
+static as_status index_fcap_expiry(aspike_cluster* handle, as_error* err, const as_policy_operate* policy,
+    const as_key* key, const char* bin, const char* exp_bin)
+{
+    as_record* p_rec = NULL;
+    as_exp_build(unindexed_exp,
+        as_exp_cond(
+            as_exp_bin_exists(exp_bin),
+            as_exp_map_remove_by_key_list(NULL,
+                as_exp_map_get_by_index_range_to_end(NULL, AS_MAP_RETURN_KEY, as_exp_int(0), as_exp_bin_map(exp_bin)),
+                as_exp_bin_map(bin)),
+            as_exp_bin_map(bin)));
+    as_operations ops;
+    as_operations_inita(&ops, 1);
+    as_operations_exp_read(&ops, bin, unindexed_exp, AS_EXP_READ_EVAL_NO_FAIL);
+    as_status status = aerospike_key_operate(handle->as, err, policy, key, &ops, &p_rec);
+    as_operations_destroy(&ops);
+    as_exp_destroy(unindexed_exp);
+    if (status != AEROSPIKE_OK || p_rec == NULL) {
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        return status;
+    }
+
+    as_bin_value* entries = as_record_get(p_rec, bin);
+    if (entries == NULL || as_val_type((as_val*)entries) != AS_MAP || as_map_size((as_map*)entries) == 0) {
+        as_record_destroy(p_rec);
+        return AEROSPIKE_OK;
+    }
+    // freed by the operation
+    as_orderedmap* items = as_orderedmap_new(as_map_size((as_map*)entries));
+    as_orderedmap_iterator it;
+    as_orderedmap_iterator_init(&it, (const as_orderedmap*)entries);
+    while (as_orderedmap_iterator_has_next(&it)) {
+        as_pair* apr = as_pair_fromval(as_orderedmap_iterator_next(&it));
+        as_orderedmap_set(items, (as_val*)as_string_new_strdup(as_string_get(as_string_fromval(as_pair_1(apr)))),
+            (as_val*)as_integer_new(fcap_entry_expiry(as_pair_2(apr))));
+    }
+    as_orderedmap_iterator_destroy(&it);
+    as_record_destroy(p_rec);
+
+    // only for the record that is there, keeping its ttl
+    as_policy_operate p = policy ? *policy : handle->as->config.policies.operate;
+    p.exists = AS_POLICY_EXISTS_UPDATE;
+    as_map_policy create_mode;
+    as_map_policy_set_flags(&create_mode, AS_MAP_KEY_ORDERED,
+        AS_MAP_WRITE_CREATE_ONLY | AS_MAP_WRITE_NO_FAIL | AS_MAP_WRITE_PARTIAL);
+    as_operations index_ops;
+    as_operations_inita(&index_ops, 1);
+    index_ops.ttl = AS_RECORD_NO_CHANGE_TTL;
+    as_operations_map_put_items(&index_ops, exp_bin, NULL, &create_mode, (as_map*)items);
+    status = aerospike_key_operate(handle->as, err, &p, key, &index_ops, NULL);
+    as_operations_destroy(&index_ops);
+    return status;
+}
+
+// the subkeys of bin once the expired ones are gone, 0 without bin
+#define FCAP_COUNT(bin) \
+    as_exp_cond(as_exp_bin_exists(bin), as_exp_map_size(NULL, as_exp_bin_map(bin)), as_exp_int(0))
+// the subkeys of bin without an entry in the expiry index exp_bin
+#define FCAP_UNINDEXED(bin, exp_bin) \
+    as_exp_cond( \
+        as_exp_bin_exists(bin), \
+        as_exp_map_size(NULL, \
+            as_exp_cond( \
+                as_exp_bin_exists(exp_bin), \
+                as_exp_map_remove_by_key_list(NULL, \
+                    as_exp_map_get_by_index_range_to_end(NULL, AS_MAP_RETURN_KEY, as_exp_int(0), \
+                        as_exp_bin_map(exp_bin)), \
+                    as_exp_bin_map(bin)), \
+                as_exp_bin_map(bin))), \
+        as_exp_int(0))
+
+// cdt_check_and_put(Cluster, Ns, Set, Key, {Bin, SubKey, Value, SubTtl}, Cap, TTL, Policy)
+//     -> {ok, Count, Written} | {error, Msg}
+// One operate: drops the subkeys of Bin that expired according to the expiry index
+// (expiry_bin_name()), counts the rest and puts SubKey only if Count < Cap. When some subkeys
+// have no index entry yet, nothing is written: the index is completed from the entries
+// (index_fcap_expiry()) and the operate is sent once more.
+static ERL_NIF_TERM cdt_check_and_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_CDT_CHECK_AND_PUT)
+    ErlNifBinary bin_ns, bin_set, bin_key, bin_name, bin_subkey, bin_value;
+    std::string name_space, aspk_set, aspk_key, bin_str, exp_bin_str, subkey;
+    const ERL_NIF_TERM* tuple = NULL;
+    int t_length;
+    long sub_ttl, cap, ttl;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    if (!enif_get_tuple(env, argv[4], &t_length, &tuple) || t_length != 4
+        || !enif_inspect_binary(env, tuple[0], &bin_name)
+        || !enif_inspect_binary(env, tuple[1], &bin_subkey)
+        || !enif_inspect_binary(env, tuple[2], &bin_value)
+        || !enif_get_long(env, tuple[3], &sub_ttl)) {
+        return enif_make_badarg(env);
+    }
+    bin_str.assign((const char*) bin_name.data, bin_name.size);
+    if (!expiry_bin_name(bin_str, &exp_bin_str)) {
+        return enif_make_badarg(env);
+    }
+    subkey.assign((const char*) bin_subkey.data, bin_subkey.size);
+
+    if (!enif_get_long(env, argv[5], &cap) || !enif_get_long(env, argv[6], &ttl)) {
+        return enif_make_badarg(env);
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[7], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    ERL_NIF_TERM res;
+	as_error err;
+    as_key key;
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    long wt = std::chrono::duration_cast<std::chrono::seconds>(now).count();
+    const char* bin = bin_str.c_str();
+    const char* exp_bin = exp_bin_str.c_str();
+
+    as_map_policy put_mode;
+    as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
+
+    // the entry as cdt_put writes it, and the maps for bins that do not exist yet
+    as_val* entry;
+    if (compact_entries.load(std::memory_order_relaxed)) {
+        entry = (as_val*)compact_entry_new((as_val*)as_bytes_new_wrap(bin_value.data, bin_value.size, false),
+            sub_ttl, wt);
+    } else {
+        as_orderedmap* entry_map = as_orderedmap_new(3);
+        as_orderedmap_set(entry_map, (as_val*)as_string_new_strdup("value"),
+            (as_val*)as_bytes_new_wrap(bin_value.data, bin_value.size, false));
+        as_orderedmap_set(entry_map, (as_val*)as_string_new_strdup("ttl"), (as_val*)as_integer_new(sub_ttl));
+        as_orderedmap_set(entry_map, (as_val*)as_string_new_strdup("wt"), (as_val*)as_integer_new(wt));
+        entry = (as_val*)entry_map;
+    }
+    int64_t expiry = fcap_expiry(wt, sub_ttl);
+    as_orderedmap* new_map = as_orderedmap_new(1);
+    as_val_reserve(entry);
+    as_orderedmap_set(new_map, (as_val*)as_string_new_strdup(subkey.c_str()), entry);
+    as_orderedmap* new_exp_map = as_orderedmap_new(1);
+    as_orderedmap_set(new_exp_map, (as_val*)as_string_new_strdup(subkey.c_str()), (as_val*)as_integer_new(expiry));
+
+    // removes the subkeys whose expiry time has passed
+    as_exp_build(expire_exp,
+        as_exp_map_remove_by_key_list(NULL,
+            as_exp_map_get_by_value_range(NULL, AS_MAP_RETURN_KEY, as_exp_int(0), as_exp_int(wt + 1),
+                as_exp_bin_map(exp_bin)),
+            as_exp_bin_map(bin)));
+    as_exp_build(count_exp, FCAP_COUNT(bin));
+    as_exp_build(unindexed_exp, FCAP_UNINDEXED(bin, exp_bin));
+    // SubKey => expiry time, unless the cap is reached or the index is not complete
+    as_exp_build(put_exp_exp,
+        as_exp_cond(
+            as_exp_not(as_exp_and(
+                as_exp_cmp_lt(FCAP_COUNT(bin), as_exp_int(cap)),
+                as_exp_cmp_eq(FCAP_UNINDEXED(bin, exp_bin), as_exp_int(0)))),
+            as_exp_unknown(),
+            as_exp_bin_exists(exp_bin),
+            as_exp_map_put(NULL, &put_mode, as_exp_str(subkey.c_str()), as_exp_int(expiry), as_exp_bin_map(exp_bin)),
+            as_exp_val(new_exp_map)));
+    // SubKey => entry, on the same conditions
+    as_exp_build(put_exp,
+        as_exp_cond(
+            as_exp_not(as_exp_and(
+                as_exp_cmp_lt(FCAP_COUNT(bin), as_exp_int(cap)),
+                as_exp_cmp_eq(FCAP_UNINDEXED(bin, exp_bin), as_exp_int(0)))),
+            as_exp_unknown(),
+            as_exp_bin_exists(bin),
+            as_exp_map_put(NULL, &put_mode, as_exp_str(subkey.c_str()), as_exp_val(entry), as_exp_bin_map(bin)),
+            as_exp_val(new_map)));
+    // the expressions are packed, the values are not needed anymore
+    as_orderedmap_destroy(new_map);
+    as_orderedmap_destroy(new_exp_map);
+    as_val_destroy(entry);
+
+    as_integer range_begin, range_end;
+    as_integer_init(&range_begin, 0);
+    as_integer_init(&range_end, wt + 1);
+
+    // the operations run in this order, the puts see the count after the expiry
+    as_operations ops;
+    as_operations_inita(&ops, 6);
+    ops.ttl = ttl != 0 ? ttl : AS_RECORD_NO_CHANGE_TTL;
+    as_operations_exp_write(&ops, bin, expire_exp, AS_EXP_WRITE_EVAL_NO_FAIL);
+    as_operations_map_remove_by_value_range(&ops, exp_bin, NULL, (as_val*)&range_begin, (as_val*)&range_end,
+        AS_MAP_RETURN_NONE);
+    as_operations_exp_read(&ops, "count", count_exp, AS_EXP_READ_DEFAULT);
+    as_operations_exp_read(&ops, "unindexed", unindexed_exp, AS_EXP_READ_DEFAULT);
+    as_operations_exp_write(&ops, exp_bin, put_exp_exp, AS_EXP_WRITE_EVAL_NO_FAIL);
+    as_operations_exp_write(&ops, bin, put_exp, AS_EXP_WRITE_EVAL_NO_FAIL);
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status;
+    int64_t count = 0;
+    int64_t unindexed = 0;
+    for (int attempt = 0; ; attempt++) {
+        as_record* p_rec = NULL;
+        status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, &p_rec);
+        if (status == AEROSPIKE_OK && p_rec != NULL) {
+            count = as_record_get_int64(p_rec, "count", 0);
+            unindexed = as_record_get_int64(p_rec, "unindexed", 0);
+        }
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        if (status != AEROSPIKE_OK || unindexed == 0 || attempt > 0) {
+            break;
+        }
+        status = index_fcap_expiry(handle, &err, policy, &key, bin, exp_bin);
+        if (status != AEROSPIKE_OK) {
+            break;
+        }
+    }
+    STATS_PHASE(STATS_CALL)
+    cache_drop(handle, &key);
+    if (status != AEROSPIKE_OK) {
+        res = enif_make_tuple2(env, erl_error, enif_make_string(env, err.message, ERL_NIF_UTF8));
+    } else {
+        res = enif_make_tuple3(env, erl_ok, enif_make_int64(env, count),
+            enif_make_atom(env, count < cap && unindexed == 0 ? "true" : "false"));
+    }
+    as_operations_destroy(&ops);
+    as_exp_destroy(expire_exp);
+    as_exp_destroy(count_exp);
+    as_exp_destroy(unindexed_exp);
+    as_exp_destroy(put_exp_exp);
+    as_exp_destroy(put_exp);
+    as_key_destroy(&key);
+    STATS_PHASE(STATS_ENCODE)
+    return res;
+}
+
+#undef FCAP_COUNT
+#undef FCAP_UNINDEXED
+
+static ERL_NIF_TERM cdt_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_CDT_GET)
+    ErlNifBinary bin_ns, bin_set, bin_key;
+    std::string name_space, aspk_set, aspk_key;
+    
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    // {max_retries, sleep_between_retries, socket_timeout, total_timeout} or policy_new(read, ...)
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    ERL_NIF_TERM rc, msg;
+	as_error err;
+    as_key key;
+    as_record* p_rec = NULL;    
+
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    std::string ckey;
+    uint64_t cache_ticket = 0;
+    uint64_t negcache_ticket = 0;
+    flight* fl = NULL;
+    if (any_cache_enabled()) {
+        ckey = cache_key(handle, &key);
+        if (negcache_enabled() && negcache_lookup(ckey, &negcache_ticket)) {
+            as_key_destroy(&key);
+            return not_found_error(env);
+        }
+        if (cache_enabled() && cache_get(ckey, env, &msg, &cache_ticket)) {
+            as_key_destroy(&key);
+            return enif_make_tuple2(env, erl_ok, msg);
+        }
+        if (flight_enabled() && (fl = flight_enter(ckey, FLIGHT_CDT_GET, env, &msg)) == NULL) {
+            as_key_destroy(&key);
+            return msg;
+        }
+    }
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_get(handle->as, &err, policy, &key, &p_rec);
+    STATS_PHASE(STATS_CALL)
+    if (status != AEROSPIKE_OK) {
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        if (status == AEROSPIKE_ERR_RECORD_NOT_FOUND && !ckey.empty()) {
+            negcache_insert(ckey, negcache_ticket);
+        }
+        rc = erl_error;
+        as_key_destroy(&key);
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+        return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+    }
+
+    as_key_destroy(&key);
+    if (p_rec == NULL) {
+        rc = erl_error;
+        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
+        return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+    }
+
+    // the holder owns p_rec now, it is destroyed with the last binary pointing into it
+    record_holder* holder = record_holder_new(p_rec);
+    msg = dump_cdt_records(env, p_rec, holder);
+    rc = erl_ok;
+    enif_release_resource(holder);
+    if (cache_enabled() && !ckey.empty()) {
+        cache_put(ckey, env, msg, cache_ticket);
+    }
+    STATS_PHASE(STATS_ENCODE)
+    return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+
+//
+}
+
+// cdt_get_live(Cluster, Ns, Set, Key, Bins, Policy) -> {ok, [{Bin, Entries}]} | {error, Msg}
+// Like cdt_get for the map bins Bins, but without the expired subkeys: those expired by the
+// expiry index (expiry_bin_name()) are dropped by an expression on the server, so they are
+// neither sent nor decoded; subkeys not indexed yet are sent and left out while decoding.
+static ERL_NIF_TERM cdt_get_live(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_CDT_GET_LIVE)
+    ErlNifBinary bin_ns, bin_set, bin_key, bin_name;
+    std::string name_space, aspk_set, aspk_key;
+    unsigned int length;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    ERL_NIF_TERM list = argv[4];
+    if (!enif_get_list_length(env, list, &length) || length == 0) {
+	    return enif_make_badarg(env);
+    }
+    std::vector<std::string> bins(length), exp_bins(length);
+    for (unsigned int i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        if (!enif_get_list_cell(env, list, &head, &list) || !enif_inspect_binary(env, head, &bin_name)
+            || bin_name.size >= AS_BIN_NAME_MAX_SIZE) {
+            return enif_make_badarg(env);
+        }
+        bins[i].assign((const char*) bin_name.data, bin_name.size);
+        if (!expiry_bin_name(bins[i], &exp_bins[i])) {
+            return enif_make_badarg(env);
+        }
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[5], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    ERL_NIF_TERM rc, msg;
+	as_error err;
+    as_key key;
+    as_record* p_rec = NULL;
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    long wt = std::chrono::duration_cast<std::chrono::seconds>(now).count();
+
+    // Bin without the subkeys that expired by now, read back under the name of Bin
+    as_operations ops;
+    as_operations_init(&ops, length);
+    std::vector<as_exp*> exps(length);
+    for (unsigned int i = 0; i < length; i++) {
+        const char* bin = bins[i].c_str();
+        const char* exp_bin = exp_bins[i].c_str();
+        as_exp_build(live_exp,
+            as_exp_cond(
+                as_exp_bin_exists(exp_bin),
+                as_exp_map_remove_by_key_list(NULL,
+                    as_exp_map_get_by_value_range(NULL, AS_MAP_RETURN_KEY, as_exp_int(0), as_exp_int(wt + 1),
+                        as_exp_bin_map(exp_bin)),
+                    as_exp_bin_map(bin)),
+                as_exp_bin_map(bin)));
+        exps[i] = live_exp;
+        as_operations_exp_read(&ops, bin, live_exp, AS_EXP_READ_EVAL_NO_FAIL);
+    }
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, &p_rec);
+    STATS_PHASE(STATS_CALL)
+    as_operations_destroy(&ops);
+    for (unsigned int i = 0; i < length; i++) {
+        as_exp_destroy(exps[i]);
+    }
+    as_key_destroy(&key);
+    if (status != AEROSPIKE_OK) {
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    }
+    if (p_rec == NULL) {
+        rc = erl_error;
+        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    }
+
+    // the holder owns p_rec now, it is destroyed with the last binary pointing into it
+    record_holder* holder = record_holder_new(p_rec);
+    msg = enif_make_list(env, 0);
+    for (unsigned int i = length; i-- > 0; ) {
+        ERL_NIF_TERM name_term;
+        unsigned char* name_data = enif_make_new_binary(env, bins[i].size(), &name_term);
+        memcpy(name_data, bins[i].data(), bins[i].size());
+        // a bin that does not exist comes back nil
+        as_bin_value* val = as_record_get(p_rec, bins[i].c_str());
+        ERL_NIF_TERM entries = val != NULL && as_val_type((as_val*)val) == AS_MAP
+            ? format_fcap_map(env, (const as_orderedmap*)val, holder, wt)
+            : enif_make_list(env, 0);
+        msg = enif_make_list_cell(env, enif_make_tuple2(env, name_term, entries), msg);
+    }
+    rc = erl_ok;
+    enif_release_resource(holder);
+    STATS_PHASE(STATS_ENCODE)
+    return enif_make_tuple2(env, rc, msg);
+}
+
+// cdt_get_subkeys(Cluster, Ns, Set, Key, Bin, SubKeys, Policy) -> {ok, Entries} | {error, Msg}
+// Only the SubKeys entries of the map bin Bin, in the cdt_get format
+// ([SubKey, {Value, TTL, WT}, ...], in key order); subkeys that do not exist are left out.
+static ERL_NIF_TERM cdt_get_subkeys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_CDT_GET_SUBKEYS)
+    ErlNifBinary bin_ns, bin_set, bin_key, bin_name, bin_subkey;
+    std::string name_space, aspk_set, aspk_key, bin_str, subkey;
+    unsigned int length;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    if (!enif_inspect_binary(env, argv[4], &bin_name) || bin_name.size >= AS_BIN_NAME_MAX_SIZE) {
+	    return enif_make_badarg(env);
+    }
+    bin_str.assign((const char*) bin_name.data, bin_name.size);
+
+    ERL_NIF_TERM list = argv[5];
+    if (!enif_get_list_length(env, list, &length)) {
+	    return enif_make_badarg(env);
+    }
+    if (length == 0) {
+        return enif_make_tuple2(env, erl_ok, enif_make_list(env, 0));
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[6], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    as_arraylist subkeys;
+    as_arraylist_init(&subkeys, length, 0);
+    for (unsigned int i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        if (!enif_get_list_cell(env, list, &head, &list) || !enif_inspect_binary(env, head, &bin_subkey)) {
+            as_arraylist_destroy(&subkeys);
+            return enif_make_badarg(env);
+        }
+        subkey.assign((const char*) bin_subkey.data, bin_subkey.size);
+        as_arraylist_append_str(&subkeys, subkey.c_str());
+    }
+
+    ERL_NIF_TERM rc, msg;
+	as_error err;
+    as_key key;
+    as_record* p_rec = NULL;
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    as_operations ops;
+    as_operations_inita(&ops, 1);
+    // the operation owns the list now
+    as_operations_map_get_by_key_list(&ops, bin_str.c_str(), NULL, (as_list*)&subkeys, AS_MAP_RETURN_KEY_VALUE);
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_operate(handle->as, &err, policy, &key, &ops, &p_rec);
+    STATS_PHASE(STATS_CALL)
+    as_operations_destroy(&ops);
+    as_key_destroy(&key);
+    if (status != AEROSPIKE_OK) {
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    }
+    if (p_rec == NULL) {
+        rc = erl_error;
+        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
+        return enif_make_tuple2(env, rc, msg);
+    }
+
+    // the holder owns p_rec now, it is destroyed with the last binary pointing into it
+    record_holder* holder = record_holder_new(p_rec);
+    as_bin_value* val = as_record_get(p_rec, bin_str.c_str());
+    msg = val != NULL && as_val_type((as_val*)val) == AS_MAP
+        ? format_value_out(env, AS_MAP, val, holder)
+        : enif_make_list(env, 0);
+    rc = erl_ok;
+    enif_release_resource(holder);
+    STATS_PHASE(STATS_ENCODE)
+    return enif_make_tuple2(env, rc, msg);
+}
+
+static ERL_NIF_TERM binary_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_BINARY_GET)
+    ErlNifBinary bin_ns, bin_set, bin_key;
+    std::string name_space, aspk_set, aspk_key;
+    
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+    ERL_NIF_TERM rc, msg;
+	as_error err;
+    as_key key;
+    as_record* p_rec = NULL;    
+
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    std::string ckey;
+    uint64_t negcache_ticket = 0;
+    flight* fl = NULL;
+    if (negcache_enabled() || flight_enabled()) {
+        ckey = cache_key(handle, &key);
+        if (negcache_enabled() && negcache_lookup(ckey, &negcache_ticket)) {
+            as_key_destroy(&key);
+            return not_found_error(env);
+        }
+        if (flight_enabled() && (fl = flight_enter(ckey, FLIGHT_BINARY_GET, env, &msg)) == NULL) {
+            as_key_destroy(&key);
+            return msg;
+        }
+    }
+
+    STATS_PHASE(STATS_DECODE)
+    as_status status = aerospike_key_get(handle->as, &err, policy, &key, &p_rec);
+    STATS_PHASE(STATS_CALL)
+    if (status != AEROSPIKE_OK) {
+        if (p_rec != NULL) {
+            as_record_destroy(p_rec);
+        }
+        if (status == AEROSPIKE_ERR_RECORD_NOT_FOUND && !ckey.empty()) {
+            negcache_insert(ckey, negcache_ticket);
+        }
+        rc = erl_error;
+        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
+        return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+    }
+    if (p_rec == NULL) {
+        rc = erl_error;
+        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
+        return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+    }
+
+    // the holder owns p_rec now, it is destroyed with the last binary pointing into it
+    record_holder* holder = record_holder_new(p_rec);
+    msg = dump_binary_records(env, p_rec, holder);
+    rc = erl_ok;
+    enif_release_resource(holder);
+    STATS_PHASE(STATS_ENCODE)
+    return flight_reply(fl, env, enif_make_tuple2(env, rc, msg));
+
+//
+}
+
+// Reads all bins of every key from one namespace/set with a single batch request,
+// results are returned in the order of keys as {ok, Bins} | {error, Status}
+static ERL_NIF_TERM batch_get(ErlNifEnv* env, const ERL_NIF_TERM argv[], const as_policy_batch* policy,
+    ERL_NIF_TERM (*dump)(ErlNifEnv*, const as_record*, record_holder*), int op)
+{
+    STATS_START(op)
+    ErlNifBinary bin_ns, bin_set;
+    std::string name_space, aspk_set;
+    unsigned int length;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    ERL_NIF_TERM keys_list = argv[3];
+    if (!enif_is_list(env, keys_list) || !enif_get_list_length(env, keys_list, &length)) {
+	    return enif_make_badarg(env);
+    }
+    if (length == 0) {
+        return enif_make_tuple2(env, erl_ok, enif_make_list(env, 0));
+    }
+
+    CHECK_ALL
+
+    // as_key_init_str() keeps the pointer, so the strings have to outlive the batch
+    std::vector<std::string> key_str_list(length);
+    std::vector<as_batch_read_record*> abrrs(length);
+
+    as_batch_records recs;
+	as_batch_records_inita(&recs, length);
+
+    for (uint i = 0; i < length; i++) {
+        ERL_NIF_TERM head;
+        ERL_NIF_TERM tail;
+        ErlNifBinary bin_bin;
+
+        if (!enif_get_list_cell(env, keys_list, &head, &tail)) {
+            break;
+        }
+        if (!enif_inspect_binary(env, head, &bin_bin)) {
+            as_batch_records_destroy(&recs);
+            return enif_make_badarg(env);
+        }
+        key_str_list[i].assign((const char*) bin_bin.data, bin_bin.size);
+
+        abrrs[i] = as_batch_read_reserve(&recs);
+	    as_key_init_str(&(abrrs[i]->key), name_space.c_str(), aspk_set.c_str(), key_str_list[i].c_str());
+        abrrs[i]->read_all_bins = true;
+
+        keys_list = tail;
+    }
+
+    as_error err;
+    STATS_PHASE(STATS_DECODE)
+	as_status status = aerospike_batch_read(handle->as, &err, policy, &recs);
+    STATS_PHASE(STATS_CALL)
+    if(status != AEROSPIKE_OK){
+        as_batch_records_destroy(&recs);
+        return enif_make_tuple2(env, erl_error, enif_make_string(env, err.message, ERL_NIF_UTF8));
+    }
+
+	std::vector<ERL_NIF_TERM> erl_list;
+    erl_list.reserve(length);
+    for(auto aitr : abrrs){
+        if(aitr->result == AEROSPIKE_OK){
+            erl_list.push_back(enif_make_tuple2(env, erl_ok, dump(env, &aitr->record, NULL)));
+        }else{
+            erl_list.push_back(enif_make_tuple2(env, erl_error,
+                enif_make_string(env, as_error_string(aitr->result), ERL_NIF_UTF8)));
+        }
+    }
+    as_batch_records_destroy(&recs);
+    STATS_PHASE(STATS_ENCODE)
+    return enif_make_tuple2(env, erl_ok, enif_make_list_from_array(env, erl_list.data(), erl_list.size()));
+}
+
+static ERL_NIF_TERM binary_get_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    as_policy_batch p;
+    const as_policy_batch* policy;
+    if (!get_batch_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+    return batch_get(env, argv, policy, dump_binary_records, STATS_BINARY_GET_MANY);
+}
+
+static ERL_NIF_TERM cdt_get_many(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    as_policy_batch p;
+    const as_policy_batch* policy;
+    if (!get_batch_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+    return batch_get(env, argv, policy, dump_cdt_records, STATS_CDT_GET_MANY);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Async API: the command is handed over to one of the client event loops and the NIF returns
+// {ok, Ref} right away; the result is delivered later to the caller as {aspike, Ref, Result}.
+
+typedef struct {
+    ErlNifPid pid;
+    ErlNifEnv* msg_env;
+    ERL_NIF_TERM ref;
+    aspike_cluster* handle;     // kept until the listener is done
+    int stats_op;
+    uint64_t stats_t0;
+    std::string cache_key;      // reads: put the result, writes: drop the entry
+    uint64_t cache_ticket;
+    uint64_t negcache_ticket;
+    flight* led_flight;         // reads that lead a flight
+} async_data;
+
+static async_data* async_data_new(ErlNifEnv* env, aspike_cluster* handle)
+{
+    async_data* data = new async_data;
+    enif_keep_resource(handle);
+    data->handle = handle;
+    enif_self(env, &data->pid);
+    data->msg_env = enif_alloc_env();
+    data->ref = enif_make_ref(data->msg_env);
+    data->cache_ticket = 0;
+    data->negcache_ticket = 0;
+    data->led_flight = NULL;
+    return data;
+}
+
+static void async_data_free(async_data* data)
+{
+    enif_free_env(data->msg_env);
+    enif_release_resource(data->handle);
+    delete data;
+}
+
+// consumes data, caller_env is NULL on an event loop thread
+static void async_reply_from(ErlNifEnv* caller_env, async_data* data, ERL_NIF_TERM result)
+{
+    if (data->led_flight != NULL) {
+        flight_leave(data->led_flight, caller_env, result);
+    }
+    ERL_NIF_TERM msg = enif_make_tuple3(data->msg_env, erl_aspike, data->ref, result);
+    enif_send(caller_env, &data->pid, data->msg_env, msg);
+    async_data_free(data);
+}
+
+// called from an event loop thread, consumes data
+static void async_reply(async_data* data, ERL_NIF_TERM result)
+{
+    async_reply_from(NULL, data, result);
+}
+
+// answered without a command, the message is there before {ok, Ref} is returned
+static ERL_NIF_TERM async_answered(ErlNifEnv* env, async_data* data, ERL_NIF_TERM result)
+{
+    ERL_NIF_TERM ref = enif_make_copy(env, data->ref);
+    async_reply_from(env, data, result);
+    return enif_make_tuple2(env, erl_ok, ref);
+}
+
+// a read of a key that is in flight already, the leader sends the result
+static ERL_NIF_TERM async_joined(ErlNifEnv* env, async_data* data)
+{
+    ERL_NIF_TERM ref = enif_make_copy(env, data->ref);
+    async_data_free(data);
+    return enif_make_tuple2(env, erl_ok, ref);
+}
+
+static ERL_NIF_TERM async_submitted(ErlNifEnv* env, async_data* data, as_status status, as_error* err)
+{
+    if (status != AEROSPIKE_OK) {
+        // the listener is not called when the command was not queued
+        ERL_NIF_TERM error = enif_make_tuple2(env, erl_error, enif_make_string(env, err->message, ERL_NIF_UTF8));
+        if (data->led_flight != NULL) {
+            flight_leave(data->led_flight, env, error);
+        }
+        async_data_free(data);
+        return error;
+    }
+    return enif_make_tuple2(env, erl_ok, enif_make_copy(env, data->ref));
+}
+
+static void async_error_reply(async_data* data, as_error* err)
+{
+    async_reply(data, enif_make_tuple2(data->msg_env, erl_error,
+        enif_make_string(data->msg_env, err->message, ERL_NIF_UTF8)));
+}
+
+static void binary_get_listener(as_error* err, as_record* p_rec, void* udata, as_event_loop* event_loop)
+{
+    async_data* data = (async_data*)udata;
+    STATS_RESUME(data)
+    if (err) {
+        if (err->code == AEROSPIKE_ERR_RECORD_NOT_FOUND && !data->cache_key.empty()) {
+            negcache_insert(data->cache_key, data->negcache_ticket);
+        }
+        async_error_reply(data, err);
+        return;
+    }
+    ERL_NIF_TERM bins = dump_binary_records(data->msg_env, p_rec, NULL);
+    STATS_PHASE(STATS_ENCODE)
+    async_reply(data, enif_make_tuple2(data->msg_env, erl_ok, bins));
+}
+
+static void cdt_get_listener(as_error* err, as_record* p_rec, void* udata, as_event_loop* event_loop)
+{
+    async_data* data = (async_data*)udata;
+    STATS_RESUME(data)
+    if (err) {
+        if (err->code == AEROSPIKE_ERR_RECORD_NOT_FOUND && !data->cache_key.empty()) {
+            negcache_insert(data->cache_key, data->negcache_ticket);
+        }
+        async_error_reply(data, err);
+        return;
+    }
+    ERL_NIF_TERM bins = dump_cdt_records(data->msg_env, p_rec, NULL);
+    if (cache_enabled() && !data->cache_key.empty()) {
+        cache_put(data->cache_key, data->msg_env, bins, data->cache_ticket);
+    }
+    STATS_PHASE(STATS_ENCODE)
+    async_reply(data, enif_make_tuple2(data->msg_env, erl_ok, bins));
+}
+
+static void binary_put_listener(as_error* err, void* udata, as_event_loop* event_loop)
+{
+    async_data* data = (async_data*)udata;
+    STATS_RESUME(data)
+    if (!data->cache_key.empty()) {
+        cache_drop_key(data->cache_key);
+    }
+    if (err) {
+        async_error_reply(data, err);
+        return;
+    }
+    ERL_NIF_TERM result = enif_make_tuple2(data->msg_env, erl_ok,
+        enif_make_string(data->msg_env, "key_put", ERL_NIF_UTF8));
+    STATS_PHASE(STATS_ENCODE)
+    async_reply(data, result);
+}
+
+static void cdt_put_listener(as_error* err, as_record* p_rec, void* udata, as_event_loop* event_loop)
+{
+    async_data* data = (async_data*)udata;
+    STATS_RESUME(data)
+    if (!data->cache_key.empty()) {
+        cache_drop_key(data->cache_key);
+    }
+    if (err) {
+        async_error_reply(data, err);
+        return;
+    }
+    ERL_NIF_TERM result = enif_make_tuple2(data->msg_env, erl_ok,
+        enif_make_string(data->msg_env, "put", ERL_NIF_UTF8));
+    STATS_PHASE(STATS_ENCODE)
+    async_reply(data, result);
+}
+
+static ERL_NIF_TERM binary_get_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    STATS_START(STATS_BINARY_GET_ASYNC)
+    ErlNifBinary bin_ns, bin_set, bin_key;
+    std::string name_space, aspk_set, aspk_key;
+    
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
+	    return enif_make_badarg(env);
+    }
+    name_space.assign((const char*) bin_ns.data, bin_ns.size);
+
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_set.assign((const char*) bin_set.data, bin_set.size);
+
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
+	    return enif_make_badarg(env);
+    }
+    aspk_key.assign((const char*) bin_key.data, bin_key.size);
+
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
+    CHECK_ALL
+
+	as_error err;
+    as_key key;
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
+
+    async_data* data = async_data_new(env, handle);
+    if (negcache_enabled() || flight_enabled()) {
+        data->cache_key = cache_key(handle, &key);
+        if (negcache_enabled() && negcache_lookup(data->cache_key, &data->negcache_ticket)) {
+            as_key_destroy(&key);
+            return async_answered(env, data, not_found_error(data->msg_env));
+        }
+        if (flight_enabled() && (data->led_flight = flight_enter_async(data->cache_key, FLIGHT_BINARY_GET,
+                &data->pid, data->msg_env, data->ref)) == NULL) {
+            as_key_destroy(&key);
+            return async_joined(env, data);
+        }
     }
+    STATS_PHASE(STATS_DECODE)
+    STATS_SUSPEND(data)
+    as_status status = aerospike_key_get_async(handle->as, &err, policy, &key, binary_get_listener, data, NULL, NULL);
+    as_key_destroy(&key);
+    return async_submitted(env, data, status, &err);
 }
 
-static ERL_NIF_TERM cdt_delete_by_keys(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM cdt_get_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    ErlNifBinary bin_ns, bin_set, bin_key, bin_name;
-    std::string name_space, aspk_set, aspk_key, bin_str;
-    unsigned int length;
+    STATS_START(STATS_CDT_GET_ASYNC)
+    ErlNifBinary bin_ns, bin_set, bin_key;
+    std::string name_space, aspk_set, aspk_key;
     
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
-    
-    if (!enif_inspect_binary(env, argv[3], &bin_name)) {
-	    return enif_make_badarg(env);
-    }
-    bin_str.assign((const char*) bin_name.data, bin_name.size);
-    
-    ERL_NIF_TERM list = argv[4];
-    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
-	    return enif_make_badarg(env);
+
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
     }
 
     CHECK_ALL
-    
-    as_arraylist remove_list;
-	as_arraylist_init(&remove_list, length, length);
 
-    ERL_NIF_TERM rc, msg;
 	as_error err;
     as_key key;
-
 	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-    
-    as_operations ops;
-    as_operations_inita(&ops, 1);
-    as_map_policy put_mode;
-    as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
 
-    ErlNifBinary subkey_term;
-    std::string subkey_str;
-    unsigned int subkeys_num = 0;
-    for (uint i = 0; i < length; i++) {
-        ERL_NIF_TERM head;
-        ERL_NIF_TERM tail;
-        if (!enif_get_list_cell(env, list, &head, &tail)) {
-            break;
+    async_data* data = async_data_new(env, handle);
+    if (any_cache_enabled()) {
+        ERL_NIF_TERM cached;
+        data->cache_key = cache_key(handle, &key);
+        if (negcache_enabled() && negcache_lookup(data->cache_key, &data->negcache_ticket)) {
+            as_key_destroy(&key);
+            return async_answered(env, data, not_found_error(data->msg_env));
         }
-        if (enif_inspect_binary(env, head, &subkey_term)) {
-            subkey_str.assign((const char*) subkey_term.data, subkey_term.size);
-	        as_arraylist_append_str(&remove_list, (char*)subkey_str.c_str());
-            subkeys_num++;
+        if (cache_enabled() && cache_get(data->cache_key, data->msg_env, &cached, &data->cache_ticket)) {
+            as_key_destroy(&key);
+            return async_answered(env, data, enif_make_tuple2(data->msg_env, erl_ok, cached));
+        }
+        if (flight_enabled() && (data->led_flight = flight_enter_async(data->cache_key, FLIGHT_CDT_GET,
+                &data->pid, data->msg_env, data->ref)) == NULL) {
+            as_key_destroy(&key);
+            return async_joined(env, data);
         }
-        list = tail;
-    }
-    if(subkeys_num == length){
-        as_operations_add_map_remove_by_key_list(&ops, bin_str.c_str(), (as_list*)&remove_list, AS_MAP_RETURN_NONE);
-    }
-    as_arraylist_destroy(&remove_list);
-
-    if(aerospike_key_operate(&as, &err, NULL, &key, &ops, NULL) != AEROSPIKE_OK){
-        rc = erl_error;
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-    } else {
-        rc = erl_ok;
-        msg = enif_make_string(env, "keys_deleted", ERL_NIF_UTF8);
     }
-    as_operations_destroy(&ops);
-
-    return enif_make_tuple2(env, rc, msg);
+    STATS_PHASE(STATS_DECODE)
+    STATS_SUSPEND(data)
+    as_status status = aerospike_key_get_async(handle->as, &err, policy, &key, cdt_get_listener, data, NULL, NULL);
+    as_key_destroy(&key);
+    return async_submitted(env, data, status, &err);
 }
 
-static ERL_NIF_TERM cdt_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM binary_put_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
+    STATS_START(STATS_BINARY_PUT_ASYNC)
     ErlNifBinary bin_ns, bin_set, bin_key;
+    unsigned int length;
     std::string name_space, aspk_set, aspk_key;
-    
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    long ttl;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
 
-    // {max_retries, sleep_between_retries, socket_timeout, total_timeout}
-    const ERL_NIF_TERM* policy = NULL;
-    int policy_length;
-    long max_retries = 0;
-    long sleep_between_retries = 0;
-    long socket_timeout = 30000;
-    long total_timeout = 1000;
-    if(!enif_get_tuple(env, argv[3], &policy_length, &policy) || policy_length != 4){
+    ERL_NIF_TERM list = argv[4];
+    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length) || length == 0) {
+	    return enif_make_badarg(env);
+    }
+
+    if (!enif_get_long(env, argv[5], &ttl)) {
+        return enif_make_badarg(env);
+    }
+
+    as_policy_write p;
+    const as_policy_write* policy;
+    if (!get_write_policy(env, argv[6], &p, &policy)) {
         return enif_make_badarg(env);
     }
-    enif_get_long(env, policy[0], &max_retries);
-    enif_get_long(env, policy[1], &sleep_between_retries);
-    enif_get_long(env, policy[2], &socket_timeout);
-    enif_get_long(env, policy[3], &total_timeout);
 
     CHECK_ALL
 
-    ERL_NIF_TERM rc, msg;
 	as_error err;
     as_key key;
-    as_record* p_rec = NULL;    
-
-	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-    as_policy_read p;
-	as_policy_read_init(&p);
-    p.base.max_retries = max_retries;
-    p.base.sleep_between_retries = sleep_between_retries;
-    p.base.socket_timeout = socket_timeout;
-    p.base.total_timeout = total_timeout;
+	as_record rec;
 
-    if (aerospike_key_get(&as, &err, NULL, &key, &p_rec)  != AEROSPIKE_OK) {
-        if (p_rec != NULL) {
-            as_record_destroy(p_rec);
-        }
-        rc = erl_error;
-        as_key_destroy(&key);
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
-    }
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+	as_record_inita(&rec, indexed ? 2 * length : length);
+    rec.ttl = ttl;
 
-    as_key_destroy(&key);
-    if (p_rec == NULL) {
-        rc = erl_error;
-        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
+    if(!set_binary_put_bins(env, list, length, indexed, &rec, NULL)){
+        as_record_destroy(&rec);
+        return enif_make_badarg(env);
     }
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
 
-    msg = dump_cdt_records(env, p_rec);
-    rc = erl_ok;
-    if (p_rec != NULL) {
-        as_record_destroy(p_rec);
+    // the record is serialized into the command buffer before the call returns
+    async_data* data = async_data_new(env, handle);
+    if (any_cache_enabled()) {
+        data->cache_key = cache_key(handle, &key);
     }
-    return enif_make_tuple2(env, rc, msg);
-
-//
+    STATS_PHASE(STATS_DECODE)
+    STATS_SUSPEND(data)
+    as_status status = aerospike_key_put_async(handle->as, &err, policy, &key, &rec, binary_put_listener, data, NULL, NULL);
+    as_record_destroy(&rec);
+    as_key_destroy(&key);
+    return async_submitted(env, data, status, &err);
 }
 
-static ERL_NIF_TERM binary_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static ERL_NIF_TERM cdt_put_async(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
+    STATS_START(STATS_CDT_PUT_ASYNC)
     ErlNifBinary bin_ns, bin_set, bin_key;
+    unsigned int length;
     std::string name_space, aspk_set, aspk_key;
-    
-    if (!enif_inspect_binary(env, argv[0], &bin_ns)) {
+    long ttl;
+
+    if (!enif_inspect_binary(env, argv[1], &bin_ns)) {
 	    return enif_make_badarg(env);
     }
     name_space.assign((const char*) bin_ns.data, bin_ns.size);
 
-    if (!enif_inspect_binary(env, argv[1], &bin_set)) {
+    if (!enif_inspect_binary(env, argv[2], &bin_set)) {
 	    return enif_make_badarg(env);
     }
     aspk_set.assign((const char*) bin_set.data, bin_set.size);
 
-    if (!enif_inspect_binary(env, argv[2], &bin_key)) {
+    if (!enif_inspect_binary(env, argv[3], &bin_key)) {
 	    return enif_make_badarg(env);
     }
     aspk_key.assign((const char*) bin_key.data, bin_key.size);
 
+    ERL_NIF_TERM list = argv[4];
+    if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length) || length == 0) {
+	    return enif_make_badarg(env);
+    }
+
+    if (!enif_get_long(env, argv[5], &ttl)) {
+        return enif_make_badarg(env);
+    }
+
+    as_policy_operate p;
+    const as_policy_operate* policy;
+    if (!get_operate_policy(env, argv[6], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
-    ERL_NIF_TERM rc, msg;
 	as_error err;
     as_key key;
-    as_record* p_rec = NULL;    
-
-	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
-
-    if (aerospike_key_get(&as, &err, NULL, &key, &p_rec)  != AEROSPIKE_OK) {
-        if (p_rec != NULL) {
-            as_record_destroy(p_rec);
-        }
-        rc = erl_error;
-        msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
+    as_operations ops;
+    // on the heap, the number of subkeys is up to the caller
+    bool indexed = expiry_index.load(std::memory_order_relaxed);
+    unsigned int ops_count = cdt_put_ops_count(env, list, indexed);
+    as_operations_init(&ops, ops_count);
+    if(ttl != 0){
+        ops.ttl = ttl;
+    } else {
+        ops.ttl = AS_RECORD_NO_CHANGE_TTL;
     }
-    if (p_rec == NULL) {
-        rc = erl_error;
-        msg = enif_make_string(env, "NULL p_rec - internal error", ERL_NIF_UTF8);
-        return enif_make_tuple2(env, rc, msg);
+    if (!add_cdt_put_ops(env, list, length, indexed, &ops)) {
+        as_operations_destroy(&ops);
+        return enif_make_badarg(env);
+    }
+    if (ops_count == 0) {
+        // only empty subkey lists, nothing to write
+        as_operations_destroy(&ops);
+        async_data* data = async_data_new(env, handle);
+        return async_answered(env, data,
+            enif_make_tuple2(data->msg_env, erl_ok, enif_make_string(data->msg_env, "put", ERL_NIF_UTF8)));
     }
+	as_key_init_str(&key, name_space.c_str(), aspk_set.c_str(), aspk_key.c_str());
 
-    msg = dump_binary_records(env, p_rec);
-    rc = erl_ok;
-    if (p_rec != NULL) {
-        as_record_destroy(p_rec);
+    ERL_NIF_TERM ref;
+    if (coalesce_enabled()
+        && cdt_put_coalesced(env, handle, policy, name_space, aspk_set, aspk_key, &key, list,
+            indexed ? ops_count / 2 : ops_count, ttl, &ref)) {
+        as_operations_destroy(&ops);
+        as_key_destroy(&key);
+        STATS_PHASE(STATS_DECODE)
+        return enif_make_tuple2(env, erl_ok, ref);
     }
-    return enif_make_tuple2(env, rc, msg);
 
-//
+    async_data* data = async_data_new(env, handle);
+    if (any_cache_enabled()) {
+        data->cache_key = cache_key(handle, &key);
+    }
+    STATS_PHASE(STATS_DECODE)
+    STATS_SUSPEND(data)
+    as_status status = aerospike_key_operate_async(handle->as, &err, policy, &key, &ops, cdt_put_listener, data, NULL, NULL);
+    as_operations_destroy(&ops);
+    as_key_destroy(&key);
+    return async_submitted(env, data, status, &err);
 }
 
 static ERL_NIF_TERM key_select(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
@@ -1597,19 +3855,25 @@ static ERL_NIF_TERM key_select(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     unsigned int i = 0;
     as_record* p_rec = NULL;
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    ERL_NIF_TERM list = argv[3];
+    ERL_NIF_TERM list = argv[4];
     if (!enif_is_list(env, list) || !enif_get_list_length(env, list, &length)) {
 	    return enif_make_badarg(env);
     }
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[5], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
     ERL_NIF_TERM rc, msg;
@@ -1640,13 +3904,13 @@ static ERL_NIF_TERM key_select(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     as_key key;
 	as_key_init_str(&key, name_space, set, key_str);
 
-    if (aerospike_key_select(&as, &err, NULL, &key, bins, &p_rec)  != AEROSPIKE_OK) {
+    if (aerospike_key_select(handle->as, &err, policy, &key, bins, &p_rec)  != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
         return enif_make_tuple2(env, rc, msg);
     }
 
-    msg = dump_records(env, p_rec);
+    msg = dump_records(env, p_rec, NULL);
     rc = erl_ok;
     for (uint j = 0; j < i; j++) {
         delete(bins[j]);
@@ -1664,15 +3928,21 @@ static ERL_NIF_TERM key_generation(ErlNifEnv* env, int argc, const ERL_NIF_TERM
     char set[MAX_SET_SIZE];
     char key_str[MAX_KEY_STR_SIZE];
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
     ERL_NIF_TERM rc, msg;
@@ -1682,7 +3952,7 @@ static ERL_NIF_TERM key_generation(ErlNifEnv* env, int argc, const ERL_NIF_TERM
 
 	as_key_init_str(&key, name_space, set, key_str);
 
-    if (aerospike_key_get(&as, &err, NULL, &key, &p_rec)  != AEROSPIKE_OK) {
+    if (aerospike_key_get(handle->as, &err, policy, &key, &p_rec)  != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.message, ERL_NIF_UTF8);
         return enif_make_tuple2(env, rc, msg);
@@ -1710,15 +3980,21 @@ static ERL_NIF_TERM key_exists(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     char set[MAX_SET_SIZE];
     char key_str[MAX_KEY_STR_SIZE];
 
-    if (!enif_get_string(env, argv[0], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], name_space, MAX_NAMESPACE_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], set, MAX_SET_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], key_str, MAX_KEY_STR_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
+    as_policy_read p;
+    const as_policy_read* policy;
+    if (!get_read_policy(env, argv[4], &p, &policy)) {
+        return enif_make_badarg(env);
+    }
+
     CHECK_ALL
 
     ERL_NIF_TERM rc, msg;
@@ -1727,7 +4003,7 @@ static ERL_NIF_TERM key_exists(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
     as_record* p_rec = NULL;    
 
 	as_key_init_str(&key, name_space, set, key_str);
-    int as_rc = aerospike_key_exists(&as, &err, NULL, &key, &p_rec);
+    int as_rc = aerospike_key_exists(handle->as, &err, policy, &key, &p_rec);
 
     if (as_rc != AEROSPIKE_OK) {
         rc = erl_error;
@@ -1746,7 +4022,7 @@ static ERL_NIF_TERM node_random(ErlNifEnv* env, int argc, const ERL_NIF_TERM arg
 {
     CHECK_ALL
     ERL_NIF_TERM rc, msg;
-    as_node* node = as_node_get_random(as.cluster);
+    as_node* node = as_node_get_random(handle->as->cluster);
     if (! node) {
         rc = erl_error;
         msg = enif_make_string(env, "Failed to find server node.", ERL_NIF_UTF8);
@@ -1763,7 +4039,7 @@ static ERL_NIF_TERM node_names(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 {
     CHECK_ALL
     ERL_NIF_TERM rc;
-	as_nodes* nodes = as_nodes_reserve(as.cluster);
+	as_nodes* nodes = as_nodes_reserve(handle->as->cluster);
     uint32_t n_nodes = (nodes == NULL) ? 0 : nodes->size;
 
     ERL_NIF_TERM lst = enif_make_list(env, 0);
@@ -1787,13 +4063,13 @@ static ERL_NIF_TERM node_names(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv
 static ERL_NIF_TERM node_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     char node_name[AS_NODE_NAME_MAX_SIZE];
-    if (!enif_get_string(env, argv[0], node_name, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], node_name, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
     CHECK_ALL
     ERL_NIF_TERM rc, msg;
     
-    as_node* node = as_node_get_by_name(as.cluster, node_name);
+    as_node* node = as_node_get_by_name(handle->as->cluster, node_name);
     if (! node) {
         rc = erl_error;
         msg = enif_make_string(env, "Failed to find server node.", ERL_NIF_UTF8);
@@ -1810,16 +4086,16 @@ static ERL_NIF_TERM nif_node_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 {
     char node_name[AS_NODE_NAME_MAX_SIZE];
     char item[1024];
-    if (!enif_get_string(env, argv[0], node_name, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], node_name, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[1], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[2], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
     CHECK_ALL
     ERL_NIF_TERM rc, msg;
 
-	as_cluster* cluster = as.cluster;
+	as_cluster* cluster = handle->as->cluster;
     as_node* node = as_node_get_by_name(cluster, node_name);
     if (! node) {
         rc = erl_error;
@@ -1829,7 +4105,7 @@ static ERL_NIF_TERM nif_node_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 
     char * info = NULL;
     as_error err;
-    const as_policy_info* policy = &as.config.policies.info;
+    const as_policy_info* policy = &handle->as->config.policies.info;
 	uint64_t deadline = as_socket_deadline(policy->timeout);
 
     as_status status = as_info_command_node(&err, node, (char*)item, policy->send_as_is, deadline, &info);
@@ -1853,7 +4129,7 @@ static ERL_NIF_TERM nif_node_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 static ERL_NIF_TERM nif_help(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     char item[1024];
-    if (!enif_get_string(env, argv[0], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
     CHECK_ALL
@@ -1861,7 +4137,7 @@ static ERL_NIF_TERM nif_help(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]
     char * info = NULL;
     as_error err;
 
-    if (aerospike_info_any(&as, &err, NULL, item, &info) != AEROSPIKE_OK) {
+    if (aerospike_info_any(handle->as, &err, NULL, item, &info) != AEROSPIKE_OK) {
         rc = erl_error;
         msg = enif_make_string(env, err.in_doubt == true ? "unknown error" : err.message, ERL_NIF_UTF8);
     } else if (info == NULL) {
@@ -1881,13 +4157,13 @@ static ERL_NIF_TERM nif_host_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
     char hostname[AS_NODE_NAME_MAX_SIZE];
     long port;
     char item[1024];    
-    if (!enif_get_string(env, argv[0], hostname, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[1], hostname, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_long(env, argv[1], &port)) {
+    if (!enif_get_long(env, argv[2], &port)) {
 	    return enif_make_badarg(env);
     }
-    if (!enif_get_string(env, argv[2], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
+    if (!enif_get_string(env, argv[3], item, AS_USER_SIZE, ERL_NIF_UTF8)) {
 	    return enif_make_badarg(env);
     }
     CHECK_ALL
@@ -1902,8 +4178,8 @@ static ERL_NIF_TERM nif_host_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
         return enif_make_tuple2(env, rc, msg);   
 	}
     char * info = NULL;
-    as_cluster* cluster = as.cluster;
-    const as_policy_info* policy = &as.config.policies.info;
+    as_cluster* cluster = handle->as->cluster;
+    const as_policy_info* policy = &handle->as->config.policies.info;
 	uint64_t deadline = as_socket_deadline(policy->timeout);
 	struct sockaddr* addr;
 
@@ -1940,6 +4216,149 @@ static ERL_NIF_TERM nif_host_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM a
 
 // ------------------------------------------------------------------------------------------------
 
+// stats_snapshot() -> #{Op => #{decode | call | encode => #{count, mean, min, max, p50, p90, p99, p999}}}
+static ERL_NIF_TERM stats_snapshot_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return stats_snapshot(env);
+}
+
+static ERL_NIF_TERM stats_reset_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    stats_reset();
+    return erl_ok;
+}
+
+// #{max_entries => N, max_age => Ms}, max_entries 0 turns the cache off
+static ERL_NIF_TERM cache_config_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint32_t max_entries = 0;
+    uint32_t max_age = 1000;
+    if (!enif_is_map(env, argv[0])
+        || !get_config_uint(env, argv[0], "max_entries", &max_entries)
+        || !get_config_uint(env, argv[0], "max_age", &max_age)) {
+        return enif_make_badarg(env);
+    }
+    cache_configure(max_entries, max_age);
+    return erl_ok;
+}
+
+static ERL_NIF_TERM cache_stats_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return cache_stats(env);
+}
+
+static ERL_NIF_TERM cache_clear_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    cache_clear();
+    return erl_ok;
+}
+
+// #{window => Ms}, window 0 turns the negative cache off
+static ERL_NIF_TERM negcache_config_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint32_t window = 0;
+    if (!enif_is_map(env, argv[0]) || !get_config_uint(env, argv[0], "window", &window)) {
+        return enif_make_badarg(env);
+    }
+    negcache_configure(window);
+    return erl_ok;
+}
+
+static ERL_NIF_TERM negcache_stats_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return negcache_stats(env);
+}
+
+// flight_enable(true | false), single-flight reads are off by default
+static ERL_NIF_TERM flight_enable_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (enif_is_identical(argv[0], enif_make_atom(env, "true"))) {
+        flight_enable(true);
+    } else if (enif_is_identical(argv[0], enif_make_atom(env, "false"))) {
+        flight_enable(false);
+    } else {
+        return enif_make_badarg(env);
+    }
+    return erl_ok;
+}
+
+static ERL_NIF_TERM flight_stats_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return flight_stats(env);
+}
+
+// #{window => Ms, max_subkeys => N}, window 0 turns cdt_put coalescing off
+static ERL_NIF_TERM coalesce_config_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint32_t window = 0;
+    uint32_t max_subkeys = 64;
+    if (!enif_is_map(env, argv[0])
+        || !get_config_uint(env, argv[0], "window", &window)
+        || !get_config_uint(env, argv[0], "max_subkeys", &max_subkeys)) {
+        return enif_make_badarg(env);
+    }
+    coalesce_configure(window, max_subkeys);
+    return erl_ok;
+}
+
+static ERL_NIF_TERM coalesce_stats_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return coalesce_stats(env);
+}
+
+// #{interval => Ms}, interval 0 turns key_inc aggregation off and flushes
+static ERL_NIF_TERM key_inc_aggregate_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint32_t interval = 0;
+    if (!enif_is_map(env, argv[0]) || !get_config_uint(env, argv[0], "interval", &interval)) {
+        return enif_make_badarg(env);
+    }
+    counters_configure(interval);
+    std::string error;
+    if (interval == 0 && !counters_flush(&error)) {
+        return enif_make_tuple2(env, erl_error, enif_make_string(env, error.c_str(), ERL_NIF_UTF8));
+    }
+    return erl_ok;
+}
+
+static ERL_NIF_TERM key_inc_flush_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    std::string error;
+    if (!counters_flush(&error)) {
+        return enif_make_tuple2(env, erl_error, enif_make_string(env, error.c_str(), ERL_NIF_UTF8));
+    }
+    return erl_ok;
+}
+
+static ERL_NIF_TERM key_inc_pending_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return counters_pending(env);
+}
+
+static ERL_NIF_TERM cdt_expiry_index_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (enif_is_identical(argv[0], enif_make_atom(env, "true"))) {
+        expiry_index.store(true, std::memory_order_relaxed);
+    } else if (enif_is_identical(argv[0], enif_make_atom(env, "false"))) {
+        expiry_index.store(false, std::memory_order_relaxed);
+    } else {
+        return enif_make_badarg(env);
+    }
+    return erl_ok;
+}
+
+static ERL_NIF_TERM cdt_compact_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (enif_is_identical(argv[0], enif_make_atom(env, "true"))) {
+        compact_entries.store(true, std::memory_order_relaxed);
+    } else if (enif_is_identical(argv[0], enif_make_atom(env, "false"))) {
+        compact_entries.store(false, std::memory_order_relaxed);
+    } else {
+        return enif_make_badarg(env);
+    }
+    return erl_ok;
+}
+
 extern int foo(int x);
 extern int bar(int y);
 
@@ -1964,36 +4383,66 @@ static ERL_NIF_TERM bar_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 }
 
 static ErlNifFunc nif_funcs[] = {
-    {"as_init", 0, as_init},
-    NIF_FUN("connect", 2, connect),
-    NIF_FUN("nif_host_add", 2, host_add),
-    NIF_FUN("host_clear", 0, host_clear),
-    NIF_FUN("nif_host_list", 0, host_list),
-    NIF_FUN("key_exists", 3, key_exists),
-    NIF_FUN("key_inc", 4, key_inc),
-    NIF_FUN("key_get", 3, key_get),
-    NIF_FUN("key_generation", 3, key_generation),
-    NIF_FUN("key_put", 4, key_put),
-    NIF_FUN("binary_put", 5, binary_put),
-    NIF_FUN("cdt_put", 6, cdt_put),
-    NIF_FUN("binary_remove", 5, binary_remove),
-    NIF_FUN("binary_get", 3, binary_get),
-    NIF_FUN("cdt_get", 4, cdt_get),
-    NIF_FUN("cdt_expire", 4, cdt_expire),
-    NIF_FUN("cdt_delete_by_keys", 5, cdt_delete_by_keys),
-    NIF_FUN("cdt_delete_by_keys_batch", 4, cdt_delete_by_keys_batch),
-    NIF_FUN("key_remove", 3, key_remove),
-    NIF_FUN("key_select", 4, key_select),
-    NIF_FUN("nif_node_random", 0, node_random),
-    NIF_FUN("nif_node_names", 0, node_names),
-    NIF_FUN("nif_node_get", 1, node_get),
-    NIF_FUN("nif_node_info", 2, nif_node_info),
-    NIF_FUN("nif_help", 1, nif_help),
-    NIF_FUN("nif_host_info", 3, nif_host_info),
+    {"as_init", 1, as_init},
+    {"policy_new", 2, policy_new},
+    {"stats_snapshot", 0, stats_snapshot_nif},
+    {"stats_reset", 0, stats_reset_nif},
+    {"cache_stats", 0, cache_stats_nif},
+    // may free many cached entries
+    NIF_FUN("cache_config", 1, cache_config_nif),
+    NIF_FUN("cache_clear", 0, cache_clear_nif),
+    {"negcache_stats", 0, negcache_stats_nif},
+    NIF_FUN("negcache_config", 1, negcache_config_nif),
+    {"flight_enable", 1, flight_enable_nif},
+    {"flight_stats", 0, flight_stats_nif},
+    NIF_FUN("coalesce_config", 1, coalesce_config_nif),
+    {"coalesce_stats", 0, coalesce_stats_nif},
+    NIF_FUN("key_inc_aggregate", 1, key_inc_aggregate_nif),
+    NIF_FUN("key_inc_flush", 0, key_inc_flush_nif),
+    NIF_FUN("key_inc_pending", 0, key_inc_pending_nif),
+    {"cdt_compact", 1, cdt_compact_nif},
+    {"cdt_expiry_index", 1, cdt_expiry_index_nif},
+    NIF_FUN("connect", 3, connect),
+    NIF_FUN("nif_host_add", 3, host_add),
+    NIF_FUN("host_clear", 1, host_clear),
+    NIF_FUN("nif_host_list", 1, host_list),
+    NIF_FUN("key_exists", 5, key_exists),
+    NIF_FUN("key_inc", 6, key_inc),
+    NIF_FUN("key_get", 5, key_get),
+    NIF_FUN("key_generation", 5, key_generation),
+    NIF_FUN("key_put", 6, key_put),
+    NIF_FUN("binary_put", 7, binary_put),
+    NIF_FUN("binary_put_many", 5, binary_put_many),
+    NIF_FUN("nif_cdt_put", 7, cdt_put),
+    NIF_FUN("cdt_put_many", 5, cdt_put_many),
+    NIF_FUN("binary_remove", 7, binary_remove),
+    NIF_FUN("binary_get", 5, binary_get),
+    NIF_FUN("cdt_get", 5, cdt_get),
+    NIF_FUN("binary_get_many", 5, binary_get_many),
+    NIF_FUN("cdt_get_many", 5, cdt_get_many),
+    NIF_FUN("cdt_expire", 6, cdt_expire),
+    NIF_FUN("cdt_check_and_put", 8, cdt_check_and_put),
+    NIF_FUN("cdt_get_live", 6, cdt_get_live),
+    NIF_FUN("cdt_get_subkeys", 7, cdt_get_subkeys),
+    NIF_FUN("cdt_delete_by_keys", 7, cdt_delete_by_keys),
+    NIF_FUN("cdt_delete_by_keys_batch", 6, cdt_delete_by_keys_batch),
+    NIF_FUN("key_remove", 5, key_remove),
+    NIF_FUN("key_select", 6, key_select),
+    NIF_FUN("nif_node_random", 1, node_random),
+    NIF_FUN("nif_node_names", 1, node_names),
+    NIF_FUN("nif_node_get", 2, node_get),
+    NIF_FUN("nif_node_info", 3, nif_node_info),
+    NIF_FUN("nif_help", 2, nif_help),
+    NIF_FUN("nif_host_info", 4, nif_host_info),
+    // async, only queue the command on an event loop
+    {"binary_get_async", 5, binary_get_async},
+    {"binary_put_async", 7, binary_put_async},
+    {"cdt_get_async", 5, cdt_get_async},
+    {"cdt_put_async", 7, cdt_put_async},
     // ----------------------------------------------------
-    NIF_FUN("a_key_put", 6, a_key_put),
+    NIF_FUN("a_key_put", 7, a_key_put),
     {"foo", 1, foo_nif},
     {"bar", 1, bar_nif}
 };
 
-ERL_NIF_INIT(aspike_nif, nif_funcs, NULL, NULL, NULL, NULL)
+ERL_NIF_INIT(aspike_nif, nif_funcs, load, NULL, upgrade, unload)
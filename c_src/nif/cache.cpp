@@ -0,0 +1,271 @@
+/* cache.cpp */
+
+// Read-through cache of decoded cdt_get results.
+// The key is the cluster handle, the namespace and the record digest; the value
+// is a copy of the result term in its own environment, so a hit is one
+// enif_make_copy() and no round trip.
+//
+// The cache is split into shards, each one an LRU list with its own lock.
+// An entry lives until the smallest wt + ttl of its fcaps or max_age,
+// whichever comes first. Writes through the NIF drop the entry of the key;
+// a read that was in flight during a write of its key is not put in the cache.
+// Every write leaves a tombstone with the shard's clock at the time, a read
+// carries the clock from its miss as a ticket (see cache_get/cache_put).
+// Tombstones are kept for the last TOMBSTONES_PER_SHARD writes of a shard,
+// a read older than the oldest one dropped is not cached either.
+// Disabled (max_entries = 0) until cache_configure() is called.
+
+#include "cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+#define CACHE_SHARDS 16
+#define TOMBSTONES_PER_SHARD 4096
+
+typedef struct {
+    std::string key;
+    ErlNifEnv* env;
+    ERL_NIF_TERM term;
+    uint64_t expires_ms;
+} cache_entry;
+
+typedef struct {
+    std::mutex mutex;
+    std::list<cache_entry> lru;     // most recently used first
+    std::unordered_map<std::string, std::list<cache_entry>::iterator> index;
+    uint64_t clock;                 // ticks on every write and clear
+    std::unordered_map<std::string, uint64_t> written;  // tombstones: key => clock of its last write
+    std::deque<std::pair<std::string, uint64_t>> written_order;
+    uint64_t floor;                 // tickets before it are stale: clear or dropped tombstones
+} cache_shard;
+
+static cache_shard shards[CACHE_SHARDS];
+static std::atomic<size_t> shard_capacity(0);
+static std::atomic<uint64_t> max_age_ms(0);
+
+static std::atomic<uint64_t> hits(0);
+static std::atomic<uint64_t> misses(0);
+static std::atomic<uint64_t> evictions(0);
+static std::atomic<uint64_t> expirations(0);
+static std::atomic<uint64_t> invalidations(0);
+static std::atomic<uint64_t> entries(0);
+
+static uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static cache_shard* shard_of(const std::string& key)
+{
+    return &shards[std::hash<std::string>()(key) % CACHE_SHARDS];
+}
+
+// shard lock is held
+static void erase_entry(cache_shard* shard, std::list<cache_entry>::iterator it)
+{
+    enif_free_env(it->env);
+    shard->index.erase(it->key);
+    shard->lru.erase(it);
+    entries.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static void clear_shard(cache_shard* shard)
+{
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    while (!shard->lru.empty()) {
+        erase_entry(shard, shard->lru.begin());
+    }
+    shard->floor = ++shard->clock;
+    shard->written.clear();
+    shard->written_order.clear();
+}
+
+// shard lock is held: the read with ticket missed a write of key
+static bool is_stale(cache_shard* shard, const std::string& key, uint64_t ticket)
+{
+    if (ticket < shard->floor) {
+        return true;
+    }
+    auto found = shard->written.find(key);
+    return found != shard->written.end() && found->second > ticket;
+}
+
+// shard lock is held
+static void add_tombstone(cache_shard* shard, const std::string& key)
+{
+    uint64_t now = ++shard->clock;
+    shard->written[key] = now;
+    shard->written_order.push_back(std::make_pair(key, now));
+    while (shard->written_order.size() > TOMBSTONES_PER_SHARD) {
+        auto& oldest = shard->written_order.front();
+        auto found = shard->written.find(oldest.first);
+        if (found != shard->written.end() && found->second == oldest.second) {
+            shard->written.erase(found);
+        }
+        shard->floor = oldest.second;
+        shard->written_order.pop_front();
+    }
+}
+
+bool cache_enabled()
+{
+    return shard_capacity.load(std::memory_order_relaxed) > 0;
+}
+
+// max_entries = 0 turns the cache off and drops everything in it
+void cache_configure(size_t max_entries, uint64_t max_age)
+{
+    size_t capacity = max_entries == 0 ? 0 : (max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    shard_capacity.store(capacity, std::memory_order_relaxed);
+    max_age_ms.store(max_age, std::memory_order_relaxed);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard* shard = &shards[i];
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        while (shard->lru.size() > capacity) {
+            erase_entry(shard, std::prev(shard->lru.end()));
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void cache_clear()
+{
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        clear_shard(&shards[i]);
+    }
+}
+
+// On a hit copies the cached term to env. On a miss *ticket is what
+// cache_put() needs to know that no write happened in between.
+bool cache_get(const std::string& key, ErlNifEnv* env, ERL_NIF_TERM* term, uint64_t* ticket)
+{
+    cache_shard* shard = shard_of(key);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    *ticket = shard->clock;
+
+    auto found = shard->index.find(key);
+    if (found == shard->index.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto it = found->second;
+    if (it->expires_ms <= now_ms()) {
+        erase_entry(shard, it);
+        expirations.fetch_add(1, std::memory_order_relaxed);
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    shard->lru.splice(shard->lru.begin(), shard->lru, it);
+    *term = enif_make_copy(env, it->term);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// The smallest wt + ttl (seconds) of the fcaps in a cdt_get result
+// [{BinName, [FcapKey, {Value, Ttl, Wt}, ...]}], 0 if there are none.
+static uint64_t fcaps_deadline_ms(ErlNifEnv* env, ERL_NIF_TERM bins)
+{
+    uint64_t deadline = 0;
+    ERL_NIF_TERM bin, fcaps, fcap;
+    while (enif_get_list_cell(env, bins, &bin, &bins)) {
+        int arity;
+        const ERL_NIF_TERM* bin_tuple;
+        if (!enif_get_tuple(env, bin, &arity, &bin_tuple) || arity != 2) {
+            continue;
+        }
+        fcaps = bin_tuple[1];
+        while (enif_get_list_cell(env, fcaps, &fcap, &fcaps)) {
+            const ERL_NIF_TERM* fcap_tuple;
+            ErlNifSInt64 ttl, wt;
+            if (!enif_get_tuple(env, fcap, &arity, &fcap_tuple) || arity != 3
+                    || !enif_get_int64(env, fcap_tuple[1], &ttl) || !enif_get_int64(env, fcap_tuple[2], &wt)
+                    || ttl <= 0) {
+                continue;
+            }
+            uint64_t d = wt > 0 ? (uint64_t)(wt + ttl) * 1000 : now_ms() + (uint64_t)ttl * 1000;
+            if (deadline == 0 || d < deadline) {
+                deadline = d;
+            }
+        }
+    }
+    return deadline;
+}
+
+void cache_put(const std::string& key, ErlNifEnv* env, ERL_NIF_TERM term, uint64_t ticket)
+{
+    size_t capacity = shard_capacity.load(std::memory_order_relaxed);
+    if (capacity == 0) {
+        return;
+    }
+    uint64_t now = now_ms();
+    uint64_t expires = now + max_age_ms.load(std::memory_order_relaxed);
+    uint64_t deadline = fcaps_deadline_ms(env, term);
+    if (deadline != 0 && deadline < expires) {
+        expires = deadline;
+    }
+    if (expires <= now) {
+        return;
+    }
+
+    cache_shard* shard = shard_of(key);
+    ErlNifEnv* entry_env = enif_alloc_env();
+    ERL_NIF_TERM entry_term = enif_make_copy(entry_env, term);
+
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    if (is_stale(shard, key, ticket)) {
+        // the key was written meanwhile
+        enif_free_env(entry_env);
+        return;
+    }
+    auto found = shard->index.find(key);
+    if (found != shard->index.end()) {
+        erase_entry(shard, found->second);
+    }
+    shard->lru.push_front({key, entry_env, entry_term, expires});
+    shard->index[key] = shard->lru.begin();
+    entries.fetch_add(1, std::memory_order_relaxed);
+    while (shard->lru.size() > capacity) {
+        erase_entry(shard, std::prev(shard->lru.end()));
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void cache_invalidate(const std::string& key)
+{
+    cache_shard* shard = shard_of(key);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    add_tombstone(shard, key);
+    auto found = shard->index.find(key);
+    if (found != shard->index.end()) {
+        erase_entry(shard, found->second);
+        invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// #{hits, misses, evictions, expirations, invalidations, entries}
+ERL_NIF_TERM cache_stats(ErlNifEnv* env)
+{
+    const char* const names[] = {"hits", "misses", "evictions", "expirations", "invalidations", "entries"};
+    const std::atomic<uint64_t>* const counters[] = {&hits, &misses, &evictions, &expirations, &invalidations, &entries};
+    const int count = sizeof(names) / sizeof(names[0]);
+    ERL_NIF_TERM keys[count];
+    ERL_NIF_TERM values[count];
+    for (int i = 0; i < count; i++) {
+        keys[i] = enif_make_atom(env, names[i]);
+        values[i] = enif_make_uint64(env, counters[i]->load(std::memory_order_relaxed));
+    }
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, count, &map);
+    return map;
+}
@@ -0,0 +1,21 @@
+/* cache.h */
+
+#ifndef ASPIKE_NIF_CACHE_H
+#define ASPIKE_NIF_CACHE_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+// a miss returns the ticket to pass to cache_put(), see cache.cpp
+bool cache_enabled();
+void cache_configure(size_t max_entries, uint64_t max_age);
+void cache_clear();
+bool cache_get(const std::string& key, ErlNifEnv* env, ERL_NIF_TERM* term, uint64_t* ticket);
+void cache_put(const std::string& key, ErlNifEnv* env, ERL_NIF_TERM term, uint64_t ticket);
+void cache_invalidate(const std::string& key);
+ERL_NIF_TERM cache_stats(ErlNifEnv* env);
+
+#endif
@@ -0,0 +1,201 @@
+/* coalesce.cpp */
+
+// Write coalescing of cdt_put: puts to the same record (and with the same
+// record ttl) within a short window go out as one operate with all of their
+// map_put operations. A caller only adds its bin list to the open batch of
+// the key (the first one opens it) and gets a reference back; a flush thread
+// sends a batch once its window has passed or it holds max_subkeys fcaps,
+// and every caller gets the result as {aspike, Ref, Result} when the write
+// is done. No scheduler waits for the window.
+// Disabled (window = 0) until coalesce_configure() is called.
+
+#include "coalesce.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+static coalesce_write_fun write_batch = NULL;
+static coalesce_free_fun free_target = NULL;
+
+static std::mutex config_mutex;            // one coalesce_configure() at a time
+static std::mutex mutex;
+static std::condition_variable flush_cv;
+static std::unordered_map<std::string, put_batch*> open_batches;
+static std::deque<put_batch*> open_order;   // open_batches by deadline
+static std::deque<put_batch*> full;         // closed by max_subkeys, sent first
+static std::thread flush_thread;
+static bool flush_stop = false;
+
+static std::atomic<uint32_t> window_ms(0);
+static std::atomic<uint32_t> max_subkeys(64);
+
+static std::atomic<uint64_t> batches(0);
+static std::atomic<uint64_t> coalesced_puts(0);
+
+static uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void coalesce_init(coalesce_write_fun write, coalesce_free_fun free)
+{
+    write_batch = write;
+    free_target = free;
+}
+
+bool coalesce_enabled()
+{
+    return window_ms.load(std::memory_order_relaxed) > 0;
+}
+
+uint32_t coalesce_window()
+{
+    return window_ms.load(std::memory_order_relaxed);
+}
+
+// mutex is held: the batches to send now, all of them when the thread stops
+static void take_due(std::vector<put_batch*>* due)
+{
+    due->insert(due->end(), full.begin(), full.end());
+    full.clear();
+    uint64_t now = now_ms();
+    while (!open_order.empty() && (flush_stop || open_order.front()->deadline <= now)) {
+        put_batch* b = open_order.front();
+        open_batches.erase(b->key);
+        open_order.pop_front();
+        due->push_back(b);
+    }
+}
+
+static void flush_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        std::vector<put_batch*> due;
+        take_due(&due);
+        if (due.empty()) {
+            if (flush_stop) {
+                return;
+            }
+            if (open_order.empty()) {
+                flush_cv.wait(lock);
+            } else {
+                flush_cv.wait_until(lock, std::chrono::steady_clock::time_point(
+                    std::chrono::milliseconds(open_order.front()->deadline)));
+            }
+            continue;
+        }
+        lock.unlock();
+        for (auto b : due) {
+            batches.fetch_add(1, std::memory_order_relaxed);
+            write_batch(b);
+        }
+        lock.lock();
+    }
+}
+
+// window 0 stops the flush thread, the open batches are sent first
+void coalesce_configure(uint32_t window, uint32_t max)
+{
+    std::lock_guard<std::mutex> config_lock(config_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    window_ms.store(window, std::memory_order_relaxed);
+    max_subkeys.store(max, std::memory_order_relaxed);
+    if (window > 0 && !flush_thread.joinable()) {
+        flush_stop = false;
+        flush_thread = std::thread(flush_loop);
+    } else if (window == 0 && flush_thread.joinable()) {
+        flush_stop = true;
+        flush_cv.notify_all();
+        lock.unlock();
+        flush_thread.join();
+    }
+}
+
+// Adds list (subkeys fcaps) to the open batch of key or opens a new one with target,
+// target is freed when a batch is joined. The caller gets {aspike, Ref, Result} for *ref.
+// false (target not taken) when coalescing was turned off meanwhile.
+bool coalesce_put(ErlNifEnv* env, const std::string& key, ERL_NIF_TERM list, unsigned int subkeys,
+    void* target, ERL_NIF_TERM* ref)
+{
+    ErlNifPid pid;
+    enif_self(env, &pid);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!flush_thread.joinable() || flush_stop) {
+        return false;
+    }
+    *ref = enif_make_ref(env);
+    coalesced_puts.fetch_add(1, std::memory_order_relaxed);
+
+    put_batch* b;
+    auto found = open_batches.find(key);
+    if (found != open_batches.end()) {
+        b = found->second;
+        free_target(target);
+    } else {
+        b = new put_batch;
+        b->key = key;
+        b->env = enif_alloc_env();
+        b->subkeys = 0;
+        b->deadline = now_ms() + window_ms.load(std::memory_order_relaxed);
+        b->target = target;
+        open_batches[key] = b;
+        open_order.push_back(b);
+        if (open_order.size() == 1) {
+            flush_cv.notify_one();
+        }
+    }
+    b->lists.push_back(enif_make_copy(b->env, list));
+    b->pids.push_back(pid);
+    b->refs.push_back(enif_make_copy(b->env, *ref));
+    b->subkeys += subkeys;
+    if (b->subkeys >= max_subkeys.load(std::memory_order_relaxed)) {
+        // closed right away, the flush thread sends it now
+        open_batches.erase(b->key);
+        open_order.erase(std::find(open_order.begin(), open_order.end(), b));
+        full.push_back(b);
+        flush_cv.notify_one();
+    }
+    return true;
+}
+
+// called by the write function once the batch is written (or failed), replies to every
+// caller and frees the batch
+void coalesce_done(put_batch* b, bool ok, const char* error)
+{
+    ErlNifEnv* msg_env = enif_alloc_env();
+    for (size_t i = 0; i < b->pids.size(); i++) {
+        ERL_NIF_TERM result = ok
+            ? enif_make_tuple2(msg_env, enif_make_atom(msg_env, "ok"), enif_make_string(msg_env, "put", ERL_NIF_UTF8))
+            : enif_make_tuple2(msg_env, enif_make_atom(msg_env, "error"), enif_make_string(msg_env, error, ERL_NIF_UTF8));
+        ERL_NIF_TERM msg = enif_make_tuple3(msg_env, enif_make_atom(msg_env, "aspike"),
+            enif_make_copy(msg_env, b->refs[i]), result);
+        // clears msg_env, it is used again for the next caller
+        enif_send(NULL, &b->pids[i], msg_env, msg);
+    }
+    enif_free_env(msg_env);
+    enif_free_env(b->env);
+    free_target(b->target);
+    delete b;
+}
+
+// #{batches, puts}: writes sent and cdt_put calls they carried
+ERL_NIF_TERM coalesce_stats(ErlNifEnv* env)
+{
+    ERL_NIF_TERM keys[] = {enif_make_atom(env, "batches"), enif_make_atom(env, "puts")};
+    ERL_NIF_TERM values[] = {
+        enif_make_uint64(env, batches.load(std::memory_order_relaxed)),
+        enif_make_uint64(env, coalesced_puts.load(std::memory_order_relaxed))
+    };
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 2, &map);
+    return map;
+}
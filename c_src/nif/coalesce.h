@@ -0,0 +1,38 @@
+/* coalesce.h */
+
+#ifndef ASPIKE_NIF_COALESCE_H
+#define ASPIKE_NIF_COALESCE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+// a batch of coalesced cdt_put calls, see coalesce.cpp
+struct put_batch {
+    std::string key;
+    ErlNifEnv* env;
+    std::vector<ERL_NIF_TERM> lists;    // bin lists of all callers, terms of env
+    std::vector<ErlNifPid> pids;        // callers and the refs (terms of env) they wait on
+    std::vector<ERL_NIF_TERM> refs;
+    unsigned int subkeys;
+    uint64_t deadline;                  // steady clock, ms
+    void* target;                       // made by the first caller, see coalesce_init()
+};
+
+// write sends the batch (without blocking) and calls coalesce_done() once it is written,
+// free_target frees a target that was not needed or whose batch is done
+typedef void (*coalesce_write_fun)(put_batch* b);
+typedef void (*coalesce_free_fun)(void* target);
+
+void coalesce_init(coalesce_write_fun write, coalesce_free_fun free_target);
+bool coalesce_enabled();
+uint32_t coalesce_window();
+void coalesce_configure(uint32_t window, uint32_t max);
+bool coalesce_put(ErlNifEnv* env, const std::string& key, ERL_NIF_TERM list, unsigned int subkeys,
+    void* target, ERL_NIF_TERM* ref);
+void coalesce_done(put_batch* b, bool ok, const char* error);
+ERL_NIF_TERM coalesce_stats(ErlNifEnv* env);
+
+#endif
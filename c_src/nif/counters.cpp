@@ -0,0 +1,106 @@
+/* counters.cpp */
+
+// Aggregated key_inc deltas. Every calling thread (dirty schedulers, in
+// practice) hashes to one of the shards, so increments of a hot counter
+// from different schedulers rarely share a lock. The flush (aspike_nif.cpp)
+// takes the shards' contents and writes them with one batch.
+// The owner of an entry (the cluster handle) is kept by the caller when
+// counters_add() creates the entry and released after the flush.
+
+#include "counters.h"
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define COUNTERS_SHARDS 32
+
+typedef struct {
+    std::mutex mutex;
+    std::unordered_map<std::string, counter_delta> deltas;
+} counters_shard;
+
+static counters_shard shards[COUNTERS_SHARDS];
+
+static counters_shard* own_shard()
+{
+    return &shards[std::hash<std::thread::id>()(std::this_thread::get_id()) % COUNTERS_SHARDS];
+}
+
+static std::string counter_key(void* owner, const std::string& ns, const std::string& set,
+    const std::string& key, const std::string& bin)
+{
+    std::string res((const char*)&owner, sizeof(owner));
+    res.append(ns).push_back('\0');
+    res.append(set).push_back('\0');
+    res.append(key).push_back('\0');
+    res.append(bin);
+    return res;
+}
+
+// true when the entry is new, the caller has to keep owner then
+bool counters_add(void* owner, const std::string& ns, const std::string& set,
+    const std::string& key, const std::string& bin, int64_t delta)
+{
+    counters_shard* shard = own_shard();
+    std::string ckey = counter_key(owner, ns, set, key, bin);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto found = shard->deltas.find(ckey);
+    if (found != shard->deltas.end()) {
+        found->second.delta += delta;
+        return false;
+    }
+    counter_delta& d = shard->deltas[ckey];
+    d.owner = owner;
+    d.ns = ns;
+    d.set = set;
+    d.key = key;
+    d.bin = bin;
+    d.delta = delta;
+    return true;
+}
+
+// moves all entries to out, one per shard and counter (not merged)
+void counters_drain(std::vector<counter_delta>* out)
+{
+    for (int i = 0; i < COUNTERS_SHARDS; i++) {
+        std::unordered_map<std::string, counter_delta> deltas;
+        {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            deltas.swap(shards[i].deltas);
+        }
+        for (auto& it : deltas) {
+            out->push_back(it.second);
+        }
+    }
+}
+
+// [{Namespace, Set, Key, Bin, Delta}] of the deltas not flushed yet, summed over the shards
+ERL_NIF_TERM counters_pending(ErlNifEnv* env)
+{
+    std::unordered_map<std::string, counter_delta> sum;
+    for (int i = 0; i < COUNTERS_SHARDS; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        for (auto& it : shards[i].deltas) {
+            auto found = sum.find(it.first);
+            if (found == sum.end()) {
+                sum[it.first] = it.second;
+            } else {
+                found->second.delta += it.second.delta;
+            }
+        }
+    }
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (auto& it : sum) {
+        const counter_delta& d = it.second;
+        list = enif_make_list_cell(env, enif_make_tuple5(env,
+            enif_make_string_len(env, d.ns.data(), d.ns.size(), ERL_NIF_UTF8),
+            enif_make_string_len(env, d.set.data(), d.set.size(), ERL_NIF_UTF8),
+            enif_make_string_len(env, d.key.data(), d.key.size(), ERL_NIF_UTF8),
+            enif_make_string_len(env, d.bin.data(), d.bin.size(), ERL_NIF_UTF8),
+            enif_make_int64(env, d.delta)), list);
+    }
+    return list;
+}
@@ -0,0 +1,27 @@
+/* counters.h */
+
+#ifndef ASPIKE_NIF_COUNTERS_H
+#define ASPIKE_NIF_COUNTERS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+// one aggregated key_inc delta, see counters.cpp
+typedef struct {
+    void* owner;
+    std::string ns;
+    std::string set;
+    std::string key;
+    std::string bin;
+    int64_t delta;
+} counter_delta;
+
+bool counters_add(void* owner, const std::string& ns, const std::string& set,
+    const std::string& key, const std::string& bin, int64_t delta);
+void counters_drain(std::vector<counter_delta>* out);
+ERL_NIF_TERM counters_pending(ErlNifEnv* env);
+
+#endif
@@ -0,0 +1,205 @@
+/* flight.cpp */
+
+// Single-flight reads: concurrent reads of the same record (and the same
+// operation) share one server request. The first reader leads the flight,
+// later ones join it until the leader publishes the result with
+// flight_leave(); every waiter gets a copy of the same {ok, _} | {error, _}.
+//
+// Sync readers wait on the flight's condition variable (they are on dirty
+// IO schedulers, which are there to block); async readers only leave their
+// pid and ref and get {aspike, Ref, Result} sent by the leader.
+// A write detaches the flights of its key, so a read that starts after the
+// write never joins a request that was sent before it.
+// The flight key is the record and the operation only: a joined reader gets
+// the leader's result whatever its own policy, so it is off until
+// flight_enable(true).
+
+#include "flight.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+#define FLIGHT_SHARDS 16
+
+typedef struct {
+    ErlNifPid pid;
+    ErlNifEnv* env;
+    ERL_NIF_TERM ref;
+} flight_async_waiter;
+
+struct flight {
+    std::string key;
+    std::condition_variable cv;
+    bool done;
+    int refs;                   // the leader and the sync waiters
+    ErlNifEnv* env;
+    ERL_NIF_TERM result;
+    std::vector<flight_async_waiter> async_waiters;
+};
+
+typedef struct {
+    std::mutex mutex;
+    std::unordered_map<std::string, flight*> flights;
+} flight_shard;
+
+static flight_shard shards[FLIGHT_SHARDS];
+static std::atomic<bool> enabled(false);
+static std::atomic<uint64_t> leaders(0);
+static std::atomic<uint64_t> joiners(0);
+
+static ERL_NIF_TERM atom_aspike;
+
+static flight_shard* shard_of(const std::string& key)
+{
+    return &shards[std::hash<std::string>()(key) % FLIGHT_SHARDS];
+}
+
+static std::string flight_key(const std::string& key, int op)
+{
+    return key + (char)op;
+}
+
+// shard lock is held
+static void release(flight* f)
+{
+    if (--f->refs == 0) {
+        if (f->env != NULL) {
+            enif_free_env(f->env);
+        }
+        delete f;
+    }
+}
+
+// shard lock is held
+static flight* find_flight(flight_shard* shard, const std::string& fkey)
+{
+    auto found = shard->flights.find(fkey);
+    return found == shard->flights.end() ? NULL : found->second;
+}
+
+// shard lock is held
+static flight* start_flight(flight_shard* shard, const std::string& fkey)
+{
+    flight* f = new flight;
+    f->key = fkey;
+    f->done = false;
+    f->refs = 1;
+    f->env = NULL;
+    shard->flights[fkey] = f;
+    leaders.fetch_add(1, std::memory_order_relaxed);
+    return f;
+}
+
+void flight_init(ErlNifEnv* env)
+{
+    atom_aspike = enif_make_atom(env, "aspike");
+}
+
+bool flight_enabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void flight_enable(bool enable)
+{
+    enabled.store(enable, std::memory_order_relaxed);
+}
+
+// not NULL: the caller leads the flight and must call flight_leave() with it,
+// NULL: another read of the key was in flight, its result is in *result
+flight* flight_enter(const std::string& key, int op, ErlNifEnv* env, ERL_NIF_TERM* result)
+{
+    std::string fkey = flight_key(key, op);
+    flight_shard* shard = shard_of(fkey);
+    std::unique_lock<std::mutex> lock(shard->mutex);
+    flight* f = find_flight(shard, fkey);
+    if (f == NULL) {
+        return start_flight(shard, fkey);
+    }
+    joiners.fetch_add(1, std::memory_order_relaxed);
+    f->refs++;
+    while (!f->done) {
+        f->cv.wait(lock);
+    }
+    *result = enif_make_copy(env, f->result);
+    release(f);
+    return NULL;
+}
+
+// as flight_enter(), but a joining reader does not wait: pid gets
+// {aspike, Ref, Result} when the leader is done
+flight* flight_enter_async(const std::string& key, int op, ErlNifPid* pid, ErlNifEnv* env, ERL_NIF_TERM ref)
+{
+    std::string fkey = flight_key(key, op);
+    flight_shard* shard = shard_of(fkey);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    flight* f = find_flight(shard, fkey);
+    if (f == NULL) {
+        return start_flight(shard, fkey);
+    }
+    joiners.fetch_add(1, std::memory_order_relaxed);
+    flight_async_waiter w;
+    w.pid = *pid;
+    w.env = enif_alloc_env();
+    w.ref = enif_make_copy(w.env, ref);
+    f->async_waiters.push_back(w);
+    return NULL;
+}
+
+// the leader publishes its result to all waiters, caller_env is NULL on
+// an event loop thread
+void flight_leave(flight* f, ErlNifEnv* caller_env, ERL_NIF_TERM result)
+{
+    flight_shard* shard = shard_of(f->key);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto found = shard->flights.find(f->key);
+    // a write may have detached it, another flight of the key may be on then
+    if (found != shard->flights.end() && found->second == f) {
+        shard->flights.erase(found);
+    }
+    for (size_t i = 0; i < f->async_waiters.size(); i++) {
+        flight_async_waiter* w = &f->async_waiters[i];
+        ERL_NIF_TERM msg = enif_make_tuple3(w->env, atom_aspike, w->ref, enif_make_copy(w->env, result));
+        enif_send(caller_env, &w->pid, w->env, msg);
+        enif_free_env(w->env);
+    }
+    f->async_waiters.clear();
+    if (f->refs > 1) {
+        f->env = enif_alloc_env();
+        f->result = enif_make_copy(f->env, result);
+    }
+    f->done = true;
+    f->cv.notify_all();
+    release(f);
+}
+
+// after a write to the key: reads from now on start new flights
+void flight_detach(const std::string& key)
+{
+    for (int op = 0; op < FLIGHT_OPS; op++) {
+        std::string fkey = flight_key(key, op);
+        flight_shard* shard = shard_of(fkey);
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->flights.erase(fkey);
+    }
+}
+
+// #{leaders, joiners}
+ERL_NIF_TERM flight_stats(ErlNifEnv* env)
+{
+    ERL_NIF_TERM keys[] = {enif_make_atom(env, "leaders"), enif_make_atom(env, "joiners")};
+    ERL_NIF_TERM values[] = {
+        enif_make_uint64(env, leaders.load(std::memory_order_relaxed)),
+        enif_make_uint64(env, joiners.load(std::memory_order_relaxed))
+    };
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 2, &map);
+    return map;
+}
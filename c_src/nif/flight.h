@@ -0,0 +1,28 @@
+/* flight.h */
+
+#ifndef ASPIKE_NIF_FLIGHT_H
+#define ASPIKE_NIF_FLIGHT_H
+
+#include <string>
+
+#include <erl_nif.h>
+
+// operations with their own flights, see flight.cpp
+enum {
+    FLIGHT_BINARY_GET,
+    FLIGHT_CDT_GET,
+    FLIGHT_OPS
+};
+
+struct flight;
+
+void flight_init(ErlNifEnv* env);
+bool flight_enabled();
+void flight_enable(bool enable);
+flight* flight_enter(const std::string& key, int op, ErlNifEnv* env, ERL_NIF_TERM* result);
+flight* flight_enter_async(const std::string& key, int op, ErlNifPid* pid, ErlNifEnv* env, ERL_NIF_TERM ref);
+void flight_leave(flight* f, ErlNifEnv* caller_env, ERL_NIF_TERM result);
+void flight_detach(const std::string& key);
+ERL_NIF_TERM flight_stats(ErlNifEnv* env);
+
+#endif
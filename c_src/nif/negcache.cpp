@@ -0,0 +1,156 @@
+/* negcache.cpp */
+
+// Negative cache: a time-decayed Bloom filter of keys that recently came back
+// AEROSPIKE_ERR_RECORD_NOT_FOUND. Every slot holds the time it was last set
+// instead of a bit, a key is in the filter when all of its slots were set
+// within the window, so old misses fade out without any sweeping.
+// A write through the NIF zeroes the slots of its key (and maybe of some
+// other keys, which then just cost a round trip again).
+// A Bloom filter has false positives: while the window lasts an existing
+// record can be reported not found, keep the window short.
+// Disabled (window = 0) until negcache_configure() is called.
+
+#include "negcache.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+#define NEGCACHE_SLOTS (1 << 21)        // power of two, 4 bytes each
+#define NEGCACHE_HASHES 4
+#define NEGCACHE_STRIPES 64             // write tickets, see negcache_insert()
+
+static std::atomic<uint32_t> slots[NEGCACHE_SLOTS];
+static std::atomic<uint64_t> stripes[NEGCACHE_STRIPES];
+static std::atomic<uint32_t> window_ms(0);
+
+static std::atomic<uint64_t> hits(0);
+static std::atomic<uint64_t> inserts(0);
+static std::atomic<uint64_t> clears(0);
+
+static const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+// milliseconds since load, 0 marks an empty slot
+static uint32_t now_ms()
+{
+    uint32_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    return now == 0 ? 1 : now;
+}
+
+typedef struct {
+    uint32_t index[NEGCACHE_HASHES];
+    std::atomic<uint64_t>* stripe;
+} negcache_slots;
+
+// the key ends with the record digest, so std::hash of it is well spread;
+// the slots come from double hashing
+static void slots_of(const std::string& key, negcache_slots* res)
+{
+    uint64_t h = std::hash<std::string>()(key);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        res->index[i] = (h1 + i * h2) & (NEGCACHE_SLOTS - 1);
+    }
+    res->stripe = &stripes[(h >> 26) % NEGCACHE_STRIPES];
+}
+
+static void clear_slots(const negcache_slots* ks)
+{
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        slots[ks->index[i]].store(0, std::memory_order_relaxed);
+    }
+}
+
+bool negcache_enabled()
+{
+    return window_ms.load(std::memory_order_relaxed) > 0;
+}
+
+// window = 0 turns the filter off and empties it
+void negcache_configure(uint32_t window)
+{
+    window_ms.store(window, std::memory_order_relaxed);
+    if (window == 0) {
+        for (int i = 0; i < NEGCACHE_SLOTS; i++) {
+            slots[i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+// true when the key was not found within the window. Otherwise *ticket is
+// what negcache_insert() needs to know that no write happened in between.
+bool negcache_lookup(const std::string& key, uint64_t* ticket)
+{
+    negcache_slots ks;
+    slots_of(key, &ks);
+    *ticket = ks.stripe->load(std::memory_order_acquire);
+
+    uint32_t window = window_ms.load(std::memory_order_relaxed);
+    uint32_t now = now_ms();
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        uint32_t t = slots[ks.index[i]].load(std::memory_order_relaxed);
+        if (t == 0 || now - t >= window) {
+            return false;
+        }
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void negcache_insert(const std::string& key, uint64_t ticket)
+{
+    if (!negcache_enabled()) {
+        return;
+    }
+    negcache_slots ks;
+    slots_of(key, &ks);
+    if (ks.stripe->load(std::memory_order_acquire) != ticket) {
+        return;
+    }
+    uint32_t now = now_ms();
+    for (int i = 0; i < NEGCACHE_HASHES; i++) {
+        slots[ks.index[i]].store(now, std::memory_order_relaxed);
+    }
+    // a write that bumped the stripe before the slots were set may have
+    // cleared them already, undo the insert then
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ks.stripe->load(std::memory_order_relaxed) != ticket) {
+        clear_slots(&ks);
+        return;
+    }
+    inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+// after a write to the key
+void negcache_clear(const std::string& key)
+{
+    negcache_slots ks;
+    slots_of(key, &ks);
+    ks.stripe->fetch_add(1, std::memory_order_acq_rel);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    clear_slots(&ks);
+    clears.fetch_add(1, std::memory_order_relaxed);
+}
+
+// #{hits, inserts, clears}
+ERL_NIF_TERM negcache_stats(ErlNifEnv* env)
+{
+    const char* const names[] = {"hits", "inserts", "clears"};
+    const std::atomic<uint64_t>* const counters[] = {&hits, &inserts, &clears};
+    const int count = sizeof(names) / sizeof(names[0]);
+    ERL_NIF_TERM keys[count];
+    ERL_NIF_TERM values[count];
+    for (int i = 0; i < count; i++) {
+        keys[i] = enif_make_atom(env, names[i]);
+        values[i] = enif_make_uint64(env, counters[i]->load(std::memory_order_relaxed));
+    }
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, count, &map);
+    return map;
+}
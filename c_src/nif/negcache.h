@@ -0,0 +1,19 @@
+/* negcache.h */
+
+#ifndef ASPIKE_NIF_NEGCACHE_H
+#define ASPIKE_NIF_NEGCACHE_H
+
+#include <string>
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+// a miss returns the ticket to pass to negcache_insert(), see negcache.cpp
+bool negcache_enabled();
+void negcache_configure(uint32_t window);
+bool negcache_lookup(const std::string& key, uint64_t* ticket);
+void negcache_insert(const std::string& key, uint64_t ticket);
+void negcache_clear(const std::string& key);
+ERL_NIF_TERM negcache_stats(ErlNifEnv* env);
+
+#endif
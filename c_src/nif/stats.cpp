@@ -0,0 +1,168 @@
+/* stats.cpp */
+
+// Per operation latency histograms, split into phases:
+// argument decode, client call and term encode.
+// Recording is a couple of relaxed atomic increments, so it is safe from any
+// scheduler or event loop thread without locks.
+//
+// Buckets are log-linear (HDR style): values below STATS_SUB_BUCKETS have
+// their own bucket, above that every power of two is split into
+// STATS_SUB_BUCKETS buckets, i.e. the relative error is under 1/16.
+
+#include "stats.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+
+#include <erl_nif.h>
+
+#define STATS_MAX_OPS 32
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef struct {
+    std::atomic<uint64_t> buckets[STATS_BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+} histogram;
+
+static const char* const phase_names[STATS_PHASES] = {"decode", "call", "encode"};
+static const char* const* op_names = NULL;
+static int ops_number = 0;
+static histogram histograms[STATS_MAX_OPS][STATS_PHASES];
+
+static int bucket_index(uint64_t v)
+{
+    if (v < STATS_SUB_BUCKETS) {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (int)((v >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+// highest value that goes to the bucket
+static uint64_t bucket_value(int index)
+{
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / STATS_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t stats_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// names have to live as long as the library, e.g. string literals
+void stats_init(const char* const names[], int count)
+{
+    op_names = names;
+    ops_number = count < STATS_MAX_OPS ? count : STATS_MAX_OPS;
+}
+
+void stats_record(int op, int phase, uint64_t ns)
+{
+    if (op < 0 || op >= ops_number || phase < 0 || phase >= STATS_PHASES) {
+        return;
+    }
+    histogram* h = &histograms[op][phase];
+    h->buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+    h->sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = h->max.load(std::memory_order_relaxed);
+    while (ns > max && !h->max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void stats_reset()
+{
+    for (int op = 0; op < STATS_MAX_OPS; op++) {
+        for (int phase = 0; phase < STATS_PHASES; phase++) {
+            histogram* h = &histograms[op][phase];
+            for (int i = 0; i < STATS_BUCKETS; i++) {
+                h->buckets[i].store(0, std::memory_order_relaxed);
+            }
+            h->sum.store(0, std::memory_order_relaxed);
+            h->max.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+static ERL_NIF_TERM histogram_to_map(ErlNifEnv* env, histogram* h)
+{
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    static const char* const percentile_names[] = {"p50", "p90", "p99", "p999"};
+    const int percentiles_number = sizeof(percentiles) / sizeof(percentiles[0]);
+
+    // a copy first, so all percentiles are taken from the same counts
+    uint64_t counts[STATS_BUCKETS];
+    uint64_t count = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        counts[i] = h->buckets[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+    uint64_t sum = h->sum.load(std::memory_order_relaxed);
+    uint64_t max = h->max.load(std::memory_order_relaxed);
+
+    ERL_NIF_TERM keys[4 + percentiles_number];
+    ERL_NIF_TERM values[4 + percentiles_number];
+    keys[0] = enif_make_atom(env, "count");
+    values[0] = enif_make_uint64(env, count);
+    keys[1] = enif_make_atom(env, "mean");
+    values[1] = enif_make_uint64(env, count > 0 ? sum / count : 0);
+    keys[2] = enif_make_atom(env, "max");
+    values[2] = enif_make_uint64(env, max);
+    keys[3] = enif_make_atom(env, "min");
+
+    int i = 0;
+    while (i < STATS_BUCKETS && counts[i] == 0) {
+        i++;
+    }
+    values[3] = enif_make_uint64(env, i < STATS_BUCKETS ? bucket_value(i) : 0);
+
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (int p = 0; p < percentiles_number; p++) {
+        uint64_t rank = (uint64_t)(percentiles[p] / 100.0 * count + 0.5);
+        while (bucket < STATS_BUCKETS && seen + counts[bucket] < rank) {
+            seen += counts[bucket];
+            bucket++;
+        }
+        uint64_t value = count == 0 ? 0 : bucket_value(bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1);
+        keys[4 + p] = enif_make_atom(env, percentile_names[p]);
+        values[4 + p] = enif_make_uint64(env, value < max ? value : max);
+    }
+
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 4 + percentiles_number, &map);
+    return map;
+}
+
+// #{Op => #{decode | call | encode => #{count, mean, min, max, p50, p90, p99, p999}}}
+// all values are in nanoseconds, ops without samples are skipped
+ERL_NIF_TERM stats_snapshot(ErlNifEnv* env)
+{
+    ERL_NIF_TERM res = enif_make_new_map(env);
+    for (int op = 0; op < ops_number; op++) {
+        bool has_samples = false;
+        ERL_NIF_TERM phases = enif_make_new_map(env);
+        for (int phase = 0; phase < STATS_PHASES; phase++) {
+            histogram* h = &histograms[op][phase];
+            if (h->max.load(std::memory_order_relaxed) == 0 && h->buckets[0].load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            has_samples = true;
+            enif_make_map_put(env, phases, enif_make_atom(env, phase_names[phase]), histogram_to_map(env, h), &phases);
+        }
+        if (has_samples) {
+            enif_make_map_put(env, res, enif_make_atom(env, op_names[op]), phases, &res);
+        }
+    }
+    return res;
+}
@@ -0,0 +1,24 @@
+/* stats.h */
+
+#ifndef ASPIKE_NIF_STATS_H
+#define ASPIKE_NIF_STATS_H
+
+#include <stdint.h>
+
+#include <erl_nif.h>
+
+// phases of a call, see stats.cpp
+enum {
+    STATS_DECODE,
+    STATS_CALL,
+    STATS_ENCODE,
+    STATS_PHASES
+};
+
+uint64_t stats_now();
+void stats_init(const char* const names[], int count);
+void stats_record(int op, int phase, uint64_t ns);
+void stats_reset();
+ERL_NIF_TERM stats_snapshot(ErlNifEnv* env);
+
+#endif
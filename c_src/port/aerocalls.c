@@ -1,6 +1,8 @@
 /* aerocalls.c */
 
 #include "ei.h"
+#include "logger.h"
+#include "aerocalls.h"
 #include <string.h>
 #include <stdlib.h>
 #include <cstring>
@@ -9,6 +11,8 @@
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <mutex>
+#include <atomic>
 
 #include <aerospike/aerospike.h>
 #include <aerospike/aerospike_info.h>
@@ -29,6 +33,7 @@
 #include <aerospike/as_exp.h>
 #include <aerospike/as_batch.h>
 #include <aerospike/aerospike_batch.h>
+#include <aerospike/as_event.h>
 
 // ----------------------------------------------------------------------------
 
@@ -124,15 +129,23 @@ struct cdtPutStruct {
 
 // ----------------------------------------------------------------------------
 
+// Commands run on several worker threads: the data commands share as once it is
+// connected, the admin ones (init, hosts, connect, config_info) change or read its
+// config and are run one at a time under admin_mutex.
 static aerospike as;
-int is_aerospike_initialised = 0;
-int is_connected = 0;
+static std::mutex admin_mutex;
+std::atomic<int> is_aerospike_initialised(0);
+std::atomic<int> is_connected(0);
+
+#define ADMIN_LOCK std::lock_guard<std::mutex> admin_lock(admin_mutex);
 
 // ----------------------------------------------------------------------------
 
 typedef char byte;
 
 int write_cmd(byte *buf, int len, int fd);
+uint32_t get_current_req_id();
+void set_req_id(uint32_t req_id);
 
 
 int ifail(int ind, int fd);
@@ -184,7 +197,6 @@ int call_port_cdt_delete_by_keys(const char *buf, int *index, int arity, int fd_
 int call_port_cdt_delete_by_keys_batch(const char *buf, int *index, int arity, int fd_out);
 int call_port_binary_remove(const char *buf, int *index, int arity, int fd_out);
 
-void logfile(std::string str);
 
 char err_msg[8][80] = {
     "ei_decode_version",
@@ -216,6 +228,87 @@ int note(const char *msg, int fd_out) {
     POST
 }
 
+// ----------------------------------------------------------------------------
+// Async mode (aspike_port --async): the port main loop is also the client
+// event loop, binary_key_get, cdt_get and cdt_put are sent with the *_async
+// client calls and replied from the listener, other commands stay sync and run on the
+// worker threads (ei.c).
+
+typedef int (*dump_fun)(ei_x_buff *p_res_buf, const as_record *p_rec);
+
+typedef struct {
+    uint32_t req_id;
+    int fd_out;
+    dump_fun dump;      // NULL for commands that reply with ok_msg
+    const char *ok_msg;
+} async_command;
+
+static as_event_loop *async_loop = NULL;
+static int async_in_flight = 0;
+
+// has to be called before aerospike_connect(), i.e. before the first command
+int async_init(void *ev_loop) {
+    if (!as_event_set_external_loop_capacity(1)) {
+        return 0;
+    }
+    async_loop = as_event_set_external_loop(ev_loop);
+    return async_loop != NULL;
+}
+
+int async_pending() {
+    return async_in_flight;
+}
+
+// cdt_put and binary_put keep the Bin ++ "_exp" expiry index too (--expiry-index)
+static bool expiry_index = false;
+
+void set_expiry_index(bool on) {
+    expiry_index = on;
+}
+
+static async_command *async_command_new(int fd_out, dump_fun dump, const char *ok_msg) {
+    async_command *cmd = new async_command;
+    cmd->req_id = get_current_req_id();
+    cmd->fd_out = fd_out;
+    cmd->dump = dump;
+    cmd->ok_msg = ok_msg;
+    async_in_flight++;
+    return cmd;
+}
+
+static void async_command_free(async_command *cmd) {
+    async_in_flight--;
+    delete cmd;
+}
+
+// p_rec is owned by the client and destroyed after the listener returns
+static void async_record_listener(as_error *err, as_record *p_rec, void *udata, as_event_loop *event_loop) {
+    async_command *cmd = (async_command *)udata;
+    int res = 1;
+    ei_x_buff res_buf;
+    ei_x_new_with_version(&res_buf);
+    ei_x_encode_tuple_header(&res_buf, 2);
+
+    if (err) {
+        ERROR(err->message)
+    } else if (cmd->dump) {
+        res = cmd->dump(&res_buf, p_rec);
+    } else {
+        OK(cmd->ok_msg)
+    }
+    (void)res;
+
+    set_req_id(cmd->req_id);
+    write_cmd(res_buf.buff, res_buf.index, cmd->fd_out);
+    ei_x_free(&res_buf);
+    async_command_free(cmd);
+}
+
+// the reply is written later by async_record_listener()
+#define ASYNC_POST \
+    ei_x_free(&res_buf);\
+    return res;
+
 // static void res_buf_free(ei_x_buff  *res_buf, int fd_out) {
 //     if (res_buf != 0 && res_buf->buff != 0 && strncmp(res_buf->buff, "", 1) != 0) { 
 //         if (ei_x_free(res_buf) != 0) {
@@ -241,7 +334,7 @@ int function_call(const char *buf, int *index, int arity, int fd_out) {
         return 0;
     }
 
-    if (check_name(fname, "aerospike_init", arity, 1)) {
+    if (check_name(fname, "aerospike_init", arity, 1) || check_name(fname, "aerospike_init", arity, 2)) {
         return call_aerospike_init(buf, index, arity, fd_out);
     }
     if (check_name(fname, "host_add", arity, 3)) {
@@ -347,6 +440,7 @@ int function_call(const char *buf, int *index, int arity, int fd_out) {
 
 int call_config_info(const char *buf, int *index, int arity, int fd_out){
     PRE
+    ADMIN_LOCK
     CHECK_AEROSPIKE_INIT     
     OK0
 
@@ -461,11 +555,44 @@ int call_port_status(const char *buf, int *index, int arity, int fd_out) {
     POST
 }
 
+// {aerospike_init} or
+// {aerospike_init, {UseShm, ShmKey, ShmMaxNodes, ShmMaxNamespaces, ShmTakeoverThresholdSec}}
+// with use_shm the first process on the host tends the cluster and keeps the
+// partition map in shared memory, the others only read it
 int call_aerospike_init(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
+    int use_shm = 0;
+    long shm_key = 0;
+    long shm_max_nodes = 0;
+    long shm_max_namespaces = 0;
+    long shm_takeover_threshold_sec = 0;
+    if (arity == 2) {
+        int tuple_len;
+        if (ei_decode_tuple_header(buf, index, &tuple_len) < 0 || tuple_len != 5)
+            {STOPERROR("invalid shm options ( wrong size )")}
+        if (ei_decode_boolean(buf, index, &use_shm) < 0)
+            {STOPERROR("invalid shm option: use_shm")}
+        if (ei_decode_long(buf, index, &shm_key) < 0)
+            {STOPERROR("invalid shm option: shm_key")}
+        if (ei_decode_long(buf, index, &shm_max_nodes) < 0)
+            {STOPERROR("invalid shm option: shm_max_nodes")}
+        if (ei_decode_long(buf, index, &shm_max_namespaces) < 0)
+            {STOPERROR("invalid shm option: shm_max_namespaces")}
+        if (ei_decode_long(buf, index, &shm_takeover_threshold_sec) < 0)
+            {STOPERROR("invalid shm option: shm_takeover_threshold_sec")}
+    }
+
     if (!is_aerospike_initialised) {
         as_config config;
         as_config_init(&config);
+        if (use_shm) {
+            config.use_shm = true;
+            config.shm_key = (int)shm_key;
+            config.shm_max_nodes = shm_max_nodes;
+            config.shm_max_namespaces = shm_max_namespaces;
+            config.shm_takeover_threshold_sec = shm_takeover_threshold_sec;
+        }
         aerospike_init(&as, &config);
         is_aerospike_initialised = 1;
     } 
@@ -476,6 +603,7 @@ int call_aerospike_init(const char *buf, int *index, int arity, int fd_out) {
 
 int call_config_add_hosts(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
     char host[MAX_HOST_SIZE];
     long port;
 
@@ -503,6 +631,7 @@ int call_config_add_hosts(const char *buf, int *index, int arity, int fd_out) {
 
 int call_config_clear_hosts(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
     CHECK_INIT
 
     as_config_clear_hosts(&as.config);
@@ -514,6 +643,7 @@ int call_config_clear_hosts(const char *buf, int *index, int arity, int fd_out)
 
 int call_config_list_hosts(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
     CHECK_INIT
 
     as_config  *config = &as.config;   
@@ -540,6 +670,7 @@ int call_config_list_hosts(const char *buf, int *index, int arity, int fd_out) {
 
 int call_connect(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
     char user[AS_USER_SIZE];
     char password[AS_PASSWORD_SIZE];
 
@@ -573,6 +704,7 @@ int call_connect(const char *buf, int *index, int arity, int fd_out) {
 
 int call_anon_connect(const char *buf, int *index, int arity, int fd_out) {
     PRE
+    ADMIN_LOCK
 
     CHECK_INIT
 
@@ -592,12 +724,6 @@ int call_anon_connect(const char *buf, int *index, int arity, int fd_out) {
     POST
 }
 
-void logfile(std::string str){
-    std::fstream file;
-    file.open("/tmp/aspikeport", std::ios::out | std::ios::app);
-    file << str << "\n";
-    file.close();
-}
 
 int decode_bin_term(const char *buf, int *index, std::string& ds){
     int term_size;
@@ -656,7 +782,7 @@ int call_binary_key_put(const char *buf, int *index, int arity, int fd_out) {
     as_key askey;
     as_key_init_str(&askey, ns, set, key);
     as_record rec;
-    as_record_inita(&rec, bin_list_length);
+    as_record_inita(&rec, expiry_index ? 2 * bin_list_length : bin_list_length);
 
     int t_length;
     std::string bin_name, bin_str_value;
@@ -668,6 +794,10 @@ int call_binary_key_put(const char *buf, int *index, int arity, int fd_out) {
             {STOPERROR("invalid tuple")}
         if (decode_bin_term(buf, index, bin_name) < 0 )
             {STOPERROR("invalid bin_name")}
+        // an overwritten fcap bin takes its expiry index with it
+        if (expiry_index && bin_name.size() + 4 < AS_BIN_NAME_MAX_SIZE) {
+            as_record_set_nil(&rec, (bin_name + "_exp").c_str());
+        }
         if (ei_get_type(buf, index, &term_type, &term_size) < 0)
              {STOPERROR("BKP invalid bin value type (should be binary or integer)")}
 
@@ -712,7 +842,7 @@ int call_binary_key_put(const char *buf, int *index, int arity, int fd_out) {
 		   }
 	   }
         } else {
-	   logfile("unknown type: " + std::to_string(term_type));
+	   LOG_WARN("unknown type: " + std::to_string(term_type));
 	}
      
     }
@@ -1021,6 +1151,79 @@ static void dump_binary_bin(ei_x_buff *p_res_buf, const as_bin* p_bin) {
     }
 }
 
+// the value of an fcap entry, bytes or a string
+static void encode_fcap_value(ei_x_buff *p_res_buf, const as_val* val) {
+    if (as_val_type(val) == AS_BYTES) {
+        as_bytes *vnt_b = as_bytes_fromval(val);
+        ei_x_encode_binary(p_res_buf, as_bytes_get(vnt_b), as_bytes_size(vnt_b));
+    } else if (as_val_type(val) == AS_STRING) {
+        as_string *vnt_s = as_string_fromval(val);
+        ei_x_encode_binary(p_res_buf, as_string_get(vnt_s), as_string_len(vnt_s));
+    } else {
+        ei_x_encode_atom(p_res_buf, "undefined");
+    }
+}
+
+// {Value, TTL, WT} of an fcap entry, written either as a {value, ttl, wt} map or in the
+// compact [value, ttl, wt] layout (see format_fcap_entry of the NIF); undefined for anything else
+static void encode_fcap_entry(ei_x_buff *p_res_buf, const as_val* entry) {
+    if (as_val_type(entry) == AS_LIST && as_list_size((const as_list*)entry) == 3) {
+        const as_list* list = (const as_list*)entry;
+        ei_x_encode_tuple_header(p_res_buf, 3);
+        encode_fcap_value(p_res_buf, as_list_get(list, 0));
+        ei_x_encode_long(p_res_buf, as_list_get_int64(list, 1));
+        ei_x_encode_long(p_res_buf, as_list_get_int64(list, 2));
+        return;
+    }
+    if (as_val_type(entry) != AS_MAP) {
+        ei_x_encode_atom(p_res_buf, "undefined");
+        return;
+    }
+
+    long fccount = 0;
+    long ttlsm = 0;
+    long writetime = 0;
+    const as_val* vnt = NULL;
+    const as_orderedmap *vmap = (const as_orderedmap*)as_map_fromval(entry);
+    as_orderedmap_iterator iti_int;
+    as_orderedmap_iterator_init(&iti_int, vmap);
+    while ( as_orderedmap_iterator_has_next(&iti_int) ) {
+        const as_val* valsm = as_orderedmap_iterator_next(&iti_int);
+        as_pair * aprsm = as_pair_fromval(valsm);
+        switch (as_val_type(as_pair_2(aprsm))) {
+            case AS_BYTES:
+            case AS_STRING:
+                vnt = as_pair_2(aprsm);
+                fccount++;
+                break;
+            case AS_INTEGER: {
+                auto smkey = as_string_get((as_string*)as_pair_1(aprsm));
+                if(strcmp(smkey,"ttl") == 0){
+                    ttlsm = as_integer_get((as_integer*)as_pair_2(aprsm));
+                }else if(strcmp(smkey,"wt") == 0) {
+                    writetime = as_integer_get((as_integer*)as_pair_2(aprsm));
+                }
+                fccount++;
+            }break;
+            default:
+                break;
+        }
+    }
+    as_orderedmap_iterator_destroy(&iti_int);
+    if((fccount == 2) || (fccount == 3)){
+        ei_x_encode_tuple_header(p_res_buf, 3);
+        if (vnt != NULL) {
+            encode_fcap_value(p_res_buf, vnt);
+        } else {
+            ei_x_encode_atom(p_res_buf, "undefined");
+        }
+        ei_x_encode_long(p_res_buf, ttlsm);
+        ei_x_encode_long(p_res_buf, writetime);
+    } else {
+        ei_x_encode_atom(p_res_buf, "undefined");
+    }
+}
+
 static void format_value_out(ei_x_buff *p_res_buf, as_val_t type, as_bin_value *val) {
     char* val_as_str = NULL;
     switch (type){
@@ -1050,7 +1253,6 @@ static void format_value_out(ei_x_buff *p_res_buf, as_val_t type, as_bin_value *
             as_orderedmap_iterator_init(&it, amap);
             ei_x_encode_list_header(p_res_buf, len * 2);
             while ( as_orderedmap_iterator_has_next(&it) ) {
-                long fccount = 0;
                 const as_val* val = as_orderedmap_iterator_next(&it);
                 as_pair * apr = as_pair_fromval(val);
 
@@ -1058,48 +1260,7 @@ static void format_value_out(ei_x_buff *p_res_buf, as_val_t type, as_bin_value *
                 auto lenk = as_string_len(asbval);
                 ei_x_encode_binary(p_res_buf, as_string_get(asbval), lenk);
                 
-                const as_orderedmap *vmap = (const as_orderedmap*)as_map_fromval(as_pair_2(apr));
-                as_orderedmap_iterator iti_int;
-                as_orderedmap_iterator_init(&iti_int, vmap);
-                long ttlsm = 0;
-                long writetime = 0;
-                as_string *vnt_s;
-                as_bytes *vnt_b;
-                uint vnt_type = 0;
-                while ( as_orderedmap_iterator_has_next(&iti_int) ) {
-                    const as_val* valsm = as_orderedmap_iterator_next(&iti_int);
-                    as_pair * aprsm = as_pair_fromval(valsm);
-                    if(as_pair_2(aprsm)->type == 9){
-                         vnt_b = as_bytes_fromval(as_pair_2(aprsm));
-                         vnt_type = 1;
-                        fccount++;
-                    }else if(as_pair_2(aprsm)->type == 3){
-                        auto smkey = as_string_get((as_string*)as_pair_1(aprsm));
-                        if(strcmp(smkey,"ttl") == 0){
-                            ttlsm = as_integer_get((as_integer*)as_pair_2(aprsm));
-                        }else if(strcmp(smkey,"wt") == 0) {
-                            writetime = as_integer_get((as_integer*)as_pair_2(aprsm));
-                        }
-                        fccount++;
-                    }else if(as_pair_2(aprsm)->type == 4){
-                        vnt_s = as_string_fromval(as_pair_2(aprsm));
-                        vnt_type = 2;
-                        fccount++;
-                    }
-                }
-                if((fccount == 2) || (fccount == 3)){
-                    ei_x_encode_tuple_header(p_res_buf, 3);
-                    if(vnt_type == 2){
-                        ei_x_encode_binary(p_res_buf, as_string_get(vnt_s), as_string_len(vnt_s));
-                    } else if(vnt_type == 1) {
-                        ei_x_encode_binary(p_res_buf, as_bytes_get(vnt_b), as_bytes_size(vnt_b));
-                    }
-                    ei_x_encode_long(p_res_buf, ttlsm);
-                    ei_x_encode_long(p_res_buf, writetime);
-                } else {
-                    ei_x_encode_atom(p_res_buf, "undefined");
-                }
-                as_orderedmap_iterator_destroy(&iti_int);
+                encode_fcap_entry(p_res_buf, as_pair_2(apr));
             }
             ei_x_encode_empty_list(p_res_buf);
             as_orderedmap_iterator_destroy(&it);
@@ -1158,6 +1319,27 @@ static void format_value_out(ei_x_buff *p_res_buf, as_val_t type, as_bin_value *
 
 }
 
+// true for the Bin ++ "_exp" expiry index of another bin of the record (see do_cdt_put)
+static bool is_expiry_bin(const as_record* p_rec, const char* name) {
+    size_t len = strlen(name);
+    if (len <= 4 || strcmp(name + len - 4, "_exp") != 0) {
+        return false;
+    }
+    std::string bin(name, len - 4);
+    return as_record_get(p_rec, bin.c_str()) != NULL;
+}
+
+// bins of the record without the expiry index ones
+static uint16_t count_data_bins(const as_record* p_rec) {
+    uint16_t num_bins = 0;
+    for (uint16_t i = 0; i < p_rec->bins.size; i++) {
+        if (!is_expiry_bin(p_rec, p_rec->bins.entries[i].name)) {
+            num_bins++;
+        }
+    }
+    return num_bins;
+}
+
 static int dump_cdt_records(ei_x_buff *p_res_buf, const as_record *p_rec) {
     int res = 1;
     if (p_rec == NULL) {
@@ -1175,18 +1357,20 @@ static int dump_cdt_records(ei_x_buff *p_res_buf, const as_record *p_rec) {
         OK0P
 
 
-        uint16_t num_bins = as_record_numbins(p_rec);
+        uint16_t num_bins = count_data_bins(p_rec);
         ei_x_encode_list_header(p_res_buf, num_bins);
-        logfile("DCR numbins: " + std::to_string(num_bins) );
+        LOG_DEBUG("DCR numbins: " + std::to_string(num_bins) );
 
         while (as_record_iterator_has_next(&it)) {
             const as_bin* p_bin = as_record_iterator_next(&it);
-            ei_x_encode_tuple_header(p_res_buf, 2);
             char* name = as_bin_get_name(p_bin);
+            if (is_expiry_bin(p_rec, name)) {
+                continue;
+            }
+            ei_x_encode_tuple_header(p_res_buf, 2);
             auto namelen = strlen(name);
 
-            std::string debug_bn(name, namelen);
-            logfile("DCR name: " + debug_bn + " - " + std::to_string(namelen));
+            LOG_DEBUG("DCR name: " + std::string(name, namelen) + " - " + std::to_string(namelen));
             ei_x_encode_binary(p_res_buf, name, namelen);
 
             uint type = as_bin_get_type(p_bin);
@@ -1216,10 +1400,13 @@ static int binary_dump_records(ei_x_buff *p_res_buf, const as_record *p_rec) {
     as_record_iterator_init(&it, p_rec);
     OK0P
     
-    uint16_t num_bins = as_record_numbins(p_rec);
+    uint16_t num_bins = count_data_bins(p_rec);
     ei_x_encode_list_header(p_res_buf, num_bins);
     while (as_record_iterator_has_next(&it)) {
-    	dump_binary_bin(p_res_buf, as_record_iterator_next(&it));
+        const as_bin* p_bin = as_record_iterator_next(&it);
+        if (!is_expiry_bin(p_rec, as_bin_get_name(p_bin))) {
+            dump_binary_bin(p_res_buf, p_bin);
+        }
     }
     ei_x_encode_empty_list(p_res_buf);
     as_record_iterator_destroy(&it);
@@ -1245,11 +1432,14 @@ static int dump_records(ei_x_buff *p_res_buf, const as_record *p_rec) {
 
     OK0P
     
-	uint16_t num_bins = as_record_numbins(p_rec);
+	uint16_t num_bins = count_data_bins(p_rec);
     ei_x_encode_list_header(p_res_buf, num_bins);
 
 	while (as_record_iterator_has_next(&it)) {
-		dump_bin(p_res_buf, as_record_iterator_next(&it));
+		const as_bin* p_bin = as_record_iterator_next(&it);
+		if (!is_expiry_bin(p_rec, as_bin_get_name(p_bin))) {
+			dump_bin(p_res_buf, p_bin);
+		}
 	}
 
     ei_x_encode_empty_list(p_res_buf);
@@ -1264,8 +1454,7 @@ int call_binary_key_get(const char *buf, int *index, int arity, int fd_out) {
     long len;
     int term_size;
     int term_type;
-    as_record* p_rec = NULL;    
-    logfile("CBKG1");
+    LOG_DEBUG("CBKG1");
 
 
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || term_type != ERL_BINARY_EXT)
@@ -1274,7 +1463,7 @@ int call_binary_key_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, ns, &len) < 0) 
         {STOPERROR("BKG invalid first argument: namespace")}
     ns[len] = '\0'; 
-    logfile("CBKG2");
+    LOG_DEBUG("CBKG2");
     
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || term_type != ERL_BINARY_EXT)
         {STOPERROR("BKG invalid set bytestring size")}
@@ -1282,7 +1471,7 @@ int call_binary_key_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, set, &len) < 0)
         {STOPERROR("BKG invalid second argument: namespace")}
     set[len] = '\0'; 
-    logfile("CBKG3");
+    LOG_DEBUG("CBKG3");
 
 
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || term_type != ERL_BINARY_EXT)
@@ -1291,7 +1480,16 @@ int call_binary_key_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, key, &len) < 0)
         {STOPERROR("BKG invalid second argument: namespace")}
     key[len] = '\0'; 
-    logfile("CBKG4");
+    LOG_DEBUG("CBKG4");
+
+    ei_x_free(&res_buf);
+    return do_binary_key_get(ns, set, key, fd_out);
+}
+
+// ns, set and key are NUL terminated, the same for the ETF and the compact protocol
+int do_binary_key_get(const char *ns, const char *set, const char *key, int fd_out) {
+    PRE
+    as_record* p_rec = NULL;
 
     CHECK_ALL
 
@@ -1299,22 +1497,31 @@ int call_binary_key_get(const char *buf, int *index, int arity, int fd_out) {
     as_key_init_str(&askey, ns, set, key);
     as_error err;
     
-    logfile("CBKG5");
+    LOG_DEBUG("CBKG5");
+    if (async_loop != NULL) {
+        async_command *cmd = async_command_new(fd_out, binary_dump_records, NULL);
+        if (aerospike_key_get_async(&as, &err, NULL, &askey, async_record_listener, cmd, async_loop, NULL) != AEROSPIKE_OK) {
+            async_command_free(cmd);
+            STOPERROR(err.message)
+        }
+        ASYNC_POST
+    }
+
     // Get the record from the database.
     if (aerospike_key_get(&as, &err, NULL, &askey, &p_rec) != AEROSPIKE_OK) {
        STOPERROR(err.message)
-       logfile("CBKG6");
+       LOG_DEBUG("CBKG6");
     }
 
-    logfile("CBKG7");
+    LOG_DEBUG("CBKG7");
     res = binary_dump_records(&res_buf, p_rec);
 
-    logfile("CBKG8");
+    LOG_DEBUG("CBKG8");
     if (p_rec != NULL) {
         as_record_destroy(p_rec);
     }
 
-    logfile("CBKG9");
+    LOG_DEBUG("CBKG9");
     POST
 }
 
@@ -1691,7 +1898,7 @@ int call_port_cdt_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, ns, &len) < 0) 
         {STOPERROR("CPCG invalid first argument: namespace")}
     ns[len] = '\0'; 
-    logfile("CPCG2");
+    LOG_DEBUG("CPCG2");
 
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || term_type != ERL_BINARY_EXT)
     	{STOPERROR("CPCG invalid namespace bytestring size")}
@@ -1699,7 +1906,7 @@ int call_port_cdt_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, aspk_set, &len) < 0) 
         {STOPERROR("CPCG invalid second argument: set")}
     aspk_set[len] = '\0'; 
-    logfile("CPCG3");
+    LOG_DEBUG("CPCG3");
 
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || term_type != ERL_BINARY_EXT)
     	{STOPERROR("CPCG invalid namespace bytestring size")}
@@ -1707,30 +1914,33 @@ int call_port_cdt_get(const char *buf, int *index, int arity, int fd_out) {
     if (ei_decode_binary(buf, index, aspk_key, &len) < 0) 
         {STOPERROR("CPCG invalid third argument: key")}
     aspk_key[len] = '\0'; 
-    logfile("CPCG4");
+    LOG_DEBUG("CPCG4");
 
     // {max_retries, sleep_between_retries, socket_timeout, total_timeout}
-    long max_retries = 0;
-    long sleep_between_retries = 0;
-    long socket_timeout = 30000;
-    long total_timeout = 1000;
+    policyStruct policy;
     int tuple_len; 
     ei_decode_tuple_header(buf, index, &tuple_len);
     if(tuple_len != 4)
         {STOPERROR("CPCG invalid 4 argument: policy ( wrong size )")}
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCG invalid policy1")}
-    ei_decode_long(buf, index, &max_retries);
+    ei_decode_long(buf, index, &policy.max_retries);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCG invalid policy2")}
-    ei_decode_long(buf, index, &sleep_between_retries);
+    ei_decode_long(buf, index, &policy.sleep_between_retries);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCG invalid policy3")}
-    ei_decode_long(buf, index, &socket_timeout);
+    ei_decode_long(buf, index, &policy.socket_timeout);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCG invalid policy4")}
-    ei_decode_long(buf, index, &total_timeout);
+    ei_decode_long(buf, index, &policy.total_timeout);
 
+    ei_x_free(&res_buf);
+    return do_cdt_get(ns, aspk_set, aspk_key, policy, fd_out);
+}
+
+int do_cdt_get(const char *ns, const char *aspk_set, const char *aspk_key, const policyStruct &policy, int fd_out) {
+    PRE
     CHECK_ALL
 
 	as_error err;
@@ -1740,10 +1950,21 @@ int call_port_cdt_get(const char *buf, int *index, int arity, int fd_out) {
 	as_key_init_str(&key, ns, aspk_set, aspk_key);
     as_policy_read p;
 	as_policy_read_init(&p);
-    p.base.max_retries = max_retries;
-    p.base.sleep_between_retries = sleep_between_retries;
-    p.base.socket_timeout = socket_timeout;
-    p.base.total_timeout = total_timeout;
+    p.base.max_retries = policy.max_retries;
+    p.base.sleep_between_retries = policy.sleep_between_retries;
+    p.base.socket_timeout = policy.socket_timeout;
+    p.base.total_timeout = policy.total_timeout;
+
+    if (async_loop != NULL) {
+        async_command *cmd = async_command_new(fd_out, dump_cdt_records, NULL);
+        as_status status = aerospike_key_get_async(&as, &err, &p, &key, async_record_listener, cmd, async_loop, NULL);
+        as_key_destroy(&key);
+        if (status != AEROSPIKE_OK) {
+            async_command_free(cmd);
+            STOPERROR(err.message)
+        }
+        ASYNC_POST
+    }
 
     if (aerospike_key_get(&as, &err, NULL, &key, &p_rec)  != AEROSPIKE_OK) {
         if (p_rec != NULL) {
@@ -1762,7 +1983,7 @@ int call_port_cdt_get(const char *buf, int *index, int arity, int fd_out) {
     if (p_rec != NULL) {
         as_record_destroy(p_rec);
     }
-    logfile("CPCG end: " +  std::to_string(res));
+    LOG_DEBUG("CPCG end: " +  std::to_string(res));
     POST
 }
 
@@ -1870,50 +2091,62 @@ int call_port_cdt_put(const char *buf, int *index, int arity, int fd_out) {
     if(ei_decode_list_header(buf, index, &bin_list_length) < 0)
         {STOPERROR("invalid list of bins")}
 
-    as_cdt_ctx ctx;
-    as_cdt_ctx_inita(&ctx, 1);
-    as_operations ops;
-    as_operations_inita(&ops, 3);
     cdtPutStruct mycdt; 
     get_bins(buf, index, bin_list_length, mycdt);
         
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
         { 
-            logfile("CPCP6 errr: " + std::to_string(term_type));
+            LOG_ERROR("CPCP6 errr: " + std::to_string(term_type));
             return 6; }
     long record_ttl;
     ei_decode_long(buf, index, &record_ttl);
 
 
     // {max_retries, sleep_between_retries, socket_timeout, total_timeout}
-    long max_retries = 0;
-    long sleep_between_retries = 0;
-    long socket_timeout = 30000;
-    long total_timeout = 1000;
+    policyStruct policy;
     int tuple_len; 
     ei_decode_tuple_header(buf, index, &tuple_len);
     if(tuple_len != 4)
         {STOPERROR("CPCP invalid 5 argument: policy ( wrong size )")}
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCP invalid policy1")}
-    ei_decode_long(buf, index, &max_retries);
+    ei_decode_long(buf, index, &policy.max_retries);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCP invalid policy2")}
-    ei_decode_long(buf, index, &sleep_between_retries);
+    ei_decode_long(buf, index, &policy.sleep_between_retries);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCP invalid policy3")}
-    ei_decode_long(buf, index, &socket_timeout);
+    ei_decode_long(buf, index, &policy.socket_timeout);
     if (ei_get_type(buf, index, &term_type, &term_size) < 0 || !( term_type == ERL_SMALL_INTEGER_EXT || term_type == ERL_INTEGER_EXT ))
     	{STOPERROR("CPCP invalid policy4")}
-    ei_decode_long(buf, index, &total_timeout);
+    ei_decode_long(buf, index, &policy.total_timeout);
+
+    cdtPutView cdt;
+    cdt.bin_name = mycdt.bin_name.c_str();
+    cdt.fcap_key = mycdt.fcap_key.c_str();
+    cdt.fcap_val = mycdt.fcap_val.data();
+    cdt.fcap_val_len = mycdt.fcap_val.length();
+    cdt.fcap_ttl = mycdt.fcap_ttl;
 
+    ei_x_free(&res_buf);
+    return do_cdt_put(ns, aspk_set, aspk_key, cdt, record_ttl, policy, fd_out);
+}
+
+int do_cdt_put(const char *ns, const char *aspk_set, const char *aspk_key, const cdtPutView &cdt,
+               long record_ttl, const policyStruct &policy, int fd_out) {
+    PRE
     CHECK_ALL
 
+    as_cdt_ctx ctx;
+    as_cdt_ctx_inita(&ctx, 1);
+    as_operations ops;
+    as_operations_inita(&ops, 4);
+
 	as_error err;
     as_key key;
 	as_record rec;
 	as_key_init_str(&key, ns, aspk_set, aspk_key);
-	as_record_inita(&rec, bin_list_length);
+	as_record_inita(&rec, 1);
     if(record_ttl != 0){
         rec.ttl = record_ttl;
         ops.ttl = record_ttl;
@@ -1924,29 +2157,28 @@ int call_port_cdt_put(const char *buf, int *index, int arity, int fd_out) {
     as_policy_operate p;
 	as_policy_operate_init(&p);
     p.ttl = record_ttl;
-    p.base.max_retries = max_retries;
-    p.base.sleep_between_retries = sleep_between_retries;
-    p.base.socket_timeout = socket_timeout;
-    p.base.total_timeout = total_timeout;
+    p.base.max_retries = policy.max_retries;
+    p.base.sleep_between_retries = policy.sleep_between_retries;
+    p.base.socket_timeout = policy.socket_timeout;
+    p.base.total_timeout = policy.total_timeout;
         
         as_map_policy put_mode;
         as_map_policy_set(&put_mode, AS_MAP_KEY_ORDERED, AS_MAP_UPDATE);
         as_string key_str;
-        as_string_init(&key_str, (char*)mycdt.fcap_key.c_str(), false);
+        as_string_init(&key_str, (char*)cdt.fcap_key, false);
         as_cdt_ctx_add_map_key_create(&ctx, (as_val*)&key_str, AS_MAP_KEY_ORDERED);
         as_string subkey1;            
         std::string valuesk("value"); 
         as_string_init(&subkey1, (char*)valuesk.c_str(), false);
         as_bytes subval1;
-        as_bytes_inita(&subval1, mycdt.fcap_val.length());
-        as_bytes_set(&subval1, 0, (const uint8_t*)mycdt.fcap_val.c_str(), mycdt.fcap_val.length());
-        as_operations_map_put(&ops, mycdt.bin_name.c_str(), &ctx, &put_mode, (as_val*)&subkey1, (as_val*)&subval1);
+        as_bytes_init_wrap(&subval1, (uint8_t*)cdt.fcap_val, cdt.fcap_val_len, false);
+        as_operations_map_put(&ops, cdt.bin_name, &ctx, &put_mode, (as_val*)&subkey1, (as_val*)&subval1);
         std::string valuesk1("ttl");
         as_string subkey2, subkey3;
         as_integer subval2, subval3;
         as_string_init(&subkey2, (char*)valuesk1.c_str(), false);
-        as_integer_init(&subval2, mycdt.fcap_ttl);
-        as_operations_map_put(&ops, mycdt.bin_name.c_str(), &ctx, &put_mode, (as_val*)&subkey2, (as_val*)&subval2);
+        as_integer_init(&subval2, cdt.fcap_ttl);
+        as_operations_map_put(&ops, cdt.bin_name, &ctx, &put_mode, (as_val*)&subkey2, (as_val*)&subval2);
                 
             //subkey write time
             auto now = std::chrono::system_clock::now().time_since_epoch();
@@ -1954,7 +2186,32 @@ int call_port_cdt_put(const char *buf, int *index, int arity, int fd_out) {
             std::string valuesk2("wt");
             as_string_init(&subkey3, (char*)valuesk2.c_str(), false);
             as_integer_init(&subval3, wt);
-            as_operations_map_put(&ops, mycdt.bin_name.c_str(), &ctx, &put_mode, (as_val*)&subkey3, (as_val*)&subval3);
+            as_operations_map_put(&ops, cdt.bin_name, &ctx, &put_mode, (as_val*)&subkey3, (as_val*)&subval3);
+
+            // expiry index of the subkey, as the NIF fcap calls keep it
+            std::string exp_bin(cdt.bin_name);
+            exp_bin += "_exp";
+            as_string exp_key;
+            as_integer exp_val;
+            if (expiry_index && exp_bin.size() < AS_BIN_NAME_MAX_SIZE) {
+                as_string_init(&exp_key, (char*)cdt.fcap_key, false);
+                as_integer_init(&exp_val, cdt.fcap_ttl > 0 ? wt + cdt.fcap_ttl : INT64_MAX);
+                as_operations_map_put(&ops, exp_bin.c_str(), NULL, &put_mode, (as_val*)&exp_key, (as_val*)&exp_val);
+            }
+
+    if (async_loop != NULL) {
+        // key and ops are copied to the command buffer before the call returns
+        async_command *cmd = async_command_new(fd_out, NULL, "cdt_put");
+        as_status status = aerospike_key_operate_async(&as, &err, &p, &key, &ops, async_record_listener, cmd, async_loop, NULL);
+        as_record_destroy(&rec);
+        as_operations_destroy(&ops);
+        as_key_destroy(&key);
+        if (status != AEROSPIKE_OK) {
+            async_command_free(cmd);
+            STOPERROR(err.message)
+        }
+        ASYNC_POST
+    }
 
     if(aerospike_key_operate(&as, &err, &p, &key, &ops, &rec1) != AEROSPIKE_OK){
         STOPERROR(err.message)
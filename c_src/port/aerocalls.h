@@ -0,0 +1,36 @@
+/* aerocalls.h */
+
+// Commands of aerocalls.c that take decoded arguments, shared by the ETF
+// (function_call) and the compact (compact_call) protocols.
+
+#ifndef ASPIKE_PORT_AEROCALLS_H
+#define ASPIKE_PORT_AEROCALLS_H
+
+#include <stddef.h>
+
+// what do_cdt_put() needs from the bin list, points either to the ETF decode
+// buffers or straight into the command buffer (compact protocol)
+struct cdtPutView {
+  const char *bin_name;   // NUL terminated
+  const char *fcap_key;   // NUL terminated
+  const char *fcap_val;
+  size_t fcap_val_len;
+  long fcap_ttl;
+};
+
+// {max_retries, sleep_between_retries, socket_timeout, total_timeout}
+struct policyStruct {
+  long max_retries = 0;
+  long sleep_between_retries = 0;
+  long socket_timeout = 30000;
+  long total_timeout = 1000;
+};
+
+int fail(const char *msg, int fd);
+
+int do_binary_key_get(const char *ns, const char *set, const char *key, int fd_out);
+int do_cdt_get(const char *ns, const char *aspk_set, const char *aspk_key, const policyStruct &policy, int fd_out);
+int do_cdt_put(const char *ns, const char *aspk_set, const char *aspk_key, const cdtPutView &cdt,
+               long record_ttl, const policyStruct &policy, int fd_out);
+
+#endif
@@ -0,0 +1,173 @@
+/* compact.c */
+
+// Compact binary protocol, an alternative to term_to_binary for hot commands.
+// A frame (after the request id) is
+//
+//     <<Version:8, Opcode:8, Field..., 0:8>>
+//
+// binary fields are <<Len:varint, Bytes:Len/binary>>, integer fields are
+// zigzag varints (LEB128), see as_proto.erl. The trailing 0 lets the last
+// binary be NUL terminated in place, so fields are never copied: the parsed
+// strings point straight into the command buffer.
+// Frames starting with 131 (the ETF version byte) go to function_call().
+
+#include "aerocalls.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#define COMPACT_VERSION 1
+#define COMPACT_MAX_BINS 64
+#define COMPACT_MAX_FCAPS 64
+
+typedef char byte;
+
+enum compact_opcode {
+    OP_BINARY_KEY_GET = 1,
+    OP_CDT_GET = 2,
+    OP_CDT_PUT = 3,
+    OP_NUMBER
+};
+
+typedef struct {
+    byte *p;
+    byte *end;
+} compact_reader;
+
+// a binary field inside the frame, not NUL terminated until c_str()
+typedef struct {
+    byte *p;
+    size_t len;
+} compact_str;
+
+static int read_varint(compact_reader *r, uint64_t *v) {
+    uint64_t res = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        uint8_t b = (uint8_t)*r->p++;
+        res |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = res;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int read_long(compact_reader *r, long *v) {
+    uint64_t u;
+    if (!read_varint(r, &u)) {
+        return 0;
+    }
+    *v = (long)(u >> 1) ^ -(long)(u & 1);
+    return 1;
+}
+
+static int read_str(compact_reader *r, compact_str *s) {
+    uint64_t len;
+    if (!read_varint(r, &len) || len >= (uint64_t)(r->end - r->p)) {
+        // >= : there is at least the trailing 0 after every binary
+        return 0;
+    }
+    s->p = r->p;
+    s->len = len;
+    r->p += len;
+    return 1;
+}
+
+static int read_policy(compact_reader *r, policyStruct *policy) {
+    return read_long(r, &policy->max_retries)
+        && read_long(r, &policy->sleep_between_retries)
+        && read_long(r, &policy->socket_timeout)
+        && read_long(r, &policy->total_timeout);
+}
+
+// overwrites the first byte of the next field, so only after the whole
+// frame is parsed
+static const char *c_str(compact_str *s) {
+    s->p[s->len] = '\0';
+    return s->p;
+}
+
+// <<Ns, Set, Key>>
+static int compact_binary_key_get(compact_reader *r, int fd_out) {
+    compact_str ns, set, key;
+    if (!read_str(r, &ns) || !read_str(r, &set) || !read_str(r, &key)) {
+        return fail("binary_key_get: invalid frame", fd_out);
+    }
+    return do_binary_key_get(c_str(&ns), c_str(&set), c_str(&key), fd_out);
+}
+
+// <<Ns, Set, Key, Policy:4/varint>>
+static int compact_cdt_get(compact_reader *r, int fd_out) {
+    compact_str ns, set, key;
+    policyStruct policy;
+    if (!read_str(r, &ns) || !read_str(r, &set) || !read_str(r, &key) || !read_policy(r, &policy)) {
+        return fail("cdt_get: invalid frame", fd_out);
+    }
+    return do_cdt_get(c_str(&ns), c_str(&set), c_str(&key), policy, fd_out);
+}
+
+// <<Ns, Set, Key, BinsCount, {BinName, FcapsCount, {FcapKey, FcapVal, FcapTtl}...}..., TTL, Policy:4/varint>>
+// the last bin and the last fcap win, as in the ETF cdt_put
+static int compact_cdt_put(compact_reader *r, int fd_out) {
+    compact_str ns, set, key, bin_name, fcap_key, fcap_val;
+    long fcap_ttl = 0;
+    long record_ttl;
+    policyStruct policy;
+    uint64_t bins_count;
+    bool has_fcap = false;
+
+    if (!read_str(r, &ns) || !read_str(r, &set) || !read_str(r, &key) || !read_varint(r, &bins_count)
+            || bins_count == 0 || bins_count > COMPACT_MAX_BINS) {
+        return fail("cdt_put: invalid frame", fd_out);
+    }
+    for (uint64_t i = 0; i < bins_count; i++) {
+        uint64_t fcaps_count;
+        if (!read_str(r, &bin_name) || !read_varint(r, &fcaps_count) || fcaps_count > COMPACT_MAX_FCAPS) {
+            return fail("cdt_put: invalid bin", fd_out);
+        }
+        for (uint64_t j = 0; j < fcaps_count; j++) {
+            if (!read_str(r, &fcap_key) || !read_str(r, &fcap_val) || !read_long(r, &fcap_ttl)) {
+                return fail("cdt_put: invalid fcap", fd_out);
+            }
+            has_fcap = true;
+        }
+    }
+    if (!has_fcap || !read_long(r, &record_ttl) || !read_policy(r, &policy)) {
+        return fail("cdt_put: invalid frame", fd_out);
+    }
+
+    cdtPutView cdt;
+    cdt.bin_name = c_str(&bin_name);
+    cdt.fcap_key = c_str(&fcap_key);
+    cdt.fcap_val = fcap_val.p;
+    cdt.fcap_val_len = fcap_val.len;
+    cdt.fcap_ttl = fcap_ttl;
+    return do_cdt_put(c_str(&ns), c_str(&set), c_str(&key), cdt, record_ttl, policy, fd_out);
+}
+
+typedef int (*compact_handler)(compact_reader *r, int fd_out);
+
+static const compact_handler compact_handlers[OP_NUMBER] = {
+    NULL,
+    compact_binary_key_get,     // OP_BINARY_KEY_GET
+    compact_cdt_get,            // OP_CDT_GET
+    compact_cdt_put             // OP_CDT_PUT
+};
+
+int is_compact_frame(const byte *buf, unsigned int len) {
+    return len > 0 && (uint8_t)buf[0] == COMPACT_VERSION;
+}
+
+int compact_call(byte *buf, unsigned int len, int fd_out) {
+    if (len < 3 || (uint8_t)buf[len - 1] != 0) {
+        return fail("compact: truncated frame", fd_out);
+    }
+    uint8_t opcode = (uint8_t)buf[1];
+    if (opcode >= OP_NUMBER || compact_handlers[opcode] == NULL) {
+        return fail(("compact: unknown opcode " + std::to_string(opcode)).c_str(), fd_out);
+    }
+    compact_reader r = {buf + 2, buf + len};
+    return compact_handlers[opcode](&r, fd_out);
+}
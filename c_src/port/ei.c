@@ -1,45 +1,303 @@
 /* ei.c */
 
 #include "ei.h"
+#include "logger.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ev.h>
+
+#define DEFAULT_THREADS_NUMBER 8
+#define REQ_ID_SIZE 4
 
 typedef char byte;
 
-int read_cmd(byte *buf, int fd);
+int read_cmd(byte **buf, unsigned int *size, int fd);
+uint32_t get_req_id(const byte *buf);
+void set_req_id(uint32_t req_id);
 
 int ifail(int ind, int fd);
 int fail(const char *msg, int fd);
 int note(const char *msg, int fd);
 int is_function_call(const char *buf, int *index, int *arity);
 int function_call(const char *buf, int *index, int arity, int fd_out);
-void logfile(std::string str);
+int is_compact_frame(const byte *buf, unsigned int len);
+int compact_call(byte *buf, unsigned int len, int fd_out);
+int async_init(void *ev_loop);
+int async_pending();
+void set_expiry_index(bool on);
+
+// One command read from fd_in: request id followed by the term_to_binary payload;
+// buf is malloc'ed by read_cmd() and freed by the worker.
+typedef struct {
+    byte *buf;
+    unsigned int len;
+} command;
+
+static std::mutex queue_mutex;
+static std::condition_variable queue_cond;
+static std::deque<command> queue;
+static bool is_stopped = false;
+
+static void process_command(byte *buf, unsigned int len, int fd_out) {
+    int index = 0;
+    int version = 0;
+    int arity = 0;
+
+    set_req_id(get_req_id(buf));
+    buf += REQ_ID_SIZE;
+    len -= REQ_ID_SIZE;
+
+    if (is_compact_frame(buf, len)) {
+        compact_call(buf, len, fd_out);
+        return;
+    }
+
+    if (ei_decode_version(buf, &index, &version) != 0)  {
+        ifail(0, fd_out);
+        exit(1);
+    }
+    if (is_function_call(buf, &index, &arity) != 0) {
+        function_call(buf, &index, arity, fd_out);
+    } else {
+        LOG_ERROR("process_command: not a function call, " + std::to_string(len) + " bytes");
+        note(buf + index, fd_out);
+    }
+}
+
+// Commands are taken in the order they came, but replies go out as soon as
+// each one is done, so a slow command does not hold the others back.
+static void worker(int fd_out) {
+    for (;;) {
+        command cmd;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cond.wait(lock, []{ return is_stopped || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            cmd = queue.front();
+            queue.pop_front();
+        }
+        process_command(cmd.buf, cmd.len, fd_out);
+        free(cmd.buf);
+    }
+}
+
+// Async mode: one thread runs a libev loop that watches fd_in and is also
+// the client event loop. fd_in is read without blocking and a command is
+// decoded only once its frame is complete. The commands that have an async
+// form only send the request on the loop thread, so many of them can be in
+// flight at once; the others (connect, info, batch...) would stall the loop
+// and go to the worker threads, so they are not ordered against the async ones.
 
-int main() {
-    byte buf[1000];
+#define PACKET_HEADER_SIZE 4
+
+static std::vector<byte> async_in;     // bytes read from fd_in, not yet a whole frame
+static ev_io fd_in_watcher;
+static ev_check stop_watcher;
+static std::vector<std::thread> workers;
+
+static unsigned int frame_len(const byte *buf) {
+    const unsigned char *b = (const unsigned char *)buf;
+    return ((unsigned int)b[0] << 24) | ((unsigned int)b[1] << 16) | ((unsigned int)b[2] << 8) | b[3];
+}
+
+// compact frames and the ETF calls of do_binary_key_get(), do_cdt_get() and do_cdt_put()
+static bool is_async_command(const byte *buf, unsigned int len) {
+    buf += REQ_ID_SIZE;
+    len -= REQ_ID_SIZE;
+    if (is_compact_frame(buf, len)) {
+        return true;
+    }
     int index = 0;
     int version = 0;
     int arity = 0;
+    char fname[MAXATOMLEN];
+    if (ei_decode_version(buf, &index, &version) != 0 || ei_decode_tuple_header(buf, &index, &arity) != 0
+        || ei_decode_atom(buf, &index, fname) != 0) {
+        return false;
+    }
+    return strcmp(fname, "binary_key_get") == 0 || strcmp(fname, "cdt_get") == 0
+        || strcmp(fname, "cdt_put") == 0;
+}
+
+static void queue_command(const byte *buf, unsigned int len) {
+    byte *copy = (byte *)malloc(len);
+    if (copy == NULL) {
+        LOG_ERROR("queue_command: can not allocate " + std::to_string(len) + " bytes");
+        return;
+    }
+    memcpy(copy, buf, len);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back({copy, len});
+    }
+    queue_cond.notify_one();
+}
+
+static void stop_reading(struct ev_loop *loop, ev_io *w) {
+    // fd_in is closed: wait for the commands in flight and exit
+    ev_io_stop(loop, w);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        is_stopped = true;
+    }
+    queue_cond.notify_all();
+    if (async_pending() == 0) {
+        ev_break(loop, EVBREAK_ALL);
+    }
+}
+
+static void on_fd_in(struct ev_loop *loop, ev_io *w, int revents) {
+    bool is_closed = false;
+    byte chunk[65536];
+    for (;;) {
+        ssize_t n = read(w->fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            async_in.insert(async_in.end(), chunk, chunk + n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        is_closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+
+    int fd_out = *(int *)w->data;
+    size_t pos = 0;
+    while (async_in.size() - pos >= PACKET_HEADER_SIZE) {
+        unsigned int len = frame_len(async_in.data() + pos);
+        if (async_in.size() - pos - PACKET_HEADER_SIZE < len) {
+            break;
+        }
+        byte *buf = async_in.data() + pos + PACKET_HEADER_SIZE;
+        pos += PACKET_HEADER_SIZE + len;
+        if (len < REQ_ID_SIZE) {
+            continue;
+        }
+        if (is_async_command(buf, len)) {
+            process_command(buf, len, fd_out);
+        } else {
+            queue_command(buf, len);
+        }
+    }
+    async_in.erase(async_in.begin(), async_in.begin() + pos);
+
+    if (is_closed) {
+        stop_reading(loop, w);
+    }
+}
+
+static void on_check(struct ev_loop *loop, ev_check *w, int revents) {
+    if (is_stopped && async_pending() == 0) {
+        ev_break(loop, EVBREAK_ALL);
+    }
+}
+
+static int run_async(int fd_in, int fd_out, int threads_number) {
+    struct ev_loop *loop = ev_default_loop(0);
+    if (!async_init(loop)) {
+        LOG_ERROR("run_async: failed to set the client event loop");
+        return 1;
+    }
+    int flags = fcntl(fd_in, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd_in, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LOG_ERROR("run_async: failed to make fd_in non-blocking, errno " + std::to_string(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < threads_number; i++) {
+        workers.push_back(std::thread(worker, fd_out));
+    }
+
+    ev_io_init(&fd_in_watcher, on_fd_in, fd_in, EV_READ);
+    fd_in_watcher.data = &fd_out;
+    ev_io_start(loop, &fd_in_watcher);
+    ev_check_init(&stop_watcher, on_check);
+    ev_check_start(loop, &stop_watcher);
+
+    ev_run(loop, 0);
+    for (auto& t : workers) {
+        t.join();
+    }
+    return 0;
+}
+
+// aspike_port [--threads N] [--async] [--expiry-index] [--log-level 0..3]
+int main(int argc, char *argv[]) {
+    int threads_number = DEFAULT_THREADS_NUMBER;
+    bool is_async = false;
+    int log_level = LOG_LEVEL_WARN;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads_number = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--async") == 0) {
+            is_async = true;
+        } else if (strcmp(argv[i], "--expiry-index") == 0) {
+            set_expiry_index(true);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level = atoi(argv[++i]);
+        }
+    }
+    if (threads_number < 1) {
+        threads_number = 1;
+    }
 
     ei_init();
+    logger_start(LOG_FILE, log_level);
 
     int fd_in = 3;
     int fd_out = 4;
 
-    while (read_cmd(buf, fd_in) > 0) {
-        index = 0;
-        if (ei_decode_version(buf, &index, &version) != 0)  {
-            ifail(0, fd_out);
-            exit(1);
+    if (is_async) {
+        int res = run_async(fd_in, fd_out, threads_number);
+        logger_stop();
+        return res;
+    }
+
+    for (int i = 0; i < threads_number; i++) {
+        workers.push_back(std::thread(worker, fd_out));
+    }
+
+    for (;;) {
+        // a new buffer of the command size for every command, the worker owns it
+        byte *buf = NULL;
+        unsigned int buf_size = 0;
+        int len = read_cmd(&buf, &buf_size, fd_in);
+        if (len <= 0) {
+            free(buf);
+            break;
         }
-        if (is_function_call(buf, &index, &arity) != 0) {
-            function_call(buf, &index, arity, fd_out);
-            continue;
-        } else {
-            fprintf(stderr, "not is_function_call: %s\n", buf + index);
-            note(buf + index, fd_out);
+        if (len < REQ_ID_SIZE) {
+            free(buf);
             continue;
         }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back({buf, (unsigned int)len});
+        }
+        queue_cond.notify_one();
+    }
+
+    // fd_in is closed: finish what is queued and exit
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        is_stopped = true;
+    }
+    queue_cond.notify_all();
+    for (auto& t : workers) {
+        t.join();
     }
+    logger_stop();
 }
@@ -0,0 +1,168 @@
+/* logger.c */
+
+// Log records go to a bounded lock-free ring (Vyukov MPMC queue, here with
+// one consumer): a producer claims a slot with one CAS and copies the text
+// in, it never blocks and never does a syscall. A background thread drains
+// the ring and writes the records with one write() per batch.
+// When the ring is full the record is dropped and counted; text beyond
+// LOG_RECORD_SIZE is cut off and the record is marked as truncated.
+
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 4096      // power of two
+#define LOG_RECORD_SIZE 240
+#define LOG_FLUSH_INTERVAL_MS 100
+
+typedef struct {
+    std::atomic<uint64_t> seq;
+    int level;
+    uint64_t time_us;
+    unsigned int len;
+    bool truncated;
+    char text[LOG_RECORD_SIZE];
+} log_record;
+
+static log_record ring[LOG_RING_SIZE];
+static std::atomic<uint64_t> enqueue_pos(0);
+static uint64_t dequeue_pos = 0;   // the flush thread only
+
+// nothing is logged before logger_start()
+static std::atomic<int> current_level(-1);
+static std::atomic<uint64_t> dropped(0);
+static std::atomic<bool> is_running(false);
+static std::thread flush_thread;
+static int log_fd = -1;
+
+static const char* const level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void logger_set_level(int level) {
+    current_level.store(level, std::memory_order_relaxed);
+}
+
+int logger_level() {
+    return current_level.load(std::memory_order_relaxed);
+}
+
+void logger_write(int level, const std::string &str) {
+    uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    log_record *r;
+    for (;;) {
+        r = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t seq = r->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    r->level = level;
+    r->time_us = now_us();
+    r->truncated = str.size() > LOG_RECORD_SIZE;
+    r->len = r->truncated ? LOG_RECORD_SIZE : str.size();
+    memcpy(r->text, str.data(), r->len);
+    r->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void format_record(std::string &out, const log_record *r) {
+    char head[64];
+    time_t sec = r->time_us / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    int n = strftime(head, sizeof(head), "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(head + n, sizeof(head) - n, ".%06u %s ",
+        (unsigned int)(r->time_us % 1000000), level_names[r->level & 3]);
+    out.append(head, n);
+    out.append(r->text, r->len);
+    if (r->truncated) {
+        out += "... [truncated]";
+    }
+    out.push_back('\n');
+}
+
+static void write_all(const std::string &out) {
+    size_t done = 0;
+    while (log_fd >= 0 && done < out.size()) {
+        ssize_t n = write(log_fd, out.data() + done, out.size() - done);
+        if (n <= 0) {
+            return;
+        }
+        done += n;
+    }
+}
+
+// takes everything that is in the ring now, returns the number of records
+static int flush() {
+    std::string out;
+    int count = 0;
+    for (;;) {
+        log_record *r = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (r->seq.load(std::memory_order_acquire) != dequeue_pos + 1) {
+            break;
+        }
+        format_record(out, r);
+        r->seq.store(dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+        out += "logger: " + std::to_string(lost) + " records dropped\n";
+    }
+    write_all(out);
+    return count;
+}
+
+static void flush_loop() {
+    while (is_running.load(std::memory_order_acquire)) {
+        if (flush() < LOG_RING_SIZE / 2) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+    flush();
+}
+
+void logger_start(const char *path, int level) {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    logger_set_level(level);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    is_running.store(true, std::memory_order_release);
+    flush_thread = std::thread(flush_loop);
+}
+
+// flushes what is left, records written after it are lost
+void logger_stop() {
+    if (!is_running.exchange(false)) {
+        return;
+    }
+    flush_thread.join();
+    if (log_fd >= 0) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
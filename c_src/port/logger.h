@@ -0,0 +1,56 @@
+/* logger.h */
+
+#ifndef ASPIKE_PORT_LOGGER_H
+#define ASPIKE_PORT_LOGGER_H
+
+#include <string>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Records above the compile-time level are compiled out, their arguments
+// are not even evaluated. Build with -DLOG_COMPILE_LEVEL=3 to get tracing.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_FILE "/tmp/aspikeport"
+
+// Records written before logger_start() are dropped silently (the level is -1
+// until then), records written after logger_stop() are never flushed.
+void logger_start(const char *path, int level);
+void logger_stop();
+void logger_set_level(int level);
+int logger_level();
+void logger_write(int level, const std::string &str);
+
+#define LOG_AT(LEVEL, MSG) \
+    do {\
+        if ((LEVEL) <= logger_level()) {\
+            logger_write((LEVEL), (MSG));\
+        }\
+    } while (0)
+
+#define LOG_ERROR(MSG) LOG_AT(LOG_LEVEL_ERROR, MSG)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(MSG) LOG_AT(LOG_LEVEL_WARN, MSG)
+#else
+#define LOG_WARN(MSG) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(MSG) LOG_AT(LOG_LEVEL_INFO, MSG)
+#else
+#define LOG_INFO(MSG) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(MSG) LOG_AT(LOG_LEVEL_DEBUG, MSG)
+#else
+#define LOG_DEBUG(MSG) do {} while (0)
+#endif
+
+#endif
@@ -1,18 +1,55 @@
 /* rw_command.c */
 
+#include "logger.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include <string>
+#include <mutex>
 
-#define bytes_to_u16(MSB,LSB) (((unsigned int) ((unsigned char) MSB)) & 255)<<8 | (((unsigned char) LSB)&255)
+// {packet, 4}: every message is prefixed with its length, 4 bytes big-endian
+#define PACKET_HEADER_SIZE 4
+#define bytes_to_u32(B) \
+  ((((unsigned int) ((unsigned char) (B)[0])) << 24) | (((unsigned int) ((unsigned char) (B)[1])) << 16) |\
+   (((unsigned int) ((unsigned char) (B)[2])) << 8) | ((unsigned int) ((unsigned char) (B)[3])))
+#define u32_to_bytes(V, B) \
+  (B)[0] = ((V) >> 24) & 0xff; (B)[1] = ((V) >> 16) & 0xff; (B)[2] = ((V) >> 8) & 0xff; (B)[3] = (V) & 0xff;
+
+// every command starts with the request id (4 bytes big-endian), the reply carries it back
+#define REQ_ID_SIZE 4
 
 typedef char byte;
 
 int read_exact(byte *buf, unsigned int len, int fd);
 int write_exact(byte *buf, int len, int fd);
-int read_cmd(byte *buf, int fd);
+int read_cmd(byte **buf, unsigned int *size, int fd);
+uint32_t get_req_id(const byte *buf);
+void set_req_id(uint32_t req_id);
+uint32_t get_current_req_id();
 int write_cmd(byte *buf, int len, int fd);
-void logfile(std::string str);
+
+// replies of the worker threads must not interleave on fd_out
+static std::mutex write_mutex;
+// request the current thread works on, write_cmd() puts it in front of the reply
+static thread_local uint32_t current_req_id = 0;
+
+uint32_t get_req_id(const byte *buf)
+{
+  return bytes_to_u32(buf);
+}
+
+void set_req_id(uint32_t req_id)
+{
+  current_req_id = req_id;
+}
+
+uint32_t get_current_req_id()
+{
+  return current_req_id;
+}
 
 int read_exact(byte *buf, unsigned int len, int fd)
 {
@@ -42,27 +79,64 @@ int write_exact(byte *buf, int len, int fd)
   return (len);
 }
 
-int read_cmd(byte *buf, int fd)
+// Reads one command into *buf, the buffer is reused between calls and grows
+// (realloc) when a command does not fit into *size bytes.
+int read_cmd(byte **buf, unsigned int *size, int fd)
 {
+  byte header[PACKET_HEADER_SIZE];
   unsigned int len;
 
-  if (read_exact(buf, 2, fd) != 2)
+  if (read_exact(header, PACKET_HEADER_SIZE, fd) != PACKET_HEADER_SIZE)
     return(-1);
 
-  len = bytes_to_u16(buf[0],buf[1]);
-  //len = (buf[0] << 8) | buf[1];
-  return read_exact(buf, len, fd);
+  len = bytes_to_u32(header);
+  if (len > *size) {
+    byte *new_buf = (byte *)realloc(*buf, len);
+    if (new_buf == NULL) {
+      LOG_ERROR("read_cmd: can not allocate " + std::to_string(len) + " bytes");
+      return(-1);
+    }
+    *buf = new_buf;
+    *size = len;
+  }
+  return read_exact(*buf, len, fd);
 }
 
+// Writes the length header, the request id and the reply with one writev()
 int write_cmd(byte *buf, int len, int fd)
 {
-  byte li;
-
-  li = (len >> 8) & 0xff;
-  write_exact(&li, 1, fd);
-  
-  li = len & 0xff;
-  write_exact(&li, 1, fd);
+  byte header[PACKET_HEADER_SIZE + REQ_ID_SIZE];
+  struct iovec iov[2];
+  int iovcnt = 2;
+  ssize_t i;
+
+  u32_to_bytes(len + REQ_ID_SIZE, header)
+  u32_to_bytes(current_req_id, header + PACKET_HEADER_SIZE)
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = PACKET_HEADER_SIZE + REQ_ID_SIZE;
+  iov[1].iov_base = buf;
+  iov[1].iov_len = len;
+
+  std::lock_guard<std::mutex> lock(write_mutex);
+  struct iovec *p_iov = iov;
+  while (iovcnt > 0) {
+    if ((i = writev(fd, p_iov, iovcnt)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return (i);
+    }
+    // partial write, skip what is already written
+    while (iovcnt > 0 && (size_t)i >= p_iov->iov_len) {
+      i -= p_iov->iov_len;
+      p_iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      p_iov->iov_base = (byte *)p_iov->iov_base + i;
+      p_iov->iov_len -= i;
+    }
+  }
 
-  return write_exact(buf, len, fd);
+  return (len);
 }
@@ -0,0 +1,59 @@
+-module(as_proto).
+
+% Compact binary framing of the hot port commands, see c_src/port/compact.c:
+%   <<Version:8, Opcode:8, Field..., 0:8>>
+% binaries are <<Len:varint, Bytes/binary>>, integers are zigzag varints.
+% Everything else (and everything with {port_protocol, etf}) goes as term_to_binary.
+
+-export([
+    encode/1
+]).
+
+-define(VERSION, 1).
+-define(OP_BINARY_KEY_GET, 1).
+-define(OP_CDT_GET, 2).
+-define(OP_CDT_PUT, 3).
+
+-include("../include/defines.hrl").
+
+-spec encode(tuple()) -> iodata().
+encode(Msg) ->
+    case ?DEFAULT_PORT_PROTOCOL of
+        compact -> compact(Msg);
+        etf -> term_to_binary(Msg)
+    end.
+
+-spec compact(tuple()) -> iodata().
+compact({binary_key_get, Namespace, Set, Key}) ->
+    frame(?OP_BINARY_KEY_GET, [str(Namespace), str(Set), str(Key)]);
+compact({cdt_get, Namespace, Set, Key, Policy}) ->
+    frame(?OP_CDT_GET, [str(Namespace), str(Set), str(Key), policy(Policy)]);
+compact({cdt_put, Namespace, Set, Key, BinList, TTL, Policy}) when BinList =/= [] ->
+    frame(?OP_CDT_PUT, [str(Namespace), str(Set), str(Key),
+        varint(length(BinList)), [bin(B) || B <- BinList], int(TTL), policy(Policy)]);
+compact(Msg) ->
+    term_to_binary(Msg).
+
+frame(Opcode, Fields) ->
+    [<<?VERSION:8, Opcode:8>>, Fields, <<0:8>>].
+
+% {BinName, [FcapKey, FcapVal, FcapTtl, ...]}
+bin({BinName, Fcaps}) ->
+    [str(BinName), varint(length(Fcaps) div 3), fcaps(Fcaps)].
+
+fcaps([FcapKey, FcapVal, FcapTtl | Rest]) ->
+    [str(FcapKey), str(FcapVal), int(FcapTtl) | fcaps(Rest)];
+fcaps(_) ->
+    [].
+
+policy({MaxRetries, SleepBetweenRetries, SocketTimeout, TotalTimeout}) ->
+    [int(MaxRetries), int(SleepBetweenRetries), int(SocketTimeout), int(TotalTimeout)].
+
+str(S) ->
+    [varint(iolist_size(S)), S].
+
+int(N) when N >= 0 -> varint(N bsl 1);
+int(N) -> varint(((-N) bsl 1) - 1).
+
+varint(N) when N < 16#80 -> <<N:8>>;
+varint(N) -> [<<(N band 16#7F bor 16#80):8>> | varint(N bsr 7)].
@@ -46,7 +46,7 @@
     node_info/2,
     help/0,
     help/1,
-    nif_help/1,
+    nif_help/2,
     b/0,
     % --------------------------------------
     a_key_put/0,
@@ -55,48 +55,169 @@
     foo/1,
     bar/1,
     binary_put/5,
+    binary_put_many/3,
     binary_remove/5,
     binary_get/3,
     cdt_get/4,
     cdt_get/3,
+    cdt_get_live/4,
+    cdt_get_live/5,
+    cdt_get_subkeys/5,
+    cdt_get_subkeys/6,
     cdt_expire/4,
+    cdt_check_and_put/6,
+    cdt_check_and_put/7,
     cdt_delete_by_keys/5,
     cdt_delete_by_keys_batch/4,
     cdt_put/5,
-    cdt_put/6
+    cdt_put/6,
+    cdt_put_many/3,
+    cdt_put_many/4,
+    binary_get_many/3,
+    cdt_get_many/3,
+    cdt_get_many/4,
+    binary_get_async/3,
+    binary_put_async/5,
+    cdt_get_async/3,
+    cdt_get_async/4,
+    cdt_put_async/5,
+    cdt_put_async/6,
+    await/2,
+    % cluster handle versions, with all the arguments (see as_init/1)
+    as_init/1,
+    host_clear/1,
+    connect/3,
+    key_exists/4,
+    key_exists/5,
+    key_inc/5,
+    key_inc/6,
+    key_get/4,
+    key_get/5,
+    key_generation/4,
+    key_generation/5,
+    key_put/5,
+    key_put/6,
+    key_remove/4,
+    key_remove/5,
+    key_select/5,
+    key_select/6,
+    a_key_put/7,
+    binary_put/6,
+    binary_put_many/4,
+    binary_put_many/5,
+    binary_remove/6,
+    binary_remove/7,
+    binary_get/4,
+    binary_get/5,
+    cdt_get/5,
+    cdt_get_live/6,
+    cdt_get_subkeys/7,
+    cdt_expire/5,
+    cdt_expire/6,
+    cdt_check_and_put/8,
+    cdt_delete_by_keys/6,
+    cdt_delete_by_keys/7,
+    cdt_delete_by_keys_batch/5,
+    cdt_delete_by_keys_batch/6,
+    cdt_put/7,
+    cdt_put_many/5,
+    binary_get_many/4,
+    binary_get_many/5,
+    cdt_get_many/5,
+    binary_get_async/4,
+    binary_get_async/5,
+    binary_put_async/6,
+    cdt_get_async/5,
+    cdt_put_async/7,
+    host_add/3,
+    host_list/1,
+    node_random/1,
+    node_names/1,
+    node_get/2,
+    node_info/3,
+    help/2,
+    host_info/4,
+    cluster/0,
+    policy_new/2,
+    binary_put/7,
+    binary_put_async/7,
+    stats_snapshot/0,
+    stats_reset/0,
+    cache_config/1,
+    cache_stats/0,
+    cache_clear/0,
+    negcache_config/1,
+    negcache_stats/0,
+    flight_enable/1,
+    flight_stats/0,
+    coalesce_config/1,
+    coalesce_stats/0,
+    key_inc_aggregate/1,
+    key_inc_flush/0,
+    key_inc_pending/0,
+    cdt_compact/1,
+    cdt_expiry_index/1
 ]).
 
 -nifs([
-    as_init/0,
-    nif_host_add/2,
-    host_clear/0,
-    nif_host_list/0,
-    connect/2,
-    key_exists/3,
-    key_inc/4,
-    key_get/3,
-    key_generation/3,
-    key_put/4,
-    key_remove/3,
-    key_select/4,
-    nif_node_random/0,
-    nif_node_names/0,
-    nif_node_get/1,
-    nif_node_info/2,
-    nif_help/1,
-    nif_host_info/3,
+    as_init/1,
+    policy_new/2,
+    stats_snapshot/0,
+    stats_reset/0,
+    cache_config/1,
+    cache_stats/0,
+    cache_clear/0,
+    negcache_config/1,
+    negcache_stats/0,
+    flight_enable/1,
+    flight_stats/0,
+    coalesce_config/1,
+    coalesce_stats/0,
+    key_inc_aggregate/1,
+    key_inc_flush/0,
+    key_inc_pending/0,
+    cdt_compact/1,
+    cdt_expiry_index/1,
+    nif_host_add/3,
+    host_clear/1,
+    nif_host_list/1,
+    connect/3,
+    key_exists/5,
+    key_inc/6,
+    key_get/5,
+    key_generation/5,
+    key_put/6,
+    key_remove/5,
+    key_select/6,
+    nif_node_random/1,
+    nif_node_names/1,
+    nif_node_get/2,
+    nif_node_info/3,
+    nif_help/2,
+    nif_host_info/4,
     % --------------------------------------
-    a_key_put/6,
+    a_key_put/7,
     foo/1,
     bar/1,
-    binary_put/5,
-    binary_remove/5,
-    binary_get/3,
-    cdt_get/4,
-    cdt_expire/4,
-    cdt_delete_by_keys/5,
-    cdt_delete_by_keys_batch/4,
-    cdt_put/6
+    binary_put/7,
+    binary_put_many/5,
+    binary_remove/7,
+    binary_get/5,
+    cdt_get/5,
+    cdt_get_live/6,
+    cdt_get_subkeys/7,
+    cdt_expire/6,
+    cdt_check_and_put/8,
+    cdt_delete_by_keys/7,
+    cdt_delete_by_keys_batch/6,
+    nif_cdt_put/7,
+    cdt_put_many/5,
+    binary_get_many/5,
+    cdt_get_many/5,
+    binary_get_async/5,
+    binary_put_async/7,
+    cdt_get_async/5,
+    cdt_put_async/7
 ]).
 
 % -------------------------------------------------------------------------------
@@ -105,6 +226,15 @@
 
 -define(LIBNAME, ?MODULE).
 
+-type cluster() :: reference().
+% {MaxRetries, SleepBetweenRetries, SocketTimeout, TotalTimeout}, a policy made by policy_new/2
+% or default for the cluster's default policy of that kind
+-type policy() :: {integer(), integer(), integer(), integer()} | reference() | default.
+-export_type([cluster/0, policy/0]).
+
+-define(DEFAULT_POLICY, {0, 0, 30000, 1000}).
+-define(CLUSTER_POLICY, default).
+
 % -------------------------------------------------------------------------------
 
 init() ->
@@ -113,7 +243,164 @@ init() ->
 not_loaded(Line) ->
     erlang:nif_error({not_loaded, [{module, ?MODULE}, {line, Line}]}).
 
+% @doc Creates the default cluster handle used by the functions without Cluster argument
+-spec as_init() -> {ok, string()} | {error, string()}.
 as_init() ->
+    case persistent_term:get({?MODULE, cluster}, undefined) of
+        undefined ->
+            case as_init(#{}) of
+                {ok, Cluster} ->
+                    persistent_term:put({?MODULE, cluster}, Cluster),
+                    {ok, "initialised"};
+                Error ->
+                    Error
+            end;
+        _ ->
+            {ok, "initialised"}
+    end.
+
+% @doc Creates a new cluster handle with its own config and connection pools, e.g.
+% #{max_conns_per_node => 300, async_max_conns_per_node => 300, conn_pools_per_node => 1,
+%   min_conns_per_node => 0, async_min_conns_per_node => 0, conn_timeout_ms => 1000,
+%   login_timeout_ms => 5000, max_socket_idle => 55, tender_interval => 1000, thread_pool_size => 16}
+%
+% Every call that goes to the cluster has a version with the Cluster as the first argument
+% that takes all the other arguments too, Policy included where there is one, e.g.
+% cdt_get_many/5 for cdt_get_many/3,4. The versions without it use the default cluster
+% created by as_init/0; the shortcuts with a default key, namespace, set or policy have no
+% Cluster version. Module-wide settings and stats (stats_*, cache_*, negcache_*, flight_*,
+% coalesce_*, key_inc_*, cdt_compact/1, cdt_expiry_index/1) as well as policy_new/2 and await/2 take no Cluster.
+-spec as_init(map()) -> {ok, cluster()} | {error, string()}.
+as_init(_Config) ->
+    not_loaded(?LINE).
+
+% @doc Returns the default cluster handle
+-spec cluster() -> cluster() | undefined.
+cluster() ->
+    persistent_term:get({?MODULE, cluster}, undefined).
+
+% @doc Creates a policy once, to be passed instead of the policy tuple to any call of that kind:
+% read - cdt_get, cdt_get_subkeys, binary_get, key_get, key_select, key_exists, key_generation, *_get_async;
+% write - binary_put, binary_remove, key_put, binary_put_async;
+% operate - cdt_put, cdt_check_and_put, cdt_get_live, cdt_expire, cdt_delete_by_keys, key_inc, cdt_put_async;
+% batch - *_get_many, *_put_many, cdt_delete_by_keys_batch; remove - key_remove. Options, e.g.
+% #{max_retries => 0, sleep_between_retries => 0, socket_timeout => 30000, total_timeout => 1000,
+%   compress => false, replica => master | any | sequence | prefer_rack,
+%   read_mode_ap => one | all (read, operate, batch), commit_level => all | master (write, operate, remove),
+%   durable_delete => false (write, operate, remove)}
+-spec policy_new(read | write | operate | batch | remove, map()) -> {ok, reference()}.
+policy_new(_Type, _Options) ->
+    not_loaded(?LINE).
+
+% @doc Latency histograms of binary_*/cdt_* calls (sync, *_many and *_async) since the load
+% or the last stats_reset/0, split into argument decode, client call and term encode phases;
+% values are in nanoseconds, e.g.
+% #{binary_get => #{decode => #{count => 10, mean => 812, min => 703, max => 1407,
+%                               p50 => 767, p90 => 959, p99 => 1407, p999 => 1407},
+%                   call => #{...}, encode => #{...}}}
+-spec stats_snapshot() -> #{atom() => #{decode | call | encode => #{atom() => non_neg_integer()}}}.
+stats_snapshot() ->
+    not_loaded(?LINE).
+
+-spec stats_reset() -> ok.
+stats_reset() ->
+    not_loaded(?LINE).
+
+% @doc Read-through cache of cdt_get/5 and cdt_get_async/5 results, off by default.
+% An entry lives until the smallest wt + ttl of its fcaps or max_age (milliseconds),
+% any write of the key through this module drops it.
+% #{max_entries => 0} turns the cache off again.
+-spec cache_config(#{max_entries => non_neg_integer(), max_age => non_neg_integer()}) -> ok.
+cache_config(_Options) ->
+    not_loaded(?LINE).
+
+-spec cache_stats() -> #{hits | misses | evictions | expirations | invalidations | entries => non_neg_integer()}.
+cache_stats() ->
+    not_loaded(?LINE).
+
+-spec cache_clear() -> ok.
+cache_clear() ->
+    not_loaded(?LINE).
+
+% @doc Negative cache of binary_get/4, cdt_get/5 and their _async variants, off by default.
+% A key that came back AEROSPIKE_ERR_RECORD_NOT_FOUND is answered the same way without
+% a round trip for window milliseconds, or until it is written through this module.
+% It is a Bloom filter: within the window an existing record may rarely be reported missing.
+% #{window => 0} turns it off again.
+-spec negcache_config(#{window => non_neg_integer()}) -> ok.
+negcache_config(_Options) ->
+    not_loaded(?LINE).
+
+-spec negcache_stats() -> #{hits | inserts | clears => non_neg_integer()}.
+negcache_stats() ->
+    not_loaded(?LINE).
+
+% @doc Single-flight reads, off by default: concurrent binary_get/4 (or cdt_get/5) calls
+% for the same key, sync or _async, share one server request and all get its result.
+% A read started after a write of the key through this module never joins a request sent before it.
+% A joined read is answered by the leader's request, made with the leader's policy
+% (timeouts, retries, read mode), not its own.
+-spec flight_enable(boolean()) -> ok.
+flight_enable(_Enable) ->
+    not_loaded(?LINE).
+
+% @doc leaders: reads that went to the server, joiners: reads that shared their result.
+-spec flight_stats() -> #{leaders | joiners => non_neg_integer()}.
+flight_stats() ->
+    not_loaded(?LINE).
+
+% @doc Write coalescing of cdt_put/6,7 and cdt_put_async/6,7, off by default. Puts to the same
+% key with the same TTL within window milliseconds (or until max_subkeys fcaps, default 64) are
+% merged into one operate with all their map_put operations, written with the policy of the
+% first one. A flush thread sends the batches, so no scheduler waits for the window: cdt_put
+% waits in receive for {aspike, Ref, Result}, at most the window plus the total timeout of its
+% policy, then returns {error, timeout}; cdt_put_async returns {ok, Ref} at once.
+% #{window => 0} turns it off again, the open batches are written first.
+-spec coalesce_config(#{window => non_neg_integer(), max_subkeys => pos_integer()}) -> ok.
+coalesce_config(_Options) ->
+    not_loaded(?LINE).
+
+% @doc batches: operates sent, puts: cdt_put calls they carried.
+-spec coalesce_stats() -> #{batches | puts => non_neg_integer()}.
+coalesce_stats() ->
+    not_loaded(?LINE).
+
+% @doc Aggregated key_inc/4,5, off by default. With an interval key_inc only adds its deltas
+% to native counters and returns {ok, "key_inc"}; a background thread writes them every
+% interval milliseconds with one batch per cluster. Deltas of a failed batch are kept for
+% the next flush. #{interval => 0} stops the thread and flushes what is left (use it on shutdown).
+-spec key_inc_aggregate(#{interval => non_neg_integer()}) -> ok | {error, string()}.
+key_inc_aggregate(_Options) ->
+    not_loaded(?LINE).
+
+% @doc Writes the aggregated deltas now.
+-spec key_inc_flush() -> ok | {error, string()}.
+key_inc_flush() ->
+    not_loaded(?LINE).
+
+% @doc Deltas not written yet.
+-spec key_inc_pending() -> [{Namespace :: string(), Set :: string(), Key :: string(), Bin :: string(), Delta :: integer()}].
+key_inc_pending() ->
+    not_loaded(?LINE).
+
+% @doc Compact fcap entries, off by default. cdt_put and cdt_check_and_put write every subkey
+% as a [Value, TTL, WT] list instead of a #{value, ttl, wt} map; the reads decode both layouts,
+% so existing records keep working and are rewritten entry by entry; aspike_srv reads both too.
+% cdt_expire/4 only works on records without compact entries: its map operation on the
+% entries fails with a type error on a [Value, TTL, WT] list, use cdt_check_and_put/7 there.
+-spec cdt_compact(boolean()) -> ok.
+cdt_compact(_Enable) ->
+    not_loaded(?LINE).
+
+% @doc Expiry index kept by every writer, off by default. The index Bin ++ "_exp" of an fcap bin
+% maps each subkey to WT + SubTTL; cdt_check_and_put/7 and cdt_get_live/5 use it and index the
+% subkeys they find missing themselves. With this on, cdt_put, cdt_put_many and cdt_put_async
+% write it as well (one more operation per subkey), and binary_put*/binary_remove/5 delete the
+% index of the bins they overwrite. Turn it on on every node before a bin is used with
+% cdt_check_and_put/7 while cdt_put also writes it: with it off, a subkey put again keeps its
+% old expiry time in the index.
+-spec cdt_expiry_index(boolean()) -> ok.
+cdt_expiry_index(_Enable) ->
     not_loaded(?LINE).
 
 -spec host_add() -> {ok, string()} | {error, string()}.
@@ -128,15 +415,19 @@ host_add() ->
 % host list and populate the cluster map.
 % The multiple Hosts passed here are used only in case of network failure on the first one.
 -spec host_add(string() | inet:ip_address(), non_neg_integer()) -> {ok, string()} | {error, string()}.
-host_add(Host, Port) when is_list(Host), is_integer(Port) ->
-    nif_host_add(Host, Port);
 host_add(Host, Port) ->
+    host_add(cluster(), Host, Port).
+
+-spec host_add(cluster(), string() | inet:ip_address(), non_neg_integer()) -> {ok, string()} | {error, string()}.
+host_add(Cluster, Host, Port) when is_list(Host), is_integer(Port) ->
+    nif_host_add(Cluster, Host, Port);
+host_add(Cluster, Host, Port) ->
     case inet:is_ip_address(Host) of 
-        true -> host_add(inet:ntoa(Host), Port);
+        true -> host_add(Cluster, inet:ntoa(Host), Port);
         false -> {error, "wrong address"}
         end.
 
-nif_host_add(_, _) ->
+nif_host_add(_Cluster, _, _) ->
     not_loaded(?LINE).
 
 % @doc Adds list of [{HostName, Port}]
@@ -147,6 +438,9 @@ host_add(HLst) ->
 % @doc Clears host list
 -spec host_clear() -> {ok, string()}.
 host_clear() ->
+    host_clear(cluster()).
+
+host_clear(_Cluster) ->
     not_loaded(?LINE).
 
 % @doc Returns list of [{Hostname, TLSname, Port}]
@@ -154,9 +448,12 @@ host_clear() ->
 % If there is no TLS then TLSname =[],, i.e. empty string.
 -spec host_list() -> {ok, [{inet:ip_address(), string(), non_neg_integer()}]} | {error, term}.
 host_list() ->
-    as_render:hosts_render(nif_host_list()).
+    host_list(cluster()).
 
-nif_host_list() ->
+host_list(Cluster) ->
+    as_render:hosts_render(nif_host_list(Cluster)).
+
+nif_host_list(_Cluster) ->
     not_loaded(?LINE).
 
 connect() ->
@@ -164,7 +461,10 @@ connect() ->
 
 % @doc Create connection using User and PWd credential
 -spec connect(string(), string()) -> {ok, string()} | {error, string()}.
-connect(_, _) ->
+connect(User, Psw) ->
+    connect(cluster(), User, Psw).
+
+connect(_Cluster, _User, _Psw) ->
     not_loaded(?LINE).
 
 key_exists() ->
@@ -176,6 +476,12 @@ key_exists(Key) ->
 % @doc Checks if Key exists in Namesplace Set
 -spec key_exists(string(), string(), string()) -> {ok, string()} | {error, string()}.
 key_exists(Namespace, Set, Key) when is_list(Namespace), is_list(Set), is_list(Key) ->
+    key_exists(cluster(), Namespace, Set, Key).
+
+key_exists(Cluster, Namespace, Set, Key) ->
+    key_exists(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+key_exists(_Cluster, _Namespace, _Set, _Key, _Policy) ->
     not_loaded(?LINE).
 
 key_inc() ->
@@ -193,6 +499,12 @@ key_inc(Key, Lst) ->
 key_inc(Namespace, Set, Key, Lst) when
     is_list(Namespace), is_list(Set), is_list(Key), is_list(Lst)
 ->
+    key_inc(cluster(), Namespace, Set, Key, Lst).
+
+key_inc(Cluster, Namespace, Set, Key, Lst) ->
+    key_inc(Cluster, Namespace, Set, Key, Lst, ?CLUSTER_POLICY).
+
+key_inc(_Cluster, _Namespace, _Set, _Key, _Lst, _Policy) ->
     not_loaded(?LINE).
 
 key_put() ->
@@ -210,26 +522,90 @@ key_put(Key, Lst) ->
 key_put(Namespace, Set, Key, Lst) when
     is_list(Namespace), is_list(Set), is_list(Key), is_list(Lst)
 ->
+    key_put(cluster(), Namespace, Set, Key, Lst).
+
+key_put(Cluster, Namespace, Set, Key, Lst) ->
+    key_put(Cluster, Namespace, Set, Key, Lst, ?CLUSTER_POLICY).
+
+key_put(_Cluster, _Namespace, _Set, _Key, _Lst, _Policy) ->
     not_loaded(?LINE).
 
 -spec binary_put(binary(), binary(), binary(), [{binary(), binary()|integer()|[integer()]}], integer()) -> 
     {ok, string()} | {error, string()}.
-binary_put(_Namespace, _Set, _Key, _BinList, _TTL) ->
+binary_put(Namespace, Set, Key, BinList, TTL) ->
+    binary_put(cluster(), Namespace, Set, Key, BinList, TTL).
+
+binary_put(Cluster, Namespace, Set, Key, BinList, TTL) ->
+    binary_put(Cluster, Namespace, Set, Key, BinList, TTL, ?CLUSTER_POLICY).
+
+-spec binary_put(cluster(), binary(), binary(), binary(), [{binary(), binary()|integer()|[integer()]}], integer(),
+        policy()) -> {ok, string()} | {error, string()}.
+binary_put(_Cluster, _Namespace, _Set, _Key, _BinList, _TTL, _Policy) ->
+    not_loaded(?LINE).
+
+% Writes every {Key, BinList, TTL} in Namespace Set with one batch request;
+% returns aerospike status codes (0 - ok) in the order of Records.
+-spec binary_put_many(binary(), binary(),
+        [{binary(), [{binary(), binary()|integer()|[integer()]}], integer()}]) ->
+            {ok, [integer()]} | {error, string()}.
+binary_put_many(Namespace, Set, Records) when is_binary(Namespace), is_binary(Set), is_list(Records) ->
+    binary_put_many(cluster(), Namespace, Set, Records).
+
+binary_put_many(Cluster, Namespace, Set, Records) ->
+    binary_put_many(Cluster, Namespace, Set, Records, ?CLUSTER_POLICY).
+
+binary_put_many(_Cluster, _Namespace, _Set, _Records, _Policy) ->
     not_loaded(?LINE).
 
 % {MaxRetries, SleepBetweenRetries, SocketTimeout, TotalTimeout}  timeouts in milliseconds
 cdt_put(Namespace, Set, Key, BinList, TTL) ->
-    cdt_put(Namespace, Set, Key, BinList, TTL, {0, 0, 30000, 1000}).
+    cdt_put(Namespace, Set, Key, BinList, TTL, ?DEFAULT_POLICY).
+% BinList: [{Bin, [SubKey, Value, SubTTL]}] or, for several subkeys of a bin in one write,
+% [{Bin, [[SubKey, Value, SubTTL], ...]}]. With cdt_expiry_index/1 on, the expiry time
+% WT + SubTTL of every subkey is also written to the index map bin Bin ++ "_exp" (unless that
+% name is too long for a bin), which cdt_check_and_put/7 and cdt_get_live/5 read;
+% cdt_delete_by_keys removes from it in any case. The reads leave index bins out.
 -spec cdt_put(binary(), binary(), binary(), 
-        [{binary(), binary()|integer()|[integer()]}], integer(), 
-        {integer(), integer(), integer(), integer()}) -> 
+        [{binary(), [binary()|integer()] | [[binary()|integer()]]}], integer(), 
+        policy()) -> 
             {ok, string()} | {error, string()}.
-cdt_put(_Namespace, _Set, _Key, _BinList, _TTL, _Policy) ->
+cdt_put(Namespace, Set, Key, BinList, TTL, Policy) ->
+    cdt_put(cluster(), Namespace, Set, Key, BinList, TTL, Policy).
+
+cdt_put(Cluster, Namespace, Set, Key, BinList, TTL, Policy) ->
+    case nif_cdt_put(Cluster, Namespace, Set, Key, BinList, TTL, Policy) of
+        {coalesced, Ref, Timeout} -> await({ok, Ref}, Timeout);
+        Result -> Result
+    end.
+
+% {coalesced, Ref, Timeout} when the put joined a batch of coalesce_config/1: the window
+% plus the total timeout of Policy in milliseconds
+nif_cdt_put(_Cluster, _Namespace, _Set, _Key, _BinList, _TTL, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_put_many(Namespace, Set, Records) ->
+    cdt_put_many(Namespace, Set, Records, ?DEFAULT_POLICY).
+% Batch version of cdt_put/6: every {Key, BinList, TTL} of Records is written with one
+% batch request; returns aerospike status codes (0 - ok) in the order of Records.
+-spec cdt_put_many(binary(), binary(),
+        [{binary(), [{binary(), [binary()|integer()]}], integer()}],
+        policy()) ->
+            {ok, [integer()]} | {error, string()}.
+cdt_put_many(Namespace, Set, Records, Policy) when is_binary(Namespace), is_binary(Set), is_list(Records) ->
+    cdt_put_many(cluster(), Namespace, Set, Records, Policy).
+
+cdt_put_many(_Cluster, _Namespace, _Set, _Records, _Policy) ->
     not_loaded(?LINE).
 
 -spec binary_remove(binary(), binary(), binary(), [binary()], integer()) -> 
     {ok, string()} | {error, string()}.
-binary_remove(_Namespace, _Set, _Key, _BinNameList, _TTL) ->
+binary_remove(Namespace, Set, Key, BinNameList, TTL) ->
+    binary_remove(cluster(), Namespace, Set, Key, BinNameList, TTL).
+
+binary_remove(Cluster, Namespace, Set, Key, BinNameList, TTL) ->
+    binary_remove(Cluster, Namespace, Set, Key, BinNameList, TTL, ?CLUSTER_POLICY).
+
+binary_remove(_Cluster, _Namespace, _Set, _Key, _BinNameList, _TTL, _Policy) ->
     not_loaded(?LINE).
 
 key_remove() ->
@@ -241,6 +617,12 @@ key_remove(Key) ->
 % @doc Removes Key from  Namesplace Set
 -spec key_remove(string(), string(), string()) -> {ok, string()} | {error, string()}.
 key_remove(Namespace, Set, Key) when is_list(Namespace), is_list(Set), is_list(Key) ->
+    key_remove(cluster(), Namespace, Set, Key).
+
+key_remove(Cluster, Namespace, Set, Key) ->
+    key_remove(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+key_remove(_Cluster, _Namespace, _Set, _Key, _Policy) ->
     not_loaded(?LINE).
 
 key_select() ->
@@ -258,6 +640,12 @@ key_select(Key, Lst) ->
 key_select(Namespace, Set, Key, Lst) when
     is_list(Namespace), is_list(Set), is_list(Key), is_list(Lst)
 ->
+    key_select(cluster(), Namespace, Set, Key, Lst).
+
+key_select(Cluster, Namespace, Set, Key, Lst) ->
+    key_select(Cluster, Namespace, Set, Key, Lst, ?CLUSTER_POLICY).
+
+key_select(_Cluster, _Namespace, _Set, _Key, _Lst, _Policy) ->
     not_loaded(?LINE).
 
 key_get() ->
@@ -269,32 +657,200 @@ key_get(Key) ->
 % Gets values of all Bin for Key in Namespace Set.
 -spec key_get(string(), string(), string()) -> {ok, [{string(), term()}]} | {error, string()}.
 key_get(Namespace, Set, Key) when is_list(Namespace), is_list(Set), is_list(Key) ->
+    key_get(cluster(), Namespace, Set, Key).
+
+key_get(Cluster, Namespace, Set, Key) ->
+    key_get(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+key_get(_Cluster, _Namespace, _Set, _Key, _Policy) ->
     not_loaded(?LINE).
 
 % Gets values of all Bin for Key in Namespace Set.
 -spec binary_get(binary(), binary(), binary()) -> {ok, [{binary(), term()}]} | {error, string()}.
 binary_get(Namespace, Set, Key) when is_binary(Namespace), is_binary(Set), is_binary(Key) ->
+    binary_get(cluster(), Namespace, Set, Key).
+
+binary_get(Cluster, Namespace, Set, Key) ->
+    binary_get(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+binary_get(_Cluster, _Namespace, _Set, _Key, _Policy) ->
     not_loaded(?LINE).
 
 cdt_get(Namespace, Set, Key) ->
-    cdt_get(Namespace, Set, Key, {0, 0, 30000, 1000}).
+    cdt_get(Namespace, Set, Key, ?DEFAULT_POLICY).
 % {MaxRetries, SleepBetweenRetries, SocketTimeout, TotalTimeout}  timeouts in milliseconds
--spec cdt_get(binary(), binary(), binary(), {integer(), integer(), integer(), integer()}) -> {ok, [{binary(), term()}]} | {error, string()}.
-cdt_get(Namespace, Set, Key, _Policy) when is_binary(Namespace), is_binary(Set), is_binary(Key) ->
+-spec cdt_get(binary(), binary(), binary(), policy()) -> {ok, [{binary(), term()}]} | {error, string()}.
+cdt_get(Namespace, Set, Key, Policy) when is_binary(Namespace), is_binary(Set), is_binary(Key) ->
+    cdt_get(cluster(), Namespace, Set, Key, Policy).
+
+cdt_get(_Cluster, _Namespace, _Set, _Key, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_get_live(Namespace, Set, Key, Bins) ->
+    cdt_get_live(Namespace, Set, Key, Bins, ?DEFAULT_POLICY).
+% cdt_get/4 of the map bins Bins without the subkeys whose WT + TTL has passed. Subkeys
+% with an entry in the expiry index Bin ++ "_exp" (see cdt_expiry_index/1) are dropped on the server.
+% Subkeys written before the index existed are still sent and only dropped while decoding,
+% until cdt_check_and_put/7 (or cdt_put/6 with the index on) indexes them; bins whose name is too
+% long for an index (more than 11 bytes) are not accepted.
+-spec cdt_get_live(binary(), binary(), binary(), [binary()], policy()) ->
+    {ok, [{binary(), [binary() | {term(), integer(), integer()}]}]} | {error, string()}.
+cdt_get_live(Namespace, Set, Key, Bins, Policy)
+        when is_binary(Namespace), is_binary(Set), is_binary(Key), is_list(Bins) ->
+    cdt_get_live(cluster(), Namespace, Set, Key, Bins, Policy).
+
+cdt_get_live(_Cluster, _Namespace, _Set, _Key, _Bins, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_get_subkeys(Namespace, Set, Key, Bin, SubKeys) ->
+    cdt_get_subkeys(Namespace, Set, Key, Bin, SubKeys, ?DEFAULT_POLICY).
+% Only the SubKeys entries of the map bin Bin, in the format of cdt_get/4 (in key order);
+% subkeys that do not exist are left out.
+-spec cdt_get_subkeys(binary(), binary(), binary(), binary(), [binary()], policy()) ->
+    {ok, [binary() | {term(), integer(), integer()}]} | {error, string()}.
+cdt_get_subkeys(Namespace, Set, Key, Bin, SubKeys, Policy)
+        when is_binary(Namespace), is_binary(Set), is_binary(Key), is_binary(Bin), is_list(SubKeys) ->
+    cdt_get_subkeys(cluster(), Namespace, Set, Key, Bin, SubKeys, Policy).
+
+cdt_get_subkeys(_Cluster, _Namespace, _Set, _Key, _Bin, _SubKeys, _Policy) ->
+    not_loaded(?LINE).
+
+% Gets values of all Bin for every key of Keys in Namespace Set with one batch request;
+% results are in the order of Keys.
+-spec binary_get_many(binary(), binary(), [binary()]) ->
+    {ok, [{ok, [{binary(), term()}]} | {error, string()}]} | {error, string()}.
+binary_get_many(Namespace, Set, Keys) when is_binary(Namespace), is_binary(Set), is_list(Keys) ->
+    binary_get_many(cluster(), Namespace, Set, Keys).
+
+binary_get_many(Cluster, Namespace, Set, Keys) ->
+    binary_get_many(Cluster, Namespace, Set, Keys, ?CLUSTER_POLICY).
+
+binary_get_many(_Cluster, _Namespace, _Set, _Keys, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_get_many(Namespace, Set, Keys) ->
+    cdt_get_many(Namespace, Set, Keys, ?DEFAULT_POLICY).
+% Batch version of cdt_get/4, results are in the order of Keys.
+-spec cdt_get_many(binary(), binary(), [binary()], policy()) ->
+    {ok, [{ok, [{binary(), term()}]} | {error, string()}]} | {error, string()}.
+cdt_get_many(Namespace, Set, Keys, Policy) when is_binary(Namespace), is_binary(Set), is_list(Keys) ->
+    cdt_get_many(cluster(), Namespace, Set, Keys, Policy).
+
+cdt_get_many(_Cluster, _Namespace, _Set, _Keys, _Policy) ->
     not_loaded(?LINE).
 
+% Not for records with compact entries, see cdt_compact/1.
 -spec cdt_expire(binary(), binary(), binary(), integer()) -> {ok, [{binary(), term()}]} | {error, string()}.
 cdt_expire(Namespace, Set, Key, TTL) when is_binary(Namespace), is_binary(Set), is_binary(Key), is_integer(TTL) ->
+    cdt_expire(cluster(), Namespace, Set, Key, TTL).
+
+cdt_expire(Cluster, Namespace, Set, Key, TTL) ->
+    cdt_expire(Cluster, Namespace, Set, Key, TTL, ?CLUSTER_POLICY).
+
+cdt_expire(_Cluster, _Namespace, _Set, _Key, _TTL, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_check_and_put(Namespace, Set, Key, Entry, Cap, TTL) ->
+    cdt_check_and_put(Namespace, Set, Key, Entry, Cap, TTL, ?DEFAULT_POLICY).
+% Frequency cap in one operate: removes the subkeys of Bin whose WT + TTL has passed, counts
+% the rest and puts SubKey only if Count < Cap. Written tells whether the put happened.
+% Expiry times come from the index Bin ++ "_exp" (see cdt_expiry_index/1); subkeys that are not in it
+% yet are indexed from their own TTL and WT first, which costs two more round trips once.
+% A subkey with TTL =< 0 does not expire.
+-spec cdt_check_and_put(binary(), binary(), binary(),
+        {Bin :: binary(), SubKey :: binary(), Value :: binary(), SubTTL :: integer()},
+        integer(), integer(), policy()) ->
+            {ok, Count :: integer(), Written :: boolean()} | {error, string()}.
+cdt_check_and_put(Namespace, Set, Key, Entry, Cap, TTL, Policy)
+        when is_binary(Namespace), is_binary(Set), is_binary(Key), is_tuple(Entry), is_integer(Cap), is_integer(TTL) ->
+    cdt_check_and_put(cluster(), Namespace, Set, Key, Entry, Cap, TTL, Policy).
+
+cdt_check_and_put(_Cluster, _Namespace, _Set, _Key, _Entry, _Cap, _TTL, _Policy) ->
     not_loaded(?LINE).
 
 -spec cdt_delete_by_keys(binary(), binary(), binary(), binary(), [binary()]) -> {ok, string()} | {error, string()}.
 cdt_delete_by_keys(Namespace, Set, Key, BinName, SubkeysList) when is_binary(Namespace), is_binary(Set), is_binary(Key), is_binary(BinName), is_list(SubkeysList) ->
+    cdt_delete_by_keys(cluster(), Namespace, Set, Key, BinName, SubkeysList).
+
+cdt_delete_by_keys(Cluster, Namespace, Set, Key, BinName, SubkeysList) ->
+    cdt_delete_by_keys(Cluster, Namespace, Set, Key, BinName, SubkeysList, ?CLUSTER_POLICY).
+
+cdt_delete_by_keys(_Cluster, _Namespace, _Set, _Key, _BinName, _SubkeysList, _Policy) ->
     not_loaded(?LINE).
 
 -spec cdt_delete_by_keys_batch(binary(), binary(), binary(), [{binary(), [binary()]}]) -> {ok, [integer()]} | {error, string()}.
 cdt_delete_by_keys_batch(Namespace, Set, BinName, KeysSubkeysList) when is_binary(Namespace), is_binary(Set), is_binary(BinName), is_list(KeysSubkeysList) ->
+    cdt_delete_by_keys_batch(cluster(), Namespace, Set, BinName, KeysSubkeysList).
+
+cdt_delete_by_keys_batch(Cluster, Namespace, Set, BinName, KeysSubkeysList) ->
+    cdt_delete_by_keys_batch(Cluster, Namespace, Set, BinName, KeysSubkeysList, ?CLUSTER_POLICY).
+
+cdt_delete_by_keys_batch(_Cluster, _Namespace, _Set, _BinName, _KeysSubkeysList, _Policy) ->
     not_loaded(?LINE).
 
+% -------------------------------------------------------------------------------
+% Async API: functions return {ok, Ref} as soon as the command is queued on the
+% client event loop, the result is sent later to the caller as {aspike, Ref, Result}
+% where Result is the same as for the blocking function.
+
+% @doc Async binary_get/3
+-spec binary_get_async(binary(), binary(), binary()) -> {ok, reference()} | {error, string()}.
+binary_get_async(Namespace, Set, Key) when is_binary(Namespace), is_binary(Set), is_binary(Key) ->
+    binary_get_async(cluster(), Namespace, Set, Key).
+
+binary_get_async(Cluster, Namespace, Set, Key) ->
+    binary_get_async(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+binary_get_async(_Cluster, _Namespace, _Set, _Key, _Policy) ->
+    not_loaded(?LINE).
+
+% @doc Async binary_put/5
+-spec binary_put_async(binary(), binary(), binary(), [{binary(), binary()|integer()|[integer()]}], integer()) ->
+    {ok, reference()} | {error, string()}.
+binary_put_async(Namespace, Set, Key, BinList, TTL) ->
+    binary_put_async(cluster(), Namespace, Set, Key, BinList, TTL).
+
+binary_put_async(Cluster, Namespace, Set, Key, BinList, TTL) ->
+    binary_put_async(Cluster, Namespace, Set, Key, BinList, TTL, ?CLUSTER_POLICY).
+
+binary_put_async(_Cluster, _Namespace, _Set, _Key, _BinList, _TTL, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_get_async(Namespace, Set, Key) ->
+    cdt_get_async(Namespace, Set, Key, ?DEFAULT_POLICY).
+% @doc Async cdt_get/4
+-spec cdt_get_async(binary(), binary(), binary(), policy()) ->
+    {ok, reference()} | {error, string()}.
+cdt_get_async(Namespace, Set, Key, Policy) when is_binary(Namespace), is_binary(Set), is_binary(Key) ->
+    cdt_get_async(cluster(), Namespace, Set, Key, Policy).
+
+cdt_get_async(_Cluster, _Namespace, _Set, _Key, _Policy) ->
+    not_loaded(?LINE).
+
+cdt_put_async(Namespace, Set, Key, BinList, TTL) ->
+    cdt_put_async(Namespace, Set, Key, BinList, TTL, ?DEFAULT_POLICY).
+% @doc Async cdt_put/6
+-spec cdt_put_async(binary(), binary(), binary(),
+        [{binary(), [binary()|integer()]}], integer(),
+        policy()) ->
+            {ok, reference()} | {error, string()}.
+cdt_put_async(Namespace, Set, Key, BinList, TTL, Policy) ->
+    cdt_put_async(cluster(), Namespace, Set, Key, BinList, TTL, Policy).
+
+cdt_put_async(_Cluster, _Namespace, _Set, _Key, _BinList, _TTL, _Policy) ->
+    not_loaded(?LINE).
+
+% @doc Waits for the result of an *_async call, e.g. await(binary_get_async(Ns, Set, Key), 1000)
+-spec await({ok, reference()} | {error, string()}, timeout()) -> term().
+await({ok, Ref}, Timeout) ->
+    receive
+        {aspike, Ref, Result} -> Result
+    after Timeout ->
+        {error, timeout}
+    end;
+await(Error, _Timeout) ->
+    Error.
+
 key_generation() ->
     key_generation(?DEFAULT_KEY).
 
@@ -304,20 +860,32 @@ key_generation(Key) ->
 % Gets Generation number and TTL for Key in Namespace Set.
 -spec key_generation(string(), string(), string()) -> {ok, map()} | {error, string()}.
 key_generation(Namespace, Set, Key) when is_list(Namespace), is_list(Set), is_list(Key) ->
+    key_generation(cluster(), Namespace, Set, Key).
+
+key_generation(Cluster, Namespace, Set, Key) ->
+    key_generation(Cluster, Namespace, Set, Key, ?CLUSTER_POLICY).
+
+key_generation(_Cluster, _Namespace, _Set, _Key, _Policy) ->
     not_loaded(?LINE).
 
 % @doc Returns random node in form {Address:Port}, for example: {{127,0,0,1},3010}
 -spec node_random() -> {ok, {inet:ip_address(), non_neg_integer()}} | {error, term()}.
 node_random() ->
-    as_render:node_render(nif_node_random()).
+    node_random(cluster()).
+
+node_random(Cluster) ->
+    as_render:node_render(nif_node_random(Cluster)).
 
-nif_node_random() ->
+nif_node_random(_Cluster) ->
     not_loaded(?LINE).
 
 % @doc Returns list of node names and addresses.
 -spec node_names() -> {ok, [{string(), {inet:ip_address(), non_neg_integer()}}]} | {error, term()}.
 node_names() ->
-    case nif_node_names() of
+    node_names(cluster()).
+
+node_names(Cluster) ->
+    case nif_node_names(Cluster) of
         {ok, L} ->
             T = [{N, as_render:node_render({ok, A})} || {N, A} <- L],
             {ok, [{N, Y} || {N, {X, Y}} <- T, X == ok]};
@@ -325,25 +893,31 @@ node_names() ->
             Any
     end.
 
-nif_node_names() ->
+nif_node_names(_Cluster) ->
     not_loaded(?LINE).
 
 % @doc Returns node in form {Address:Port}, for example: {{127,0,0,1},3010}
 -spec node_get(string()) -> {ok, {inet:ip_address(), non_neg_integer()}} | {error, term()}.
-node_get(NodeName) when is_list(NodeName) ->
-    as_render:node_render(nif_node_get(NodeName)).
+node_get(NodeName) ->
+    node_get(cluster(), NodeName).
+
+node_get(Cluster, NodeName) when is_list(NodeName) ->
+    as_render:node_render(nif_node_get(Cluster, NodeName)).
 
-nif_node_get(NodeName) when is_list(NodeName) ->
+nif_node_get(_Cluster, _) ->
     not_loaded(?LINE).
 
 % @doc Returns information about Item for NodeName
 % Useful Items:
 % "bins", "sets", "node", "namespaces", "udf-list", "sindex-list:", "edition", "get-config"
 -spec node_info(string(), string()) -> {ok, {string(), map()}} | {error, string()}.
-node_info(NodeName, Item) when is_list(NodeName), is_list(Item) ->
-    as_render:info_render(nif_node_info(NodeName, Item), Item).
+node_info(NodeName, Item) ->
+    node_info(cluster(), NodeName, Item).
 
-nif_node_info(_, _) ->
+node_info(Cluster, NodeName, Item) when is_list(NodeName), is_list(Item) ->
+    as_render:info_render(nif_node_info(Cluster, NodeName, Item), Item).
+
+nif_node_info(_Cluster, _, _) ->
     not_loaded(?LINE).
 
 help() ->
@@ -353,10 +927,13 @@ help() ->
 % Useful Items:
 % "bins", "sets", "node", "namespaces", "udf-list", "sindex-list:", "edition", "get-config"
 -spec help(string()) -> {ok, {string(), map()}} | {error, string()}.
-help(Item) when is_list(Item) ->
-    as_render:info_render(nif_help(Item), Item).
+help(Item) ->
+    help(cluster(), Item).
+
+help(Cluster, Item) when is_list(Item) ->
+    as_render:info_render(nif_help(Cluster, Item), Item).
 
-nif_help(_) ->
+nif_help(_Cluster, _) ->
     not_loaded(?LINE).
 
 -spec host_info(string()) -> {ok, [string()]} | {error, string()}.
@@ -368,10 +945,13 @@ host_info(Item) ->
 % "bins", "sets", "node", "namespaces", "udf-list", "sindex-list:", "edition", "get-config"
 -spec host_info(string(), non_neg_integer(), string()) ->
     {ok, {string(), map()}} | {error, string()}.
-host_info(HostName, Port, Item) when is_list(HostName), is_integer(Port), is_list(Item) ->
-    as_render:info_render(nif_host_info(HostName, Port, Item), Item).
+host_info(HostName, Port, Item) ->
+    host_info(cluster(), HostName, Port, Item).
 
-nif_host_info(_, _, _) ->
+host_info(Cluster, HostName, Port, Item) when is_list(HostName), is_integer(Port), is_list(Item) ->
+    as_render:info_render(nif_host_info(Cluster, HostName, Port, Item), Item).
+
+nif_host_info(_Cluster, _, _, _) ->
     not_loaded(?LINE).
 
 % @doc Shortcut for testing
@@ -393,7 +973,10 @@ a_key_put() ->
 a_key_put(Rep) ->
     a_key_put("erl-bin-nif", 999, ?DEFAULT_NAMESPACE, ?DEFAULT_SET, ?DEFAULT_KEY, Rep).
 
-a_key_put(_, _, _, _, _, _) ->
+a_key_put(Bin, Val, Namespace, Set, Key, Rep) ->
+    a_key_put(cluster(), Bin, Val, Namespace, Set, Key, Rep).
+
+a_key_put(_Cluster, _Bin, _Val, _Namespace, _Set, _Key, _Rep) ->
     not_loaded(?LINE).
 
 foo(_X) ->
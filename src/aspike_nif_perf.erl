@@ -26,7 +26,8 @@
    cdt_del_batch_test/5,
    cdt_get_test/4,
    pool_cdt_insert/1,
-   pool_cdt_read/1
+   pool_cdt_read/1,
+   cdt_coalesce_test/4
 ]).
 
 
@@ -100,6 +101,25 @@ cdt_insert_test(N, NKeys, NSKeys, TTL, Timeout) ->
 
     cdt_insert_test(N-1, NKeys, NSKeys, TTL, Timeout).
 
+% NProc processes put N subkeys each to NKeys keys with write coalescing of Window ms,
+% returns {Time, Puts, Batches}: Batches well below Puts shows the puts were merged
+cdt_coalesce_test(NProc, N, NKeys, Window) ->
+    ok = aspike_nif:coalesce_config(#{window => Window}),
+    #{batches := B0, puts := P0} = aspike_nif:coalesce_stats(),
+    Self = self(),
+    T1 = erlang:system_time(microsecond),
+    Pids = lists:map(fun(_) ->
+        spawn(fun() ->
+            cdt_insert_test(N, NKeys, N, 3600, 0),
+            Self ! {coalesce_done, self()}
+        end)
+    end, lists:seq(1, NProc)),
+    [receive {coalesce_done, Pid} -> ok end || Pid <- Pids],
+    T = erlang:system_time(microsecond) - T1,
+    #{batches := B1, puts := P1} = aspike_nif:coalesce_stats(),
+    ok = aspike_nif:coalesce_config(#{window => 0}),
+    {T, P1 - P0, B1 - B0}.
+
 % single process insert
 sp_insert(N) ->
    sp_insert(<<"global-store">>, <<"rtb-gateway-fcap-users">>, N, 3600, 10).
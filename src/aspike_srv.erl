@@ -132,7 +132,7 @@ command(Cmd) ->
 % Is called automatically during init
 -spec aerospike_init() -> {ok, string()} | {error, string()}.
 aerospike_init() ->
-    command({aerospike_init}).
+    command({aerospike_init, shm_opts()}).
 
 -spec host_add() -> {ok, string()} | {error, string()}.
 host_add() ->
@@ -371,7 +371,8 @@ bar(X) ->
 -spec init(string()) -> {ok, state()}.
 init(ExtPrg) ->
     process_flag(trap_exit, true),
-    Port = open_port({spawn_executable, ExtPrg}, [{packet, 2}, binary, nouse_stdio]),
+    Port = open_port({spawn_executable, ExtPrg}, [{packet, 4}, binary, nouse_stdio,
+        {args, port_args()}]),
     spawn(fun aerospike_init/0),
     {ok, #state{ext_prg = ExtPrg, port = Port}}.
 
@@ -386,7 +387,7 @@ handle_call(Msg, _From, State) ->
     {noreply, State}.
 
 handle_cast({command, Msg}, State = #state{port = Port}) ->
-    Port ! {self(), {command, term_to_binary(Msg)}},
+    Port ! {self(), {command, [<<0:32>>, term_to_binary(Msg)]}},
     {noreply, State};
 handle_cast(Msg, State) ->
     io:format("~p:~p Msg = ~p~n", [?MODULE, ?FUNCTION_NAME, Msg]),
@@ -404,13 +405,40 @@ terminate(_Reason, _State) ->
 % -------------------------------------------------------------------------------
 -spec call_port(pid(), pid(), term()) -> {ok, term()} | {error, timeout}.
 call_port(Caller, Port, Msg) ->
+    ReqId = req_id(),
     TbMsg = term_to_binary(Msg),
-    Port ! {self(), {command, TbMsg}},
+    Port ! {self(), {command, [<<ReqId:32>>, TbMsg]}},
     receive
-        {_Port, {data, Data}} -> Caller ! binary_to_term(Data)
+        {Port, {data, <<ReqId:32, Data/binary>>}} -> Caller ! binary_to_term(Data)
     after ?DEFAULT_TIMEOUT -> {error, timeout_is_out}
     end.
 
+% Every command goes to the port as <<ReqId:32, ETF/binary>> and the reply comes back
+% with the same ReqId, the port runs commands on several threads and may reply out of order.
+-spec req_id() -> non_neg_integer().
+req_id() ->
+    erlang:unique_integer([positive]) band 16#FFFFFFFF.
+
+% {UseShm, ShmKey, ShmMaxNodes, ShmMaxNamespaces, ShmTakeoverThresholdSec}
+% with use_shm all port processes on the host share one cluster tend thread
+% and partition map in the shared memory segment shm_key
+-spec shm_opts() -> {boolean(), integer(), integer(), integer(), integer()}.
+shm_opts() ->
+    {?DEFAULT_USE_SHM, ?DEFAULT_SHM_KEY, ?DEFAULT_SHM_MAX_NODES,
+     ?DEFAULT_SHM_MAX_NAMESPACES, ?DEFAULT_SHM_TAKEOVER_THRESHOLD_SEC}.
+
+-spec port_args() -> [string()].
+port_args() ->
+    Threads = ["--threads", integer_to_list(?DEFAULT_PORT_THREADS)],
+    Index = case ?DEFAULT_PORT_EXPIRY_INDEX of
+        true -> ["--expiry-index" | Threads];
+        false -> Threads
+    end,
+    case ?DEFAULT_PORT_ASYNC of
+        true -> ["--async" | Index];
+        false -> Index
+    end.
+
 % -------------------------------------------------------------------------------
     % aql -h 127.0.0.1:3010
     % asadm -e info
@@ -107,7 +107,9 @@
 
 -record(state, {
     ext_prg :: string(),
-    port :: port()
+    port :: port(),
+    % commands sent to the port and not answered yet
+    pending = #{} :: #{non_neg_integer() => {{pid(), term()}, reference()}}
 }).
 
 -type state() :: #state{}.
@@ -140,9 +142,10 @@ start_link() ->
 -spec command(term()) -> term().
 command(Cmd) ->
     Pid = pooler:take_member(?POOLNAME),
-    Ret = gen_server:call(Pid, {command, Cmd}, ?DEFAULT_TIMEOUT + 10),
+    % a worker pipelines any number of commands over its port,
+    % so it goes back to the pool before the call, not after it
     pooler:return_member(?POOLNAME, Pid, ok),
-    Ret.
+    gen_server:call(Pid, {command, Cmd}, ?DEFAULT_TIMEOUT + 10).
 
 % @doc Initialises port (c level) global variables.
 % Is called automatically during init
@@ -430,26 +433,29 @@ binary_remove(Namespace, Set, Key, BinNameList, TTL) ->
 init(ExtPrg) ->
     io:format("WORKER starting ~p ~p ~n", [self(), ExtPrg]),
     process_flag(trap_exit, true),
-    Port = open_port({spawn_executable, ExtPrg}, [{packet, 2}, binary, nouse_stdio]),
+    Port = open_port({spawn_executable, ExtPrg}, [{packet, 4}, binary, nouse_stdio,
+        {args, port_args()}]),
     Pid = self(),
     spawn(fun() -> aspike_srv_worker:aerospike_init(Pid) end),
     {ok, #state{ext_prg = ExtPrg, port = Port}}.
 
-handle_call({command, {aerospike_init}}, {Caller, _}, State = #state{port = Port}) ->
-    Res = call_port(Caller, Port, {aerospike_init}),
+handle_call({command, {aerospike_init}}, _From, State = #state{port = Port}) ->
+    Res = call_port(Port, {aerospike_init, shm_opts()}),
     {ok, Host} = application:get_env(aspike_port, host),
     {ok, Prt} = application:get_env(aspike_port, port),
-    AHRet = call_port(Caller, Port, {host_add, Host, Prt}),
+    AHRet = call_port(Port, {host_add, Host, Prt}),
     User = application:get_env(aspike_port, user, undefined),
     Password = application:get_env(aspike_port, psw, undefined),
     ConnRet = case {User, Password} of
-        {undefined, undefined} -> call_port(Caller, Port, {anon_connect});
-        _ -> call_port(Caller, Port, {connect, User, Password})
+        {undefined, undefined} -> call_port(Port, {anon_connect});
+        _ -> call_port(Port, {connect, User, Password})
     end,
     {reply, {Res, AHRet, ConnRet}, State};
-handle_call({command, Msg}, {Caller, _}, State = #state{port = Port}) ->
-    Res = call_port(Caller, Port, Msg),
-    {reply, Res, State};
+handle_call({command, Msg}, From, State = #state{port = Port, pending = Pending}) ->
+    ReqId = req_id(),
+    Port ! {self(), {command, [<<ReqId:32>>, as_proto:encode(Msg)]}},
+    TRef = erlang:send_after(?DEFAULT_TIMEOUT, self(), {req_timeout, ReqId}),
+    {noreply, State#state{pending = Pending#{ReqId => {From, TRef}}}};
 handle_call(port_info, _, State = #state{port = Port}) ->
     Res = erlang:port_info(Port),
     {reply, Res, State};
@@ -458,12 +464,33 @@ handle_call(Msg, _From, State) ->
     {noreply, State}.
 
 handle_cast({command, Msg}, State = #state{port = Port}) ->
-    Port ! {self(), {command, term_to_binary(Msg)}},
+    Port ! {self(), {command, [<<0:32>>, term_to_binary(Msg)]}},
     {noreply, State};
 handle_cast(Msg, State) ->
     io:format("~p:~p Msg = ~p~n", [?MODULE, ?FUNCTION_NAME, Msg]),
     {noreply, State}.
 
+handle_info({Port, {data, <<ReqId:32, Data/binary>>}}, State = #state{port = Port, pending = Pending}) ->
+    case maps:take(ReqId, Pending) of
+        {{From, TRef}, Pending1} ->
+            erlang:cancel_timer(TRef),
+            gen_server:reply(From, binary_to_term(Data)),
+            {noreply, State#state{pending = Pending1}};
+        error ->
+            % reply to a cast or to a command that is timed out already
+            {noreply, State}
+    end;
+handle_info({req_timeout, ReqId}, State = #state{pending = Pending}) ->
+    case maps:take(ReqId, Pending) of
+        {{From, _}, Pending1} ->
+            gen_server:reply(From, {error, timeout_is_out}),
+            {noreply, State#state{pending = Pending1}};
+        error ->
+            {noreply, State}
+    end;
+handle_info({'EXIT', Port, Reason}, State = #state{port = Port, pending = Pending}) ->
+    [gen_server:reply(From, {error, port_closed}) || {From, _} <- maps:values(Pending)],
+    {stop, Reason, State#state{pending = #{}}};
 handle_info(Msg, State) ->
     io:format("~p:~p Msg = ~p~n", [?MODULE, ?FUNCTION_NAME, Msg]),
     {noreply, State}.
@@ -474,15 +501,43 @@ terminate(_Reason, _State) ->
 % -------------------------------------------------------------------------------
 % helpers
 % -------------------------------------------------------------------------------
--spec call_port(pid(), pid(), term()) -> {ok, term()} | {error, timeout}.
-call_port(Caller, Port, Msg) ->
-    TbMsg = term_to_binary(Msg),
-    Port ! {self(), {command, TbMsg}},
+% Blocking call, only for the connection setup in aerospike_init,
+% the other commands are answered from handle_info
+-spec call_port(port(), term()) -> term() | {error, timeout_is_out}.
+call_port(Port, Msg) ->
+    ReqId = req_id(),
+    Port ! {self(), {command, [<<ReqId:32>>, as_proto:encode(Msg)]}},
     receive
-        {_Port, {data, Data}} -> Caller ! binary_to_term(Data)
+        {Port, {data, <<ReqId:32, Data/binary>>}} -> binary_to_term(Data)
     after ?DEFAULT_TIMEOUT -> {error, timeout_is_out}
     end.
 
+% Every command goes to the port as <<ReqId:32, Frame/binary>> (ETF or as_proto) and the reply comes back
+% with the same ReqId, the port runs commands on several threads and may reply out of order.
+-spec req_id() -> non_neg_integer().
+req_id() ->
+    erlang:unique_integer([positive]) band 16#FFFFFFFF.
+
+% {UseShm, ShmKey, ShmMaxNodes, ShmMaxNamespaces, ShmTakeoverThresholdSec}
+% with use_shm all port processes on the host share one cluster tend thread
+% and partition map in the shared memory segment shm_key
+-spec shm_opts() -> {boolean(), integer(), integer(), integer(), integer()}.
+shm_opts() ->
+    {?DEFAULT_USE_SHM, ?DEFAULT_SHM_KEY, ?DEFAULT_SHM_MAX_NODES,
+     ?DEFAULT_SHM_MAX_NAMESPACES, ?DEFAULT_SHM_TAKEOVER_THRESHOLD_SEC}.
+
+-spec port_args() -> [string()].
+port_args() ->
+    Threads = ["--threads", integer_to_list(?DEFAULT_PORT_THREADS)],
+    Index = case ?DEFAULT_PORT_EXPIRY_INDEX of
+        true -> ["--expiry-index" | Threads];
+        false -> Threads
+    end,
+    case ?DEFAULT_PORT_ASYNC of
+        true -> ["--async" | Index];
+        false -> Index
+    end.
+
 % -------------------------------------------------------------------------------
     % aql -h 127.0.0.1:3010
     % asadm -e info